@@ -39,10 +39,19 @@ typedef unsigned spinlock_data_t;
 /* Initializer for use by SPINLOCK_INITIALIZER */
 #define SPINLOCK_DATA_INITIALIZER	0
 
-/* Atomic operations on spinlock_data_t */
+/*
+ * Atomic operations on spinlock_data_t. swap stores VAL and returns
+ * the old value; compareandswap stores NEWVAL only if the old value
+ * was OLDVAL, and returns the old value either way.
+ */
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd,
+				   spinlock_data_t val);
+spinlock_data_t spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+					     spinlock_data_t oldval,
+					     spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +102,53 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Unlike testandset, this can't give up if the SC fails, so
+	 * loop until it succeeds.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"move %1, %3;"		/*   y = val */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (sd), "r" (val) : "memory");
+	return x;
+}
+
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_compareandswap(volatile spinlock_data_t *sd,
+			     spinlock_data_t oldval, spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"bne %0, %3, 2f;"	/*   give up if x != oldval */
+		"move %1, %4;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if it failed */
+		"2:;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (sd), "r" (oldval), "r" (newval) : "memory");
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -39,6 +39,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <trace.h>
 
 
 /* in exception.S */
@@ -184,7 +185,24 @@ mips_trap(struct trapframe *tf)
 			doadjust = false;
 		}
 
+		/* For the profiler, if hardclock is what this is. */
+		curcpu->c_intrpc = tf->tf_epc;
+		curcpu->c_intruser = !iskern;
+
+		/*
+		 * Only now is it safe for TRACE and thread_chargetime
+		 * to use spl. Time taking an interrupt that came from
+		 * user mode is charged as system time.
+		 */
+		if (!iskern) {
+			thread_chargetime(true);
+		}
+		TRACE(TRACE_IRQ, 0, tf->tf_cause, tf->tf_epc);
 		mainbus_interrupt(tf);
+		TRACE(TRACE_IRQDONE, 0, 0, 0);
+		if (!iskern) {
+			thread_chargetime(false);
+		}
 
 		if (doadjust) {
 			KASSERT(curthread->t_curspl == IPL_HIGH);
@@ -194,6 +212,10 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+		if (!iskern) {
+			/* Check for _exit from another thread; see below. */
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -209,6 +231,10 @@ mips_trap(struct trapframe *tf)
 	 * sync, then restoring the previous state.
 	 */
 	spl = splhigh();
+	if (!iskern) {
+		/* Until now the thread was running in user mode. */
+		thread_chargetime(true);
+	}
 	splx(spl);
 
 	/* Syscall? Call the syscall handler and return. */
@@ -229,6 +255,10 @@ mips_trap(struct trapframe *tf)
 	 * Call vm_fault on the TLB exceptions.
 	 * Panic on the bus error exceptions.
 	 */
+	if (code == EX_MOD || code == EX_TLBL || code == EX_TLBS) {
+		TRACE(TRACE_FAULT, code, tf->tf_vaddr, tf->tf_epc);
+		curthread->t_usage.tu_minflt++;
+	}
 	switch (code) {
 	case EX_MOD:
 		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
@@ -314,6 +344,25 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#ifdef UW
+	/*
+	 * On the way back to user mode, leave if another thread of the
+	 * process is in _exit. The timer interrupt gets here too, so
+	 * threads that never make syscalls still notice.
+	 */
+	if (!iskern) {
+		uthread_checkexit();
+	}
+#endif
+	/*
+	 * Charge the time since coming in from user mode as system
+	 * time. (The interrupt code above has done this already.)
+	 */
+	if (!iskern && code != EX_IRQ) {
+		spl = splhigh();
+		thread_chargetime(false);
+		splx(spl);
+	}
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -362,6 +411,7 @@ mips_trap(struct trapframe *tf)
  * following places:
  *    - enter_new_process, for use by exec and equivalent.
  *    - enter_forked_process, in syscall.c, for use by fork.
+ *    - enter_new_thread, for use by thread_create.
  */
 void
 mips_usermode(struct trapframe *tf)
@@ -372,7 +422,12 @@ mips_usermode(struct trapframe *tf)
 	 * user mode. However, while in user mode, interrupts should
 	 * be on. To interact properly with the spl-handling logic
 	 * above, we explicitly call spl0() and then call cpu_irqoff().
+	 *
+	 * First, charge the time spent in the kernel; that has to be
+	 * done at splhigh.
 	 */
+	splhigh();
+	thread_chargetime(false);
 	spl0();
 	cpu_irqoff();
 
@@ -429,3 +484,28 @@ enter_new_process(int argc, userptr_t argv, vaddr_t stack, vaddr_t entry)
 
 	mips_usermode(&tf);
 }
+
+/*
+ * enter_new_thread: go to user mode as a new thread of the current
+ * process. Like enter_new_process, but the new thread also needs the
+ * global pointer its creator was using, or it won't find the
+ * program's small data.
+ */
+void
+enter_new_thread(vaddr_t entry, vaddr_t arg0, vaddr_t arg1, vaddr_t stack,
+		 vaddr_t gp)
+{
+	struct trapframe tf;
+
+	bzero(&tf, sizeof(tf));
+
+	tf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	tf.tf_epc = entry;
+	tf.tf_a0 = arg0;
+	tf.tf_a1 = arg1;
+	/* Leave room for ENTRYPOINT to save its argument registers. */
+	tf.tf_sp = stack - 16;
+	tf.tf_gp = gp;
+
+	mips_usermode(&tf);
+}
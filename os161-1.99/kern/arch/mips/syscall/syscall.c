@@ -35,6 +35,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <trace.h>
 
 
 /*
@@ -99,6 +100,8 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
+	TRACE(TRACE_SYSCALL, callno, curthread, 0);
+
 	switch (callno) {
 	    case SYS_reboot:
 		err = sys_reboot(tf->tf_a0);
@@ -129,6 +132,42 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_wait4:
+	  err = sys_wait4((pid_t)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (userptr_t)tf->tf_a3,
+			  (pid_t *)&retval);
+	  break;
+	case SYS_getrusage:
+	  err = sys_getrusage((int)tf->tf_a0,
+			      (userptr_t)tf->tf_a1);
+	  break;
+	case SYS___thread_create:
+	  err = sys___thread_create((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1,
+				    (userptr_t)tf->tf_a2,
+				    (vaddr_t)tf->tf_gp,
+				    (int *)&retval);
+	  break;
+	case SYS_thread_exit:
+	  sys_thread_exit((userptr_t)tf->tf_a0);
+	  /* sys_thread_exit does not return either */
+	  panic("unexpected return from sys_thread_exit");
+	  break;
+	case SYS_thread_join:
+	  err = sys_thread_join((int)tf->tf_a0,
+				(userptr_t)tf->tf_a1);
+	  break;
+	case SYS_futex_wait:
+	  err = sys_futex_wait((userptr_t)tf->tf_a0,
+			       (int)tf->tf_a1);
+	  break;
+	case SYS_futex_wake:
+	  err = sys_futex_wake((userptr_t)tf->tf_a0,
+			       (int)tf->tf_a1,
+			       (int *)&retval);
+	  break;
 #endif // UW
 
 	    /* Add stuff here */
@@ -140,6 +179,8 @@ syscall(struct trapframe *tf)
 	}
 
 
+	TRACE(TRACE_SYSRET, callno, curthread, err);
+
 	if (err) {
 		/*
 		 * Return the error code. This gets converted at
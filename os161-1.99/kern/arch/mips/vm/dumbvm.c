@@ -37,6 +37,9 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <buddy.h>
+#include <pagecache.h>
+#include <workqueue.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -46,15 +49,40 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+/*
+ * Threads other than the first get 16k each. Thread stacks go below
+ * the main one, with an unmapped guard page under each stack so an
+ * overflow faults instead of running into the next one.
+ */
+#define DUMBVM_TSTACKPAGES   4
+#define DUMBVM_TSTACKTOP(slot) \
+	(USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE - \
+	 ((slot) - 1) * (DUMBVM_TSTACKPAGES + 1) * PAGE_SIZE - PAGE_SIZE)
+#define DUMBVM_TSTACKBASE(slot) \
+	(DUMBVM_TSTACKTOP(slot) - DUMBVM_TSTACKPAGES * PAGE_SIZE)
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/* Set once the buddy allocator has taken over; protected by stealmem_lock */
+static bool vm_bootstrapped = false;
+
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	paddr_t lo, hi;
+
+	/*
+	 * Hand the rest of physical memory to the buddy allocator.
+	 * Pages stolen before now stay allocated forever.
+	 */
+	spinlock_acquire(&stealmem_lock);
+	ram_getsize(&lo, &hi);
+	buddy_bootstrap(lo, hi);
+	vm_bootstrapped = true;
+	spinlock_release(&stealmem_lock);
 }
 
 static
@@ -64,10 +92,18 @@ getppages(unsigned long npages)
 	paddr_t addr;
 
 	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-	
+	if (!vm_bootstrapped) {
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
+	}
 	spinlock_release(&stealmem_lock);
+
+	addr = buddy_alloc(npages);
+	if (addr == 0 && pagecache_reclaim(npages) > 0) {
+		/* Got some clean file pages back; try again. */
+		addr = buddy_alloc(npages);
+	}
 	return addr;
 }
 
@@ -86,9 +122,8 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	buddy_free(addr - MIPS_KSEG0);
 }
 
 void
@@ -104,10 +139,71 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * Find the physical address for VADDR if it's in one of the thread
+ * stacks. Returns 0 if it isn't.
+ */
+static
+paddr_t
+dumbvm_threadstack_paddr(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned slot;
+
+	for (slot=1; slot<THREAD_MAX; slot++) {
+		if (vaddr >= DUMBVM_TSTACKBASE(slot) &&
+		    vaddr < DUMBVM_TSTACKTOP(slot)) {
+			if (as->as_tstackpbase[slot] == 0) {
+				return 0;
+			}
+			return (vaddr - DUMBVM_TSTACKBASE(slot)) +
+				as->as_tstackpbase[slot];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the physical address VADDR maps to in AS, or 0 if it isn't
+ * mapped. A region that has no pages yet (no physical memory behind
+ * it, or no second segment at all) maps nothing.
+ */
+static
+paddr_t
+dumbvm_translate(struct addrspace *as, vaddr_t vaddr)
+{
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	stacktop = USERSTACK;
+
+	if (vaddr >= vbase1 && vaddr < vtop1) {
+		if (as->as_pbase1 == 0) {
+			return 0;
+		}
+		return (vaddr - vbase1) + as->as_pbase1;
+	}
+	else if (vaddr >= vbase2 && vaddr < vtop2) {
+		if (as->as_pbase2 == 0) {
+			return 0;
+		}
+		return (vaddr - vbase2) + as->as_pbase2;
+	}
+	else if (vaddr >= stackbase && vaddr < stacktop) {
+		if (as->as_stackpbase == 0) {
+			return 0;
+		}
+		return (vaddr - stackbase) + as->as_stackpbase;
+	}
+	return dumbvm_threadstack_paddr(as, vaddr);
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
@@ -161,23 +257,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
+	paddr = dumbvm_translate(as, faultaddress);
+	if (paddr == 0) {
 		return EFAULT;
 	}
 
@@ -208,6 +289,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 struct addrspace *
 as_create(void)
 {
+	unsigned i;
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
 		return NULL;
@@ -220,6 +302,9 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	for (i=0; i<THREAD_MAX; i++) {
+		as->as_tstackpbase[i] = 0;
+	}
 
 	return as;
 }
@@ -227,9 +312,40 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	unsigned i;
+
+	/* Any of these may be 0 if as_prepare_load failed partway. */
+	if (as->as_pbase1 != 0) {
+		buddy_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		buddy_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		buddy_free(as->as_stackpbase);
+	}
+	for (i=0; i<THREAD_MAX; i++) {
+		if (as->as_tstackpbase[i] != 0) {
+			buddy_free(as->as_tstackpbase[i]);
+		}
+	}
 	kfree(as);
 }
 
+static
+void
+as_reap(void *data)
+{
+	as_destroy(data);
+}
+
+void
+as_destroy_later(struct addrspace *as)
+{
+	work_init(&as->as_reapwork, as_reap, as);
+	workqueue_submit(workqueue_system, &as->as_reapwork);
+}
+
 void
 as_activate(void)
 {
@@ -351,6 +467,46 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Only the thread creating thread SLOT touches as_tstackpbase[SLOT]
+ * (the process hands out slots), so this doesn't need a lock.
+ */
+int
+as_define_threadstack(struct addrspace *as, unsigned slot, vaddr_t *stackptr)
+{
+	KASSERT(slot > 0 && slot < THREAD_MAX);
+
+	if (as->as_tstackpbase[slot] == 0) {
+		as->as_tstackpbase[slot] = getppages(DUMBVM_TSTACKPAGES);
+		if (as->as_tstackpbase[slot] == 0) {
+			return ENOMEM;
+		}
+	}
+	/* Don't let a new thread see what the last one left behind. */
+	as_zero_region(as->as_tstackpbase[slot], DUMBVM_TSTACKPAGES);
+
+	*stackptr = DUMBVM_TSTACKTOP(slot);
+	return 0;
+}
+
+/*
+ * Nothing under dumbvm ever moves or unmaps a page while the address
+ * space exists, so the answer stays good until as_destroy.
+ */
+int
+as_translate(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
+{
+	paddr_t paddr;
+
+	/* Regions that aren't set up (yet) translate to 0. */
+	paddr = dumbvm_translate(as, vaddr & PAGE_FRAME);
+	if (paddr == 0) {
+		return EFAULT;
+	}
+	*ret = paddr | (vaddr & ~PAGE_FRAME);
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -73,6 +73,23 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the on-chip timer from zero. Unlike mips_timer_set alone,
+ * this works no matter how far c0_count has got; $9 is c0_count.
+ */
+static
+void
+mips_timer_restart(uint32_t count)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* zero the counter */
+		"mtc0 %0, $11;"		/* set the compare value */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +133,36 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Program the next hardclock for the current cpu. "Never" is as far
+ * off as the timer can count, a couple of minutes; hardclock will
+ * just put it off again if need be.
+ */
+void
+mainbus_hardclock_set(unsigned ticks)
+{
+	if (ticks == 0 || ticks > 0xffffffff / (CPU_FREQUENCY / HZ)) {
+		mips_timer_restart(0xffffffff);
+	}
+	else {
+		mips_timer_restart(ticks * (CPU_FREQUENCY / HZ));
+	}
+}
+
+uint32_t
+mainbus_cycles(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* read c0_count */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -46,8 +46,6 @@
 #define LT_REG_COUNT  16    /* Time for countdown timer (usec) */
 #define LT_REG_SPKR   20    /* Beep control */
 
-static bool havetimerclock;
-
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -81,19 +79,12 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	lt->lt_hardclock = 0;
 
 	/*
-	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * We used to use the countdown timer for the timer clock as
+	 * well, waking everything sleeping in clocksleep/clocknap
+	 * every LT_GRANULARITY usec. Timed sleeps now run off the
+	 * per-cpu timer wheels driven by hardclock, so the countdown
+	 * timer is left switched off.
 	 */
-	if (!havetimerclock) {
-		havetimerclock = true;
-		lt->lt_timerclock = 1;
-
-		/* Wire it to go off once every 10 ms */
-		/* KMS: reduced this from 1s to 10ms */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
-	}
 	
 	return 0;
 }
@@ -116,12 +107,6 @@ ltimer_irq(void *vlt)
 		if (lt->lt_hardclock) {
 			hardclock();
 		}
-		/*
-		 * Likewise for timerclock.
-		 */
-		if (lt->lt_timerclock) {
-			timerclock();
-		}
 	}
 }
 
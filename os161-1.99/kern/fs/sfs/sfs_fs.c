@@ -282,6 +282,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* Make sure there's somewhere to get vnodes from */
+	result = sfs_vnodecache_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -43,12 +43,22 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <vm.h>
+#include <pagecache.h>
+#include <kmem_cache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/*
+ * Object cache for sfs_vnodes, shared by all mounted sfs volumes. An
+ * sfs_vnode is a little over 512 bytes, so seven fit in a page here
+ * against five from kmalloc's 768-byte size class.
+ */
+static struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -294,161 +304,120 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Page cache hooks. File data (for both regular files and directories)
+ * is read and written through the page cache; these move one page
+ * between the cache and the disk, SFS_BLOCKSIZE at a time.
  *
- * skipstart is the number of bytes to skip past at the beginning of
- * the sector; len is the number of bytes to actually read or write.
- * uio is the area to do the I/O into.
+ * Blocks past EOF and holes read as zeros. On the way out, only
+ * blocks that are inside the file and already mapped are written;
+ * sfs_io allocates blocks at write() time so that running out of
+ * space is reported to the writer rather than at writeback.
  */
 static
 int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+sfs_pagein(struct vnode *v, off_t offset, void *buf)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
-	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	char *ptr = buf;
+	uint32_t fileblock, diskblock;
+	unsigned i;
+	off_t pos;
+	int result = 0;
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(offset % PAGE_SIZE == 0);
 
-	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	vfs_biglock_acquire();
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
+	for (i=0; i<PAGE_SIZE/SFS_BLOCKSIZE; i++, ptr += SFS_BLOCKSIZE) {
+		pos = offset + i*SFS_BLOCKSIZE;
+		if (pos >= (off_t)sv->sv_i.sfi_size) {
+			bzero(ptr, SFS_BLOCKSIZE);
+			continue;
+		}
 
-	if (diskblock == 0) {
-		/*
-		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
+		fileblock = pos / SFS_BLOCKSIZE;
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
 		if (result) {
-			return result;
+			break;
 		}
-	}
 
-	/*
-	 * Now perform the requested operation into/out of the buffer.
-	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
+		if (diskblock == 0) {
+			/* No block mapped here; it's a hole. */
+			bzero(ptr, SFS_BLOCKSIZE);
+			continue;
+		}
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
+		result = sfs_rblock(sfs, ptr, diskblock);
 		if (result) {
-			return result;
+			break;
 		}
 	}
 
-	return 0;
+	vfs_biglock_release();
+	return result;
 }
 
-/*
- * Do I/O (either read or write) of a single whole block.
- */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_pageout(struct vnode *v, off_t offset, const void *buf)
 {
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
-	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
-
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	const char *ptr = buf;
+	uint32_t fileblock, diskblock;
+	unsigned i;
+	off_t pos;
+	int result = 0;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
-	}
+	KASSERT(offset % PAGE_SIZE == 0);
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
-	}
+	vfs_biglock_acquire();
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	for (i=0; i<PAGE_SIZE/SFS_BLOCKSIZE; i++, ptr += SFS_BLOCKSIZE) {
+		pos = offset + i*SFS_BLOCKSIZE;
+		if (pos >= (off_t)sv->sv_i.sfi_size) {
+			break;
+		}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+		fileblock = pos / SFS_BLOCKSIZE;
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock == 0) {
+			/* Never written; leave the hole alone. */
+			continue;
+		}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+		/* sfs_wblock doesn't write to its buffer. */
+		result = sfs_wblock(sfs, (void *)ptr, diskblock);
+		if (result) {
+			break;
+		}
+	}
 
+	vfs_biglock_release();
 	return result;
 }
 
+static const struct pagecache_ops sfs_pageops = {
+	sfs_pagein,
+	sfs_pageout,
+};
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * This goes a page at a time through the page cache.
  */
 static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
-	uint32_t blkoff;
-	uint32_t nblocks, i;
+	struct pcpage *pp;
+	off_t pageoff;
+	uint32_t skip, len;
+	uint32_t fileblock, lastblock, diskblock;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -473,67 +442,60 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
-	/*
-	 * First, do any leading partial block.
-	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
-	if (blkoff != 0) {
-		/* Number of bytes at beginning of block to skip */
-		uint32_t skip = blkoff;
-
-		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+	while (uio->uio_resid > 0) {
+		/* Number of bytes at beginning of page to skip */
+		skip = uio->uio_offset % PAGE_SIZE;
+		pageoff = uio->uio_offset - skip;
 
-		/* ...which might be less than the rest of the block */
+		/* Number of bytes to transfer in this page */
+		len = PAGE_SIZE - skip;
 		if (len > uio->uio_resid) {
 			len = uio->uio_resid;
 		}
 
-		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
-		if (result) {
-			goto out;
+		/*
+		 * If writing, make sure there are disk blocks under the
+		 * part of the page we're about to change.
+		 */
+		if (uio->uio_rw == UIO_WRITE) {
+			fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+			lastblock = (uio->uio_offset + len - 1) / SFS_BLOCKSIZE;
+			for (; fileblock <= lastblock; fileblock++) {
+				result = sfs_bmap(sv, fileblock, 1, &diskblock);
+				if (result) {
+					goto out;
+				}
+			}
 		}
-	}
 
-	/* If we're done, quit. */
-	if (uio->uio_resid==0) {
-		goto out;
-	}
-
-	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
-	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+		result = pagecache_get(&sv->sv_v, pageoff, &sfs_pageops, &pp);
 		if (result) {
 			goto out;
 		}
-	}
 
-	/*
-	 * Now do any remaining partial block at the end.
-	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+		result = uiomove((char *)pagecache_kvaddr(pp) + skip, len, uio);
+		if (uio->uio_rw == UIO_WRITE) {
+			/* Even a failed uiomove may have changed the page. */
+			pagecache_markdirty(pp);
+
+			/*
+			 * Extend the file as we go, so that if this page
+			 * gets written back before we're finished the
+			 * new part isn't ignored as being past EOF.
+			 */
+			if (uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
+				sv->sv_i.sfi_size = uio->uio_offset;
+				sv->sv_dirty = true;
+			}
+		}
+		pagecache_release(pp);
 
-	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
 		if (result) {
 			goto out;
 		}
 	}
 
  out:
-
-	/* If writing, adjust file length */
-	if (uio->uio_rw == UIO_WRITE && 
-	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
-		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
-	}
-
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -919,6 +881,14 @@ sfs_reclaim(struct vnode *v)
 		}
 	}
 
+	/* Write back and drop any cached file data */
+	result = pagecache_flush(v);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	pagecache_discard(v, 0);
+
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
@@ -953,7 +923,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1103,6 +1073,14 @@ sfs_fsync(struct vnode *v)
 	int result;
 
 	vfs_biglock_acquire();
+
+	/* Write back the data first, since it may dirty the inode. */
+	result = pagecache_flush(v);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	result = sfs_sync_inode(sv);
 	vfs_biglock_release();
 
@@ -1214,6 +1192,9 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
+	/* Forget any cached data past the new EOF */
+	pagecache_discard(v, len);
+
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
@@ -1642,6 +1623,26 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+/*
+ * Create sfs_vnode_cache if it doesn't exist yet. Called at mount
+ * time with the big VFS lock held.
+ */
+int
+sfs_vnodecache_init(void)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1685,7 +1686,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1700,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1737,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1748,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -35,7 +35,9 @@
  */
 
 
+#include <limits.h>
 #include <vm.h>
+#include <workqueue.h>
 
 struct vnode;
 
@@ -55,6 +57,8 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  paddr_t as_tstackpbase[THREAD_MAX];	/* extra threads' stacks; [0] unused */
+  struct work as_reapwork;	/* for as_destroy_later */
 };
 
 /*
@@ -79,6 +83,10 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_later - same, but do it from a worker thread (see
+ *                workqueue.h) so the caller can get on with exiting.
+ *                The address space must no longer be in use.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -91,6 +99,21 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - set up the user stack for thread number
+ *                SLOT of a multithreaded process, 1 to THREAD_MAX-1
+ *                (thread 0 uses the ordinary stack), and hand back its
+ *                initial stack pointer. The stack stays mapped until
+ *                as_destroy, and is handed out again to the next
+ *                thread that gets the same SLOT. Mappings never change
+ *                while the address space is in use, so the other cpus
+ *                running threads of the process never need their TLBs
+ *                shot down.
+ *
+ *    as_translate - find the physical address that user address VADDR
+ *                maps to in AS. Returns EFAULT if it isn't mapped.
+ *                The answer is good as long as the page stays mapped,
+ *                which under dumbvm is until as_destroy.
  */
 
 struct addrspace *as_create(void);
@@ -98,6 +121,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_destroy_later(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
@@ -107,6 +131,10 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_threadstack(struct addrspace *as, unsigned slot,
+                                        vaddr_t *initstackptr);
+int               as_translate(struct addrspace *as, vaddr_t vaddr,
+                               paddr_t *ret);
 
 
 /*
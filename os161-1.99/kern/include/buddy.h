@@ -0,0 +1,40 @@
+#ifndef _BUDDY_H_
+#define _BUDDY_H_
+
+/*
+ * Binary buddy allocator for physical pages.
+ *
+ * Memory is handed out in naturally aligned blocks of 2^order pages,
+ * for order 0 through BUDDY_MAXORDER. A request for N pages gets the
+ * smallest block that holds N. Bigger blocks are split to satisfy
+ * smaller requests, and on free a block is merged with its buddy
+ * (the other half of the block it was split from) whenever that is
+ * free too. So runs of free pages come back together instead of
+ * being left fragmented.
+ *
+ * The allocator takes over whatever RAM is left when the VM system
+ * bootstraps. Pages allocated before that (with ram_stealmem) are not
+ * managed by it and are never freed.
+ */
+
+#include <machine/vm.h>
+
+#define BUDDY_MAXORDER	10	/* largest block is 1024 pages */
+
+/*
+ * Operations:
+ *    buddy_bootstrap  - take over the physical memory [LO, HI). Some of
+ *                       it is used for the allocator's own bookkeeping.
+ *    buddy_alloc      - allocate a run of NPAGES contiguous pages.
+ *                       Returns 0 if none is available.
+ *    buddy_free       - free a run returned by buddy_alloc. Addresses
+ *                       that the allocator doesn't manage are ignored.
+ *    buddy_printstats - print per-order free counts and other stats.
+ */
+void buddy_bootstrap(paddr_t lo, paddr_t hi);
+paddr_t buddy_alloc(unsigned long npages);
+void buddy_free(paddr_t pa);
+void buddy_printstats(void);
+
+
+#endif /* _BUDDY_H_ */
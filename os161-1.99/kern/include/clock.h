@@ -35,11 +35,11 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
- *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * hardclock() is called on every CPU HZ times a second, for scheduling
+ * and to run timers, except on an idle CPU. The first hardclock after
+ * a CPU goes idle stops its clock until its next timer is due;
+ * thread_switch calls hardclock_resume() to start it again when
+ * there's something to run.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -56,10 +56,8 @@
 #define HZ  100
 #endif
 
-void hardclock_bootstrap(void);
-
 void hardclock(void);
-void timerclock(void);
+void hardclock_resume(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
@@ -67,11 +65,50 @@ void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
 
+/*
+ * Kernel timers.
+ *
+ * A timer calls FUNC(DATA) once, from the timer interrupt on the cpu
+ * it was started on, TICKS hardclocks after timer_start. FUNC runs in
+ * interrupt context and must not sleep. The struct timer belongs to
+ * the caller and must stay put until the timer has gone off or been
+ * cancelled.
+ *
+ *    timer_init   - set up a timer. Not pending.
+ *    timer_start  - start a timer that isn't pending. TICKS must be
+ *                   at least 1.
+ *    timer_cancel - stop a pending timer. Returns true if it was
+ *                   pending and now won't go off; false if it wasn't
+ *                   pending, which includes having already gone off
+ *                   (its function may still be running).
+ *
+ *    timer_printstats - print statistics for one cpu's timers.
+ */
+struct timer {
+	struct timer *tm_next;		/* link in timer wheel slot */
+	struct timer **tm_pprev;	/* pointer to that link */
+	struct cpu *tm_cpu;		/* cpu it's pending on, or NULL */
+	unsigned tm_expires;		/* tm_cpu's c_hardclocks then */
+	void (*tm_func)(void *);
+	void *tm_data;
+};
+
+void timer_init(struct timer *t, void (*func)(void *data), void *data);
+void timer_start(struct timer *t, unsigned ticks);
+bool timer_cancel(struct timer *t);
+void timer_printstats(struct cpu *c);
+
+/*
+ * thread_sleep_until() suspends execution until the time of day (as
+ * returned by gettime) is DEADLINE or later. Only the sleeping thread
+ * is woken when it comes.
+ */
+struct timespec;
+void thread_sleep_until(const struct timespec *deadline);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
@@ -79,6 +116,7 @@ void clocksleep(int seconds);
  * clocknap() suspends execution for the requested number of timer ticks
  *
  * the timer ticks every LT_GRANULARITY usec (see kern/dev/ltimer.h)
+ * for this purpose, whatever HZ is
  *
  */
 void clocknap(int ticks);
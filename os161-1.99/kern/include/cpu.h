@@ -36,6 +36,12 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of levels in the multi-level feedback queue scheduler.
+ * Level 0 is the highest priority. See schedule() in thread.c.
+ */
+#define SCHED_NLEVELS	4
+
 /*
  * Per-cpu structure
  *
@@ -60,6 +66,30 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	bool c_tickless;		/* Hardclock stopped while idle */
+	time_t c_tickstop_secs;		/* When it was stopped */
+	uint32_t c_tickstop_nsecs;
+	unsigned c_tickstops;		/* Times hardclock was stopped */
+	unsigned c_ticksskipped;	/* Hardclocks not taken while idle */
+	struct timerwheel *c_timerwheel; /* Pending timers; own locking */
+	struct kmalloc_cpu *c_kmalloc;	/* kmalloc per-cpu magazines */
+	struct worker *c_worker;	/* Deferred work; own locking */
+	struct trace_ring *c_trace;	/* Event trace, or NULL */
+	struct prof_table *c_prof;	/* Profile samples, or NULL */
+	vaddr_t c_intrpc;		/* Where the last interrupt hit */
+	bool c_intruser;		/* ...and if it was in user mode */
+	unsigned c_boosts;		/* Scheduler priority boosts */
+	unsigned c_lastboost;		/* c_hardclocks at last boost */
+	unsigned c_demotions;		/* Threads moved down a level */
+	unsigned c_steals;		/* Threads stolen from other cpus */
+	struct threadlist c_threadpool;	/* Dead threads kept for reuse */
+	unsigned c_poollow;		/* Smallest pool size since trim */
+	unsigned c_pooltrimtime;	/* c_hardclocks at last pool trim */
+	unsigned c_poolhits;		/* Forks that reused a thread */
+	unsigned c_poolmisses;		/* Forks that found the pool empty */
+	unsigned c_pooltrimmed;		/* Pooled threads freed by trimming */
+	struct spinlock_qnode c_qnodes[SPINLOCK_NQNODES]; /* See spinlock.c */
+	unsigned c_qnodesused;		/* Bitmap of c_qnodes in use */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +98,8 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_runlevels[SCHED_NLEVELS]; /* Threads queued per level */
+	unsigned c_promotions;		/* Wakeups that moved up a level */
 
 	/*
 	 * Accessed by other cpus.
@@ -95,9 +127,16 @@ struct cpu {
  * Initialization functions.
  * 
  * cpu_create creates a cpu; it is suitable for calling from driver-
- * or bus-specific code that looks for secondary CPUs.
+ * or bus-specific code that looks for secondary CPUs. cpu_count
+ * returns the number of cpus created so far, and cpu_get the one with
+ * a given c_number.
  *
- * cpu_create calls cpu_machdep_init.
+ * cpu_create calls cpu_machdep_init, kmalloc_cpu_init (in
+ * vm/kmalloc.c) to set up the cpu's kmalloc magazines,
+ * timer_cpu_init (in thread/clock.c) to set up its timer wheel,
+ * workqueue_cpu_init (in thread/workqueue.c) for its work list,
+ * trace_cpu_init (in thread/trace.c) for its event trace ring, and
+ * prof_cpu_init (in thread/prof.c) for its profile table.
  *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
@@ -105,6 +144,13 @@ struct cpu {
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
+void kmalloc_cpu_init(struct cpu *);
+void timer_cpu_init(struct cpu *);
+void workqueue_cpu_init(struct cpu *);
+void trace_cpu_init(struct cpu *);
+void prof_cpu_init(struct cpu *);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -0,0 +1,32 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * Futexes: sleeping on a word of user memory.
+ *
+ * futex_wait(addr, expected) sleeps if the int at ADDR still holds
+ * EXPECTED, until a futex_wake on the same word. The check and the
+ * sleep are atomic with respect to futex_wake, so a user-level lock
+ * can do its fast path with an atomic instruction and only make a
+ * system call when it has to wait or there's someone to wake.
+ *
+ * Waiters are kept in a hash table keyed by the physical address of
+ * the word, so threads of one process, or any processes sharing the
+ * page, find each other however it's mapped.
+ *
+ * Functions:
+ *    futex_bootstrap - set up the table. Call once during boot.
+ *    futex_wakeproc  - wake every futex waiter in process P, so they
+ *                      notice it exiting. futex_wait returns EINTR
+ *                      to them.
+ *
+ * The system calls themselves are in syscall.h.
+ */
+
+struct proc;
+
+void futex_bootstrap(void);
+void futex_wakeproc(struct proc *p);
+
+
+#endif /* _FUTEX_H_ */
@@ -71,6 +71,9 @@
 /* Max bytes for atomic pipe I/O -- see description in the pipe() man page */
 #define __PIPE_BUF      512
 
+/* Max threads in one process, counting the one it started with */
+#define __THREAD_MAX    16
+
 
 /*
  * Not so important parts of the API.
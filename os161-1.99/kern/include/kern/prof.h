@@ -0,0 +1,51 @@
+#ifndef _KERN_PROF_H_
+#define _KERN_PROF_H_
+
+/*
+ * Sampling profiler definitions visible to userspace. This covers the
+ * format of the file written by the "pr save" menu command, and is
+ * used by the host tool profsym to read it.
+ *
+ * All fields are in the kernel's byte order (big-endian on mips).
+ */
+
+#define PROF_MAGIC        0x70726f66    /* "prof" */
+#define PROF_VERSION      1
+
+/*
+ * One histogram bucket: the number of samples that found the cpu at
+ * pe_pc, in user mode or not, running for process pe_pid. Kernel
+ * threads count as pid 0. Samples taken while the cpu was sitting in
+ * its idle loop aren't kept as buckets; see pc_idle.
+ */
+struct prof_entry {
+	uint32_t pe_pc;			/* interrupted program counter */
+	int32_t pe_pid;			/* process */
+	uint32_t pe_count;		/* samples */
+	uint32_t pe_user;		/* 1 if in user mode */
+};
+
+/*
+ * A profile file is a prof_filehdr, then for each cpu a prof_cpuhdr
+ * followed by pc_nentries entries, in no particular order. The
+ * samples counted by pc_nsamples are the entries' counts plus
+ * pc_idle plus pc_dropped.
+ */
+struct prof_filehdr {
+	uint32_t ph_magic;		/* PROF_MAGIC */
+	uint32_t ph_version;		/* PROF_VERSION */
+	uint32_t ph_ncpus;		/* number of cpu sections */
+	uint32_t ph_hz;			/* samples per second per cpu */
+};
+
+struct prof_cpuhdr {
+	uint32_t pc_cpu;		/* cpu number */
+	uint32_t pc_nentries;		/* entries that follow */
+	uint32_t pc_nsamples;		/* samples taken */
+	uint32_t pc_idle;		/* samples in the idle loop */
+	uint32_t pc_dropped;		/* samples with no room to keep */
+	uint32_t pc_reserved;
+};
+
+
+#endif /* _KERN_PROF_H_ */
@@ -0,0 +1,72 @@
+#ifndef _KERN_TRACE_H_
+#define _KERN_TRACE_H_
+
+/*
+ * Event trace definitions visible to userspace. This covers the event
+ * types and the format of the file written by the "tr save" menu
+ * command, and is used by the host tool tracecvt to read it.
+ *
+ * All fields are in the kernel's byte order (big-endian on mips).
+ */
+
+#define TRACE_MAGIC       0x74726163    /* "trac" */
+#define TRACE_VERSION     2
+
+/*
+ * Event types. What te_info, te_a and te_b hold for each:
+ *
+ *    type             te_info        te_a            te_b
+ *    TRACE_SWITCH     new state      old thread      new thread
+ *    TRACE_WAKEUP     target cpu     thread          0
+ *    TRACE_MIGRATE    from cpu       thread          to cpu
+ *    TRACE_SYSCALL    call number    thread          0
+ *    TRACE_SYSRET     call number    thread          error (0 = ok)
+ *    TRACE_FAULT      trap code      fault address   epc
+ *    TRACE_IRQ        0              cause register  epc
+ *    TRACE_IRQDONE    0              0               0
+ *
+ * Threads are identified by the address of their struct thread. The
+ * new state for TRACE_SWITCH is the threadstate_t the old thread goes
+ * to: 1 ready, 2 sleeping, 3 exited.
+ */
+#define TRACE_SWITCH      1
+#define TRACE_WAKEUP      2
+#define TRACE_MIGRATE     3
+#define TRACE_SYSCALL     4
+#define TRACE_SYSRET      5
+#define TRACE_FAULT       6
+#define TRACE_IRQ         7
+#define TRACE_IRQDONE     8
+#define TRACE_NTYPES      9
+
+/* One event. te_time is nanoseconds since boot, from gettime(). */
+struct trace_event {
+	uint64_t te_time;
+	uint16_t te_type;
+	uint16_t te_info;
+	uint32_t te_a;
+	uint32_t te_b;
+	uint32_t te_reserved;
+};
+
+/*
+ * A trace file is a trace_filehdr, then for each cpu a trace_cpuhdr
+ * followed by tc_nevents events, oldest first. tc_lost counts events
+ * that were overwritten before the file was written.
+ */
+struct trace_filehdr {
+	uint32_t th_magic;		/* TRACE_MAGIC */
+	uint32_t th_version;		/* TRACE_VERSION */
+	uint32_t th_ncpus;		/* number of cpu sections */
+	uint32_t th_reserved;
+};
+
+struct trace_cpuhdr {
+	uint32_t tc_cpu;		/* cpu number */
+	uint32_t tc_nevents;		/* events that follow */
+	uint32_t tc_lost;		/* events overwritten */
+	uint32_t tc_reserved;
+};
+
+
+#endif /* _KERN_TRACE_H_ */
@@ -0,0 +1,45 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out fixed-size objects of a single type. Objects
+ * are carved out of whole pages ("slabs") packed at their real size,
+ * rather than rounded up to one of kmalloc's size classes.
+ *
+ * Freed objects stay in the cache in their constructed state. The
+ * constructor runs once, when an object is first carved out of a
+ * slab, not on every allocation; the destructor runs only when the
+ * cache itself is destroyed. Code using a cache must therefore hand
+ * objects back to kmem_cache_free in the same state the constructor
+ * left them in. Either hook may be NULL.
+ *
+ * Caches cannot be used for objects bigger than a page.
+ */
+
+struct kmem_cache;	/* Opaque */
+
+/*
+ * Operations:
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes. NAME is
+ *                         used only for statistics and should be a
+ *                         string constant. Returns NULL if out of memory.
+ *    kmem_cache_destroy - destroy a cache. All of its objects must have
+ *                         been freed.
+ *    kmem_cache_alloc   - get an object. Returns NULL if out of memory.
+ *    kmem_cache_free    - return an object to the cache it came from.
+ *
+ *    kmem_cache_printstats - print statistics for all caches.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -127,6 +127,14 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Per-callsite heap profiling (with "options khprof"): remember the
+ * current live allocations of each call site, and print how they've
+ * changed since.
+ */
+void kheap_snapshot(void);
+void kheap_printdiff(void);
+
 /*
  * C string functions. 
  *
@@ -0,0 +1,76 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling ("options lockstat").
+ *
+ * Spinlocks, sleep locks and semaphores each get a record that counts
+ * acquisitions, how many of those found the lock taken (contended),
+ * and how long the lock was then held. For spinlocks, "spins" counts
+ * trips around the wait loop; for sleep locks it counts trips around
+ * the adaptive spin loop. Semaphores aren't held by anyone, so for
+ * them an acquisition is a P, and a contended one is a P that slept.
+ *
+ * Records are keyed by kind and name, so every lock of the same name
+ * (all the run queue locks, say, or all the locks called "vnode")
+ * shares one. Spinlocks nobody named are keyed by address instead.
+ * Hold times are in nanoseconds, from gettime(). Holds that start
+ * before lockstat_bootstrap, which is called once the clock device
+ * is attached, aren't timed.
+ *
+ * When the option is off, none of this is compiled, the lock
+ * structures are their usual size, and the lock code is unchanged.
+ * lockstat_print and lockstat_reset still exist and just say so.
+ */
+
+#include "opt-lockstat.h"
+
+/* Kinds of lock. */
+#define LOCKSTAT_SPIN	0
+#define LOCKSTAT_LOCK	1
+#define LOCKSTAT_SEM	2
+
+#if OPT_LOCKSTAT
+
+struct lockstat;	/* Opaque */
+
+/*
+ * Find or make the record for a lock of kind KIND called NAME, or if
+ * NAME is NULL, the one at address ADDR. If the table is full, returns
+ * a catch-all record. Never returns NULL.
+ */
+struct lockstat *lockstat_get(unsigned kind, const char *name,
+			      const void *addr);
+
+/*
+ * Account for one acquisition. SPINS is the number of trips round the
+ * wait loop; CONTENDED says whether the lock had to be waited for.
+ */
+void lockstat_acquired(struct lockstat *ls, bool contended, unsigned spins);
+
+/*
+ * The time to stamp an acquisition with, or 0 before lockstat_bootstrap.
+ */
+uint64_t lockstat_now(void);
+
+/*
+ * Account for a hold that lasted from START, as returned by
+ * lockstat_now, to now.
+ */
+void lockstat_held(struct lockstat *ls, uint64_t start);
+
+#endif /* OPT_LOCKSTAT */
+
+/*
+ * Print the N records with the most contended acquisitions, or clear
+ * all the counters.
+ */
+#define LOCKSTAT_DEFAULT_TOPN	20
+void lockstat_print(unsigned n);
+void lockstat_reset(void);
+
+/* Start timing holds. Called from boot once gettime() works. */
+void lockstat_bootstrap(void);
+
+
+#endif /* _LOCKSTAT_H_ */
@@ -52,6 +52,25 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Make this cpu's next hardclock() happen TICKS hardclock periods from
+ * now, or if TICKS is 0, not until this is called again. (A very long
+ * delay may be cut short.) After that interrupt the timer goes back to
+ * interrupting HZ times a second.
+ */
+void mainbus_hardclock_set(unsigned ticks);
+
+/*
+ * Read this cpu's cycle counter. It counts at the cpu clock rate, but
+ * it is NOT monotonic: it goes back to zero at every hardclock (and
+ * whenever the hardclock is reprogrammed), even while interrupts are
+ * off. So it is only good for intervals shorter than a tick, and any
+ * interval that might span a hardclock is wrong, even if it doesn't
+ * come out negative. Counters on different cpus are unrelated. Use
+ * gettime() to measure anything longer.
+ */
+uint32_t mainbus_cycles(void);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
@@ -0,0 +1,76 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Unified page cache.
+ *
+ * File data is kept in whole pages indexed by (vnode, offset), so
+ * read(), write(), exec (which loads segments with VOP_READ) and any
+ * future file mmap all see the same copy of a page. The cache does
+ * not know anything about on-disk layout; the filesystem supplies a
+ * pagecache_ops table that moves one page between the cache and
+ * backing store.
+ *
+ * Pages are replaced in least-recently-used order. The number of
+ * frames the cache may own is bounded (a fraction of physical RAM);
+ * once the bound is reached new pages are made by evicting old ones,
+ * writing them back first if they are dirty.
+ */
+
+struct vnode;
+struct pcpage;		/* Opaque */
+
+/*
+ * Filesystem hooks. Both are called without any cache locks held and
+ * may sleep. OFFSET is always page-aligned and BUF is one page.
+ *
+ *    pco_pagein  - fill BUF with the file contents at OFFSET. Parts of
+ *                  the page past EOF or in holes must be zeroed.
+ *
+ *    pco_pageout - write BUF back to the file at OFFSET. Parts of the
+ *                  page past EOF should be ignored.
+ */
+struct pagecache_ops {
+	int (*pco_pagein)(struct vnode *v, off_t offset, void *buf);
+	int (*pco_pageout)(struct vnode *v, off_t offset, const void *buf);
+};
+
+/* Call once during system startup. */
+void pagecache_bootstrap(void);
+
+/*
+ * Operations:
+ *    pagecache_get       - find (or read in) the page of V at OFFSET and
+ *                          pin it in memory. Returns an error code.
+ *    pagecache_kvaddr    - kernel address of a pinned page's data.
+ *    pagecache_markdirty - note that a pinned page has been modified.
+ *    pagecache_release   - unpin a page obtained from pagecache_get.
+ *
+ *    pagecache_flush     - write back all dirty pages of V.
+ *    pagecache_discard   - throw away V's pages at or past LEN (without
+ *                          writing them back), and zero the part of the
+ *                          page containing LEN that lies past it. Used
+ *                          on truncate and, with LEN 0, when a vnode is
+ *                          reclaimed. None of the pages may be pinned.
+ *
+ *    pagecache_reclaim   - give up to NPAGES clean, unpinned frames back
+ *                          to the kernel page allocator. Does no I/O and
+ *                          does not sleep. Returns the number released.
+ *
+ *    pagecache_printstats - print hit/miss/eviction counts.
+ */
+int pagecache_get(struct vnode *v, off_t offset,
+		  const struct pagecache_ops *ops, struct pcpage **ret);
+void *pagecache_kvaddr(struct pcpage *pp);
+void pagecache_markdirty(struct pcpage *pp);
+void pagecache_release(struct pcpage *pp);
+
+int pagecache_flush(struct vnode *v);
+void pagecache_discard(struct vnode *v, off_t len);
+
+unsigned pagecache_reclaim(unsigned npages);
+
+void pagecache_printstats(void);
+
+
+#endif /* _PAGECACHE_H_ */
@@ -36,20 +36,40 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <limits.h>
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
 struct vnode;
+struct wchan;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
+/*
+ * User-level thread slot. A process has THREAD_MAX; slot 0 is the
+ * thread the process started with. A thread's id is its slot number
+ * plus THREAD_MAX times the number of times the slot has been used
+ * before, so ids aren't repeated soon after a thread is joined.
+ */
+struct uthread {
+	unsigned ut_state;		/* UT_FREE etc. */
+	unsigned ut_gen;		/* times this slot has been used */
+	bool ut_joining;		/* someone is in thread_join on it */
+	userptr_t ut_value;		/* thread_exit value, once UT_EXITED */
+};
+
+#define UT_FREE		0	/* not in use */
+#define UT_RUNNING	1	/* thread exists */
+#define UT_EXITED	2	/* thread exited; not yet joined */
+
 /*
  * Process structure.
  */
 struct proc {
 	char *p_name;			/* Name of this process */
+	pid_t p_pid;			/* Process id; 0 for kproc */
 	struct spinlock p_lock;		/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
 
@@ -59,6 +79,27 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/*
+	 * User threads. Protected by p_lock. Once p_exiting is set,
+	 * every thread but p_exiter leaves as soon as it's next on its
+	 * way back to user mode. p_uthreadwchan is where thread_join
+	 * and _exit wait for threads to go.
+	 */
+	struct uthread p_uthreads[THREAD_MAX];
+	unsigned p_nuthreads;		/* threads not yet gone */
+	bool p_exiting;			/* _exit in progress */
+	struct thread *p_exiter;	/* thread doing the _exit */
+	struct wchan *p_uthreadwchan;
+
+	/*
+	 * Resource usage, for getrusage. p_usage adds up the threads
+	 * that have left the process; proc_getusage adds in those still
+	 * here. p_childusage adds up child processes that have ended.
+	 * Protected by p_lock.
+	 */
+	struct thread_usage p_usage;
+	struct thread_usage p_childusage;
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -94,6 +135,12 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* Get the resource usage of the threads of a process, past and present. */
+void proc_getusage(struct proc *proc, struct thread_usage *ret);
+
+/* Print the kernel's own usage and that of the programs it has run. */
+void proc_printusage(void);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
@@ -0,0 +1,61 @@
+#ifndef _PROF_H_
+#define _PROF_H_
+
+/*
+ * Sampling profiler ("options prof").
+ *
+ * While it's on, each hardclock looks at what the cpu was doing when
+ * the timer interrupt came in: the program counter, whether it was in
+ * user mode, and the current process. Each cpu counts these in its own
+ * hash table of (pc, pid, mode) buckets (see <kern/prof.h>), touched
+ * only from its own timer interrupt, so sampling needs no locks. When
+ * a table fills up, further new buckets are counted as dropped.
+ *
+ * The trap code leaves the interrupted pc and mode in c_intrpc and
+ * c_intruser for hardclock to find.
+ *
+ * The kernel can't name its own functions, so the dump shows raw
+ * addresses; save the profile and run the host tool profsym over it
+ * and the kernel binary to get a flat profile by function.
+ *
+ * Functions:
+ *    prof_start    - clear the tables and start sampling.
+ *    prof_stop     - stop sampling.
+ *    prof_dump     - stop, and print the N buckets with the most
+ *                    samples, all cpus added together.
+ *    prof_save     - stop, and write the tables to the file PATH for
+ *                    profsym. Returns an errno.
+ *
+ * Without the option these just say it isn't there. (Each cpu's
+ * table is allocated by prof_cpu_init, from cpu_create, which then
+ * does nothing.)
+ */
+
+#include "opt-prof.h"
+#include <kern/prof.h>
+
+struct cpu;
+
+#if OPT_PROF
+
+extern volatile bool prof_on;
+
+void prof_sample(struct cpu *c);
+
+#define PROF_TICK(c) (prof_on ? prof_sample(c) : (void)0)
+
+#else
+
+#define PROF_TICK(c) ((void)0)
+
+#endif /* OPT_PROF */
+
+#define PROF_DEFAULT_DUMP	30
+
+void prof_start(void);
+void prof_stop(void);
+void prof_dump(unsigned n);
+int prof_save(const char *path);
+
+
+#endif /* _PROF_H_ */
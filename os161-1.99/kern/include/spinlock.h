@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -45,11 +46,35 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Queue entry for a queued spinlock. Each cpu waiting for or holding
+ * a queued lock has one, and spins on its own qn_wait rather than on
+ * the lock, until the cpu ahead of it in line clears it.
+ */
+struct spinlock_qnode {
+	struct spinlock_qnode *volatile qn_next; /* Next cpu in line */
+	volatile bool qn_wait;		/* Still waiting for our turn */
+};
+
+/*
+ * Number of queued spinlocks one cpu can be holding or waiting for at
+ * once. Each cpu has this many queue entries (see struct cpu).
+ */
+#define SPINLOCK_NQNODES	8
+
 /*
  * Basic spinlock.
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either plain (test-and-test-and-set on lk_lock) or
+ * queued. A queued lock is an MCS lock: cpus get it in the order they
+ * asked for it, and each waiter spins on its own queue entry instead
+ * of all of them hammering the lock word. lk_lock then points to the
+ * queue entry of the last cpu in line, and is 0 when the lock is free.
+ * Queued locks cost an extra atomic operation when uncontended, so
+ * use them for locks that are actually fought over.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
@@ -57,26 +82,47 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+	bool lk_queued;			/* Queued (FIFO) lock */
+	struct spinlock_qnode *lk_qnode; /* Holder's queue entry, if queued */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Contention record (see lockstat.h) */
+	uint64_t lk_acqtime;		/* Time when acquired */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, false, NULL, NULL, 0 }
+#define SPINLOCK_INITIALIZER_QUEUED \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, true, NULL, NULL, 0 }
+#else
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, false, NULL }
+#define SPINLOCK_INITIALIZER_QUEUED \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, true, NULL }
+#endif
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_queued	Same, but make it a queued lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Give the lock a name for lockstat. NAME need not stay
+ *		around afterwards. Does nothing without options lockstat.
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_queued(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -84,5 +130,11 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+void spinlock_setname(struct spinlock *lk, const char *name);
+#else
+#define spinlock_setname(lk, name) ((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
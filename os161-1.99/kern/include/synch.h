@@ -36,6 +36,14 @@
 
 
 #include <spinlock.h>
+#include <thread.h>
+#include <lockstat.h>
+
+/*
+ * Set up the object caches the synchronization primitives are
+ * allocated from. Call once during system startup.
+ */
+void synch_bootstrap(void);
 
 /*
  * Dijkstra-style semaphore.
@@ -48,6 +56,9 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
+#if OPT_LOCKSTAT
+	struct lockstat *sem_stat;
+#endif
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -71,11 +82,38 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held by a thread
+ * that's running on another cpu spins for a while, on the theory that
+ * it'll be released soon, and only sleeps if it isn't, or if the
+ * holder isn't running.
+ *
+ * Locks also pass on priority: a thread that goes to sleep waiting for
+ * a lock lends its priority to the holder, and on through whatever
+ * lock that thread is waiting for, and so on, until the holder lets
+ * go. So a low-priority thread can't hold up a high-priority one for
+ * long by holding a lock it needs.
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *lk_wchan;
+	struct spinlock lk_lock;
+	struct thread *volatile lk_holder;
+	struct lock *lk_heldnext;	/* next in holder's t_heldlocks */
+	unsigned lk_nwaiters;		/* threads asleep on lk_wchan */
+
+	/* Waiters at each priority; protected by synch.c's lock_pilock. */
+	unsigned lk_waitpri[PRI_LOWEST + 1];
+
+	/* Statistics; protected by lk_lock. */
+	unsigned lk_acquires;		/* total acquisitions */
+	unsigned lk_spinacquires;	/* got it after spinning */
+	unsigned lk_sleepacquires;	/* got it after sleeping */
+
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;
+	uint64_t lk_acqtime;		/* time when acquired */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -96,6 +134,20 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Work out the current thread's priority again from its base priority
+ * and the threads waiting for locks it holds. For thread_setpriority.
+ */
+void lock_repriority(void);
+
+/*
+ * Print contention statistics for all locks together: how many times
+ * a lock was found held, and of those how many were got by spinning
+ * and how many by sleeping. Also prints the same for reader-writer
+ * locks: how many times readers and writers had to wait.
+ */
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -113,8 +165,7 @@ void lock_destroy(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
@@ -138,4 +189,65 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Once a writer is waiting, new readers wait behind it, so a stream
+ * of readers can't keep writers out forever. In turn, readers that
+ * were waiting when a writer lets go all get in before the next
+ * writer, so a stream of writers can't keep readers out either.
+ * Readers that arrive after that wait their turn again.
+ *
+ * rw_readgen counts the times waiting readers were let in; a reader
+ * remembers it when it starts to wait, and a change means its turn
+ * has come.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_readwchan;	/* readers wait here */
+	struct wchan *rw_writewchan;	/* writers wait here */
+	unsigned rw_readers;		/* readers holding the lock */
+	struct thread *rw_writer;	/* writer holding it, if any */
+	unsigned rw_waitreaders;	/* readers waiting */
+	unsigned rw_waitwriters;	/* writers waiting */
+	unsigned rw_readgen;		/* see above */
+
+	/* Statistics; protected by rw_lock. */
+	unsigned rw_readacquires;	/* shared acquisitions */
+	unsigned rw_writeacquires;	/* exclusive acquisitions */
+	unsigned rw_readwaits;		/* readers that had to wait */
+	unsigned rw_writewaits;		/* writers that had to wait */
+	unsigned rw_maxreaders;		/* most readers at once */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock shared, waiting if a writer
+ *                            holds it or is waiting for it.
+ *    rwlock_release_read   - Let go of a shared hold.
+ *    rwlock_acquire_write  - Get the lock exclusively.
+ *    rwlock_release_write  - Let go of an exclusive hold.
+ *    rwlock_do_i_hold_write - True if the current thread is the writer.
+ *                            (There's no such check for readers.)
+ *    rwlock_printstats     - Print the lock's contention counters.
+ *
+ * A thread must not take a lock it already holds, either way; in
+ * particular, a reader can't upgrade to writer.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+void rwlock_printstats(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -50,6 +50,14 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/*
+ * Enter user mode as a new thread of the current process, calling
+ * ENTRYPOINT(ARG0, ARG1) on stack STACKPTR. GP is the global pointer
+ * of the thread that made it. Does not return.
+ */
+void enter_new_thread(vaddr_t entrypoint, vaddr_t arg0, vaddr_t arg1,
+		      vaddr_t stackptr, vaddr_t gp);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -63,6 +71,21 @@ int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_wait4(pid_t pid, userptr_t status, int options, userptr_t usage,
+	      pid_t *retval);
+int sys_getrusage(int who, userptr_t usage);
+
+int sys___thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+			vaddr_t gp, int *retval);
+void sys_thread_exit(userptr_t value);
+int sys_thread_join(int tid, userptr_t valueptr);
+int sys_futex_wait(userptr_t uaddr, int expected);
+int sys_futex_wake(userptr_t uaddr, int n, int *retval);
+
+/* Called on every return to user mode; see thread_syscalls.c. */
+void uthread_checkexit(void);
+/* Called by sys__exit to get rid of the process's other threads. */
+void uthread_exitall(void);
 
 #endif // UW
 
@@ -60,12 +60,18 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int timertest(int, char **);
+int pritest(int, char **);
+int spinlockbench(int, char **);
+int workqueuetest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
 int uwlocktest1(int, char **);
 /* Used to test uw-vmstats */
 int uwvmstatstest(int, char **);
+/* Reader-writer lock stress test */
+int uwrwlocktest(int, char **);
 #endif
 
 /* filesystem tests */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -55,6 +56,15 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/*
+ * Thread priorities. As with scheduler levels, smaller numbers are
+ * more urgent. Priority comes first when ordering the run queue; the
+ * scheduler level only decides among threads of the same priority.
+ */
+#define PRI_HIGHEST	0
+#define PRI_DEFAULT	8
+#define PRI_LOWEST	15
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -64,6 +74,18 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/*
+ * Resource usage of a thread, or added up for a process (see proc.h).
+ * Times are in nanoseconds.
+ */
+struct thread_usage {
+	uint64_t tu_utime;		/* Time running in user mode */
+	uint64_t tu_stime;		/* Time running in the kernel */
+	unsigned tu_nvcsw;		/* Switches from going to sleep */
+	unsigned tu_nivcsw;		/* Switches while still runnable */
+	unsigned tu_minflt;		/* VM faults taken */
+};
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -83,6 +105,34 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_level;		/* Scheduler level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on, if any */
+	unsigned t_lastran;		/* t_lastcpu's c_hardclocks then */
+	unsigned t_migrations;		/* Times moved to another CPU */
+	bool t_bound;			/* Never moved off t_cpu */
+
+	/*
+	 * Resource usage. Each time the thread is switched out or
+	 * crosses between user mode and the kernel, the time since
+	 * t_usagestamp is charged to its user or system time. Only the
+	 * thread itself updates these.
+	 */
+	struct thread_usage t_usage;
+	uint64_t t_usagestamp;		/* Time when last charged */
+
+	/*
+	 * Priority fields. t_priority is the priority the thread is
+	 * scheduled at: t_basepri, or better if it holds a lock that a
+	 * more urgent thread is waiting for (priority inheritance; see
+	 * synch.c). t_priority and t_waitlock are protected by the
+	 * priority inheritance lock in synch.c; t_heldlocks is only
+	 * touched by the thread itself.
+	 */
+	unsigned t_basepri;		/* Priority it asked for */
+	unsigned t_priority;		/* Priority it runs at */
+	struct lock *t_heldlocks;	/* Locks held, via lk_heldnext */
+	struct lock *t_waitlock;	/* Lock asleep waiting for, if any */
 
 	/*
 	 * Interrupt state fields.
@@ -105,6 +155,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	int t_tid;			/* User thread id; see proc.h */
+
 	/* add more here as needed */
 };
 
@@ -144,6 +196,14 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Same as thread_fork, but the new thread starts on cpu C and the
+ * scheduler never moves it anywhere else. For per-cpu kernel threads.
+ */
+int thread_fork_bound(const char *name, struct proc *proc, struct cpu *c,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -158,9 +218,43 @@ void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Set the current thread's priority, PRI_HIGHEST through PRI_LOWEST.
+ * Threads created afterwards by this one start at the same priority.
+ * If it's currently running at a better priority inherited through
+ * a lock, it keeps that until it lets go of the lock.
  */
-void schedule(void);
+void thread_setpriority(unsigned pri);
+
+/*
+ * Change the priority T runs at to PRI, moving it within its run
+ * queue if it's on one. For the priority inheritance code.
+ */
+void thread_changepriority(struct thread *t, unsigned pri);
+
+/*
+ * Charge the current thread for the time since it was last charged,
+ * as user time if USER is true and otherwise as system time. The trap
+ * code calls this on the way into and out of user mode. Must be
+ * called at splhigh.
+ */
+void thread_chargetime(bool user);
+
+/* Add the counts in FROM to TO. */
+void thread_usage_add(struct thread_usage *to,
+		      const struct thread_usage *from);
+
+/*
+ * Charge the current thread for a clock tick and adjust scheduler
+ * priorities. Called from the timer interrupt. Returns true if the
+ * current thread should give up the processor.
+ */
+bool schedule(void);
+
+/*
+ * Print per-cpu run queue lengths by level, and scheduler counters.
+ * If SHOWTHREADS is true, also list the threads on each cpu.
+ */
+void thread_printschedstats(bool showthreads);
 
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
@@ -168,5 +262,12 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * A thread that last ran fewer than thread_migrate_cost hardclocks ago
+ * is taken to still have its working set in that CPU's cache, and the
+ * load balancer avoids moving it. 0 disables the check.
+ */
+extern unsigned thread_migrate_cost;
+
 
 #endif /* _THREAD_H_ */
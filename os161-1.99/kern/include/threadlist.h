@@ -86,15 +86,19 @@ void threadlist_insertbefore(struct threadlist *tl,
 			     struct thread *addee, struct thread *onlist);
 void threadlist_remove(struct threadlist *tl, struct thread *t);
 
-/* Iteration; itervar should previously be declared as (struct thread *) */
+/*
+ * Iteration; itervar should previously be declared as (struct thread *).
+ * The bookends have a null tln_self, so the loop stops on reaching one.
+ * Don't remove itervar from the list inside the loop.
+ */
 #define THREADLIST_FORALL(itervar, tl) \
 	for ((itervar) = (tl).tl_head.tln_next->tln_self; \
-	     (itervar)->t_listnode.tln_next != NULL; \
+	     (itervar) != NULL; \
 	     (itervar) = (itervar)->t_listnode.tln_next->tln_self)
 
 #define THREADLIST_FORALL_REV(itervar, tl) \
 	for ((itervar) = (tl).tl_tail.tln_prev->tln_self; \
-	     (itervar)->t_listnode.tln_prev != NULL; \
+	     (itervar) != NULL; \
 	     (itervar) = (itervar)->t_listnode.tln_prev->tln_self)
 
 
@@ -0,0 +1,58 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * Event tracing ("options trace").
+ *
+ * Each cpu has a ring buffer of binary events (see <kern/trace.h>
+ * for the types): context switches, wakeups, migrations, syscalls,
+ * faults and interrupts, each stamped with the time. Only
+ * the owning cpu writes its ring, with interrupts off for the few
+ * stores it takes, so recording needs no locks and doesn't go near
+ * the console. When a ring fills, the oldest events are overwritten.
+ *
+ * Recording is off until trace_start. TRACE() costs one test of a
+ * flag when it's off, and nothing at all when the option isn't
+ * compiled in.
+ *
+ * Functions:
+ *    trace_start    - clear the rings and start recording.
+ *    trace_stop     - stop recording.
+ *    trace_dump     - stop, and print the last N events of each cpu,
+ *                     merged in time order and decoded.
+ *    trace_save     - stop, and write the rings to the file PATH for
+ *                     the host tool tracecvt. Returns an errno.
+ *
+ * Without the option these just say it isn't there. (Each cpu's ring
+ * is allocated by trace_cpu_init, from cpu_create, which then does
+ * nothing.)
+ */
+
+#include "opt-trace.h"
+#include <kern/trace.h>
+
+#if OPT_TRACE
+
+extern volatile bool trace_on;
+
+void trace_record(unsigned type, unsigned info, uint32_t a, uint32_t b);
+
+#define TRACE(type, info, a, b) \
+	(trace_on ? trace_record(type, info, (uint32_t)(a), (uint32_t)(b)) \
+		  : (void)0)
+
+#else
+
+#define TRACE(type, info, a, b) ((void)0)
+
+#endif /* OPT_TRACE */
+
+#define TRACE_DEFAULT_DUMP	50
+
+void trace_start(void);
+void trace_stop(void);
+void trace_dump(unsigned n);
+int trace_save(const char *path);
+
+
+#endif /* _TRACE_H_ */
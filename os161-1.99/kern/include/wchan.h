@@ -37,6 +37,11 @@
 
 struct wchan; /* Opaque */
 
+/*
+ * Set up the wait channel system. Call once during system startup.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -75,8 +80,9 @@ void wchan_sleep(struct wchan *wc);
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
  *
- * The current implementation is FIFO but this is not promised by the
- * interface.
+ * wchan_wakeone wakes the most urgent thread by priority, and the
+ * one that's been asleep longest among those. This ordering is not
+ * promised for wchan_wakeall.
  */
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
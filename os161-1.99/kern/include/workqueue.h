@@ -0,0 +1,64 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work.
+ *
+ * Each cpu has a worker thread, bound to it, that runs work items
+ * handed to it. A work item is a function and an argument, in a
+ * struct work the caller owns, much like a struct timer. Items are
+ * submitted to a workqueue, which is either
+ *
+ *    unordered - each item goes to the worker on the cpu it was
+ *                submitted from, so items can run in any order and
+ *                several at once on different cpus; or
+ *
+ *    ordered   - items run one at a time, in the order submitted.
+ *
+ * The function runs in a kernel thread and may sleep. Submitting
+ * never sleeps, so it can be done from an interrupt handler or with
+ * spinlocks held, to get slow work off a critical path.
+ *
+ * workqueue_system is an unordered queue for general use.
+ *
+ * Functions:
+ *    work_init          - set up a work item. Not pending.
+ *    workqueue_create   - make a queue. NAME is copied. Returns NULL
+ *                         if out of memory.
+ *    workqueue_destroy  - wait for a queue to empty, then destroy it.
+ *    workqueue_submit   - queue W to run on WQ. Returns false and does
+ *                         nothing if W is already pending. Once W's
+ *                         function has started, W can be submitted
+ *                         again or freed.
+ *    workqueue_flush    - wait until WQ has nothing pending or
+ *                         running. Work that keeps resubmitting itself
+ *                         will make this wait forever.
+ *
+ *    workqueue_bootstrap - start the workers. Call once all the cpus
+ *                          are up; work submitted before then waits.
+ *                          (Each cpu's work list is set up by
+ *                          workqueue_cpu_init, from cpu_create.)
+ */
+
+struct workqueue;	/* Opaque */
+
+struct work {
+	struct work *wk_next;		/* link in pending list */
+	void (*wk_func)(void *data);	/* function to call */
+	void *wk_data;			/* argument */
+	struct workqueue *wk_wq;	/* queue pending on, or NULL */
+};
+
+extern struct workqueue *workqueue_system;
+
+void work_init(struct work *w, void (*func)(void *data), void *data);
+
+struct workqueue *workqueue_create(const char *name, bool ordered);
+void workqueue_destroy(struct workqueue *wq);
+bool workqueue_submit(struct workqueue *wq, struct work *w);
+void workqueue_flush(struct workqueue *wq);
+
+void workqueue_bootstrap(void);
+
+
+#endif /* _WORKQUEUE_H_ */
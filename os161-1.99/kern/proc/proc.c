@@ -45,17 +45,31 @@
 #include <types.h>
 #include <proc.h>
 #include <current.h>
+#include <spl.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>  
+#include <limits.h>
+#include <kmem_cache.h>
+#include <wchan.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/* Object cache for proc structures. */
+static struct kmem_cache *proc_cache;
+
+/*
+ * Next pid for proc_create_runprogram. Pids aren't checked for reuse;
+ * they only wrap after PID_MAX processes.
+ */
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+static pid_t pid_next = PID_MIN;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -71,6 +85,30 @@ struct semaphore *no_proc_sem;
 
 
 
+/*
+ * Constructor and destructor for proc_cache. Procs freed back to the
+ * cache have no threads; the thread array keeps its storage.
+ */
+static
+void
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -79,19 +117,42 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	unsigned i;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
+		return NULL;
+	}
+	proc->p_uthreadwchan = wchan_create(proc->p_name);
+	if (proc->p_uthreadwchan == NULL) {
+		kfree(proc->p_name);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	/* p_threads and p_lock are set up by proc_ctor */
+
+	/* User threads; runprogram's thread becomes slot 0 */
+	for (i=0; i<THREAD_MAX; i++) {
+		proc->p_uthreads[i].ut_state = UT_FREE;
+		proc->p_uthreads[i].ut_gen = 0;
+		proc->p_uthreads[i].ut_joining = false;
+		proc->p_uthreads[i].ut_value = NULL;
+	}
+	proc->p_nuthreads = 0;
+	proc->p_exiting = false;
+	proc->p_exiter = NULL;
+
+	/* The kernel is pid 0; proc_create_runprogram assigns real ones. */
+	proc->p_pid = 0;
+
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_childusage, sizeof(proc->p_childusage));
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -163,11 +224,21 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(proc->p_lock.lk_holder == NULL);
+
+	/*
+	 * Every process is started from the kernel menu (there's no
+	 * fork), so count it as a child of the kernel. The menu's "ru"
+	 * command shows the totals.
+	 */
+	spinlock_acquire(&kproc->p_lock);
+	thread_usage_add(&kproc->p_childusage, &proc->p_usage);
+	spinlock_release(&kproc->p_lock);
 
+	wchan_destroy(proc->p_uthreadwchan);
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -193,6 +264,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				 proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("could not create proc cache\n");
+  }
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -243,6 +319,15 @@ proc_create_runprogram(const char *name)
 
 	proc->p_addrspace = NULL;
 
+	spinlock_acquire(&pid_lock);
+	proc->p_pid = pid_next;
+	pid_next = pid_next == PID_MAX ? PID_MIN : pid_next + 1;
+	spinlock_release(&pid_lock);
+
+	/* The thread that runs the program is user thread 0. */
+	proc->p_uthreads[0].ut_state = UT_RUNNING;
+	proc->p_nuthreads = 1;
+
 	/* VFS fields */
 
 #ifdef UW
@@ -304,16 +389,25 @@ proc_remthread(struct thread *t)
 {
 	struct proc *proc;
 	unsigned i, num;
+	int spl;
 
 	proc = t->t_proc;
 	KASSERT(proc != NULL);
 
+	if (t == curthread) {
+		/* Bring its time up to date before handing it over. */
+		spl = splhigh();
+		thread_chargetime(false);
+		splx(spl);
+	}
+
 	spinlock_acquire(&proc->p_lock);
 	/* ugh: find the thread in the array */
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
+			thread_usage_add(&proc->p_usage, &t->t_usage);
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
 			return;
@@ -324,6 +418,67 @@ proc_remthread(struct thread *t)
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
 
+/*
+ * Add up the resource usage of PROC's threads. Threads running on
+ * other cpus are still counting, so for them this is a snapshot.
+ */
+void
+proc_getusage(struct proc *proc, struct thread_usage *ret)
+{
+	struct thread *t;
+	unsigned i, num;
+	int spl;
+
+	if (proc == curproc) {
+		spl = splhigh();
+		thread_chargetime(false);
+		splx(spl);
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	*ret = proc->p_usage;
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&proc->p_threads, i);
+		thread_usage_add(ret, &t->t_usage);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/* Print one line of proc_printusage. */
+static
+void
+proc_printusageline(const char *what, const struct thread_usage *tu)
+{
+	kprintf("%-10s %6llu.%03u %6llu.%03u %8u %8u %8u\n", what,
+		(unsigned long long)(tu->tu_utime / 1000000000),
+		(unsigned)(tu->tu_utime % 1000000000 / 1000000),
+		(unsigned long long)(tu->tu_stime / 1000000000),
+		(unsigned)(tu->tu_stime % 1000000000 / 1000000),
+		tu->tu_nvcsw, tu->tu_nivcsw, tu->tu_minflt);
+}
+
+/*
+ * Print the usage of the kernel's own threads, and the totals for
+ * the programs run from the menu that have exited, which is where
+ * proc_destroy puts them.
+ */
+void
+proc_printusage(void)
+{
+	struct thread_usage self, children;
+
+	proc_getusage(kproc, &self);
+	spinlock_acquire(&kproc->p_lock);
+	children = kproc->p_childusage;
+	spinlock_release(&kproc->p_lock);
+
+	kprintf("%-10s %10s %10s %8s %8s %8s\n", "", "user (s)",
+		"system (s)", "vol sw", "invol sw", "faults");
+	proc_printusageline("kernel", &self);
+	proc_printusageline("programs", &children);
+}
+
 /*
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
@@ -41,8 +41,13 @@
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <wchan.h>
 #include <synch.h>
 #include <vm.h>
+#include <pagecache.h>
+#include <workqueue.h>
+#include <futex.h>
+#include <lockstat.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
@@ -107,9 +112,10 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
-	hardclock_bootstrap();
 	vfs_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -117,14 +123,18 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+	lockstat_bootstrap();
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	pagecache_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
+	futex_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
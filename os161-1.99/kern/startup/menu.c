@@ -1,4 +1,3 @@
-q
 /*
  * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
  *	The President and Fellows of Harvard College.
@@ -40,6 +39,12 @@ q
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <pagecache.h>
+#include <kmem_cache.h>
+#include <buddy.h>
+#include <lockstat.h>
+#include <trace.h>
+#include <prof.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -402,12 +407,190 @@ cmd_bootfs(int nargs, char **args)
 static
 int
 cmd_kheapstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "snap")) {
+		kheap_snapshot();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "diff")) {
+		kheap_printdiff();
+	}
+	else {
+		kprintf("Usage: kh [snap | diff]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_buddystats(int nargs, char **args)
 {
 	(void)nargs;
 	(void)args;
 
-	kheap_printstats();
-	
+	buddy_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_kmemcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printschedstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "threads")) {
+		thread_printschedstats(true);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "cost") &&
+		 atoi(args[2]) >= 0) {
+		thread_migrate_cost = atoi(args[2]);
+	}
+	else {
+		kprintf("Usage: sq [threads | cost hardclocks]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print(LOCKSTAT_DEFAULT_TOPN);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		lockstat_print(atoi(args[1]));
+	}
+	else {
+		kprintf("Usage: ls [count | reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_trace(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		trace_dump(TRACE_DEFAULT_DUMP);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "start")) {
+		trace_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		trace_stop();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		trace_dump(atoi(args[1]));
+	}
+	else if (nargs == 3 && !strcmp(args[1], "save")) {
+		result = trace_save(args[2]);
+		if (result) {
+			kprintf("tr: %s: %s\n", args[2], strerror(result));
+			return result;
+		}
+	}
+	else {
+		kprintf("Usage: tr [start | stop | count | save file]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_prof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		prof_dump(PROF_DEFAULT_DUMP);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "start")) {
+		prof_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		prof_stop();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		prof_dump(atoi(args[1]));
+	}
+	else if (nargs == 3 && !strcmp(args[1], "save")) {
+		result = prof_save(args[2]);
+		if (result) {
+			kprintf("pr: %s: %s\n", args[2], strerror(result));
+			return result;
+		}
+	}
+	else {
+		kprintf("Usage: pr [start | stop | count | save file]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_pagecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pagecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_usage(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printusage();
+
 	return 0;
 }
 
@@ -475,6 +658,10 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tm1] Timer test                    ",
+	"[pi1] Priority inheritance test     ",
+	"[sl1] Spinlock latency benchmark    ",
+	"[wq1] Workqueue test                ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -484,6 +671,7 @@ static const char *testmenu[] = {
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
+	"[uw3] UW rwlock stress test         ",
 #endif // UW
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
@@ -521,6 +709,15 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[kc] Kernel object cache stats      ",
+	"[bd] Buddy page allocator stats     ",
+	"[pc] Page cache stats               ",
+	"[sq] Scheduler run queue stats      ",
+	"[ru] CPU usage of kernel, programs  ",
+	"[lk] Lock contention stats          ",
+	"[ls] Lock profile (top N contended) ",
+	"[tr] Event trace                    ",
+	"[pr] Sampling profile               ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -578,6 +775,15 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kc",         cmd_kmemcachestats },
+	{ "bd",         cmd_buddystats },
+	{ "pc",         cmd_pagecachestats },
+	{ "sq",         cmd_schedstats },
+	{ "ru",         cmd_usage },
+	{ "lk",         cmd_lockstats },
+	{ "ls",         cmd_lockprof },
+	{ "tr",         cmd_trace },
+	{ "pr",         cmd_prof },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -590,6 +796,10 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tm1",	timertest },
+	{ "pi1",	pritest },
+	{ "sl1",	spinlockbench },
+	{ "wq1",	workqueuetest },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
@@ -598,6 +808,7 @@ static struct {
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
+	{ "uw3",	uwrwlocktest },
 #endif
 
 	/* file system assignment tests */
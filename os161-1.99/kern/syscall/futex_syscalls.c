@@ -0,0 +1,225 @@
+/*
+ * Futexes.
+ *
+ * The specification of the interface is in futex.h.
+ *
+ * Each bucket of the table has a spinlock, a list of waiters and a
+ * wait channel. A waiter is a struct futex_waiter on the waiting
+ * thread's own stack. futex_wake takes matching waiters off the list,
+ * marks them woken, and wakes the bucket's channel; anyone else asleep
+ * there sees it wasn't them and goes back to sleep. With enough
+ * buckets that's rare, and it keeps the wait channel code as it is.
+ *
+ * futex_wait reads the word through the kernel's direct mapping of
+ * physical memory, holding the bucket lock, so a futex_wake can't get
+ * in between the check and going to sleep.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <futex.h>
+#include <syscall.h>
+
+#define FUTEX_HASHBITS	6
+#define FUTEX_NBUCKETS	(1 << FUTEX_HASHBITS)
+
+struct futex_waiter {
+	struct futex_waiter *fw_next;
+	paddr_t fw_paddr;		/* word waited on */
+	struct proc *fw_proc;		/* process waiting */
+	bool fw_woken;			/* taken off the list by a wake */
+	int fw_result;			/* what futex_wait returns */
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct futex_waiter *fb_waiters;
+	struct wchan *fb_wchan;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		spinlock_setname(&futex_table[i].fb_lock, "futex");
+		futex_table[i].fb_waiters = NULL;
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(paddr_t paddr)
+{
+	uint32_t h;
+
+	/* Fibonacci hashing; the top bits are the best mixed. */
+	h = (paddr >> 2) * 2654435761U;
+	return &futex_table[h >> (32 - FUTEX_HASHBITS)];
+}
+
+/*
+ * Check that user address UADDR is an aligned int in the current
+ * process, and find its physical address.
+ */
+static
+int
+futex_lookup(userptr_t uaddr, paddr_t *ret)
+{
+	struct addrspace *as;
+
+	if (((vaddr_t)uaddr & (sizeof(int) - 1)) != 0) {
+		return EINVAL;
+	}
+	if ((vaddr_t)uaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_translate(as, (vaddr_t)uaddr, ret);
+}
+
+/*
+ * Sleep until woken if the int at UADDR is EXPECTED. Returns EAGAIN
+ * straight away if it isn't.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int expected)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter fw, **fwp;
+	paddr_t paddr;
+	int result;
+
+	result = futex_lookup(uaddr, &paddr);
+	if (result) {
+		return result;
+	}
+	fb = futex_bucket(paddr);
+
+	spinlock_acquire(&fb->fb_lock);
+	if (curproc->p_exiting) {
+		/*
+		 * futex_wakeproc may have been through here already.
+		 * It sets p_exiting before taking any bucket lock.
+		 */
+		spinlock_release(&fb->fb_lock);
+		return EINTR;
+	}
+	if (*(volatile int *)PADDR_TO_KVADDR(paddr) != expected) {
+		spinlock_release(&fb->fb_lock);
+		return EAGAIN;
+	}
+	fw.fw_paddr = paddr;
+	fw.fw_proc = curproc;
+	fw.fw_woken = false;
+	fw.fw_result = 0;
+	fw.fw_next = NULL;
+	/* Go at the end, so waiters are woken in the order they came. */
+	for (fwp = &fb->fb_waiters; *fwp != NULL; fwp = &(*fwp)->fw_next) {
+		/* nothing */
+	}
+	*fwp = &fw;
+
+	while (!fw.fw_woken) {
+		/* Bridge to the wchan lock, as in P(). */
+		wchan_lock(fb->fb_wchan);
+		spinlock_release(&fb->fb_lock);
+		wchan_sleep(fb->fb_wchan);
+		spinlock_acquire(&fb->fb_lock);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	return fw.fw_result;
+}
+
+/*
+ * Wake up to N threads waiting on the int at UADDR, and return how
+ * many were woken.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int n, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **fwp, *fw;
+	paddr_t paddr;
+	int result, count;
+
+	result = futex_lookup(uaddr, &paddr);
+	if (result) {
+		return result;
+	}
+	fb = futex_bucket(paddr);
+
+	count = 0;
+	spinlock_acquire(&fb->fb_lock);
+	fwp = &fb->fb_waiters;
+	while (*fwp != NULL && count < n) {
+		fw = *fwp;
+		if (fw->fw_paddr == paddr) {
+			*fwp = fw->fw_next;
+			fw->fw_woken = true;
+			count++;
+		}
+		else {
+			fwp = &fw->fw_next;
+		}
+	}
+	if (count > 0) {
+		wchan_wakeall(fb->fb_wchan);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	*retval = count;
+	return 0;
+}
+
+void
+futex_wakeproc(struct proc *p)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter **fwp, *fw;
+	bool found;
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		fb = &futex_table[i];
+		found = false;
+		spinlock_acquire(&fb->fb_lock);
+		fwp = &fb->fb_waiters;
+		while (*fwp != NULL) {
+			fw = *fwp;
+			if (fw->fw_proc == p) {
+				*fwp = fw->fw_next;
+				fw->fw_woken = true;
+				fw->fw_result = EINTR;
+				found = true;
+			}
+			else {
+				fwp = &fw->fw_next;
+			}
+		}
+		if (found) {
+			wchan_wakeall(fb->fb_wchan);
+		}
+		spinlock_release(&fb->fb_lock);
+	}
+}
@@ -1,5 +1,7 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 #include <lib.h>
@@ -9,6 +11,7 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <copyinout.h>
+#include <spinlock.h>
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
@@ -23,6 +26,10 @@ void sys__exit(int exitcode) {
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
+  /* wait for any other threads to leave (or leave, if another
+     thread got here first) */
+  uthread_exitall();
+
   KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
   /*
@@ -31,9 +38,12 @@ void sys__exit(int exitcode) {
    * come back we'll be calling as_activate on a
    * half-destroyed address space. This tends to be
    * messily fatal.
+   *
+   * Freeing the pages can wait; let a worker do it while we finish
+   * exiting.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  as_destroy_later(as);
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
@@ -49,13 +59,11 @@ void sys__exit(int exitcode) {
 }
 
 
-/* stub handler for getpid() system call                */
+/* handler for getpid() system call                */
 int
 sys_getpid(pid_t *retval)
 {
-  /* for now, this is just a stub that always returns a PID of 1 */
-  /* you need to fix this to make it work properly */
-  *retval = 1;
+  *retval = curproc->p_pid;
   return(0);
 }
 
@@ -92,3 +100,73 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+
+/* handler for wait4(): waitpid(), plus the child's resource usage */
+
+int
+sys_wait4(pid_t pid,
+	  userptr_t status,
+	  int options,
+	  userptr_t usage,
+	  pid_t *retval)
+{
+  struct rusage ru;
+  int result;
+
+  result = sys_waitpid(pid,status,options,retval);
+  if (result) {
+    return(result);
+  }
+  if (usage == NULL) {
+    return(0);
+  }
+  /* waitpid doesn't find the child yet (see above), so there is no
+     usage to report for it; it is added to the kernel's
+     RUSAGE_CHILDREN totals when it exits instead */
+  bzero(&ru,sizeof(ru));
+  return(copyout(&ru,usage,sizeof(ru)));
+}
+
+/* convert nanosecond thread_usage times to a timeval */
+static
+void
+usage_totimeval(uint64_t ns, struct timeval *tv)
+{
+  tv->tv_sec = ns / 1000000000;
+  tv->tv_usec = (ns % 1000000000) / 1000;
+}
+
+/* handler for getrusage() system call */
+
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct proc *p = curproc;
+  struct thread_usage tu;
+  struct rusage ru;
+
+  switch (who) {
+  case RUSAGE_SELF:
+    proc_getusage(p,&tu);
+    break;
+  case RUSAGE_CHILDREN:
+    /* while waitpid is the stub above, user processes never collect
+       their children, so for them this stays zero; only the kernel
+       process accumulates the usage of the programs it runs */
+    spinlock_acquire(&p->p_lock);
+    tu = p->p_childusage;
+    spinlock_release(&p->p_lock);
+    break;
+  default:
+    return(EINVAL);
+  }
+
+  /* we only keep track of the times, faults, and switches */
+  bzero(&ru,sizeof(ru));
+  usage_totimeval(tu.tu_utime,&ru.ru_utime);
+  usage_totimeval(tu.tu_stime,&ru.ru_stime);
+  ru.ru_minflt = tu.tu_minflt;
+  ru.ru_nvcsw = tu.tu_nvcsw;
+  ru.ru_nivcsw = tu.tu_nivcsw;
+  return(copyout(&ru,usage,sizeof(ru)));
+}
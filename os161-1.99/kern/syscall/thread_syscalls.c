@@ -0,0 +1,320 @@
+/*
+ * User-level threads: thread_create, thread_exit and thread_join.
+ *
+ * Each user thread is a kernel thread in the same process, sharing
+ * its address space, with its own user stack from
+ * as_define_threadstack. The process keeps a table of THREAD_MAX
+ * slots (see proc.h) saying which threads exist and holding exit
+ * values until they're collected. Everything here is protected by
+ * p_lock; thread_join and _exit wait on p_uthreadwchan.
+ *
+ * _exit from any thread ends the whole process. The thread calling it
+ * sets p_exiting and waits for the others to go; each of them leaves
+ * the next time it's on its way back to user mode (see
+ * uthread_checkexit, called from the trap code). A thread asleep in
+ * the kernel, other than in thread_join or futex_wait, finishes what
+ * it was doing first.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <futex.h>
+#include <syscall.h>
+
+/* Generations wrap before thread ids would go negative. */
+#define UT_MAXGEN	(0x7fffffffU / THREAD_MAX)
+
+/* What a new thread needs to get to user mode. */
+struct uthread_startinfo {
+	vaddr_t us_entry;
+	vaddr_t us_func;
+	vaddr_t us_arg;
+	vaddr_t us_stack;
+	vaddr_t us_gp;
+};
+
+/*
+ * Mark slot SLOT free, with a new generation so the old id goes
+ * stale. Call with p_lock held.
+ */
+static
+void
+uthread_free(struct proc *p, unsigned slot)
+{
+	struct uthread *ut = &p->p_uthreads[slot];
+
+	KASSERT(spinlock_do_i_hold(&p->p_lock));
+
+	ut->ut_state = UT_FREE;
+	ut->ut_gen = (ut->ut_gen + 1) % UT_MAXGEN;
+	ut->ut_joining = false;
+	ut->ut_value = NULL;
+}
+
+/*
+ * Make the current thread go away, leaving VALUE for thread_join.
+ * If it's the only thread in the process still running, do nothing
+ * and return; the caller should _exit instead.
+ *
+ * p_nuthreads only drops once we're off p_threads, and after that we
+ * don't touch the process again, so a thread in _exit waiting for it
+ * to reach 1 can destroy the process as soon as it does.
+ */
+static
+void
+uthread_leave(userptr_t value)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	unsigned i, nrunning;
+
+	spinlock_acquire(&p->p_lock);
+	nrunning = 0;
+	for (i=0; i<THREAD_MAX; i++) {
+		if (p->p_uthreads[i].ut_state == UT_RUNNING) {
+			nrunning++;
+		}
+	}
+	if (nrunning == 1) {
+		spinlock_release(&p->p_lock);
+		return;
+	}
+	ut = &p->p_uthreads[curthread->t_tid % THREAD_MAX];
+	KASSERT(ut->ut_state == UT_RUNNING);
+	ut->ut_state = UT_EXITED;
+	ut->ut_value = value;
+	spinlock_release(&p->p_lock);
+
+	/* The stack stays with the slot, for the next thread to reuse. */
+	proc_remthread(curthread);
+
+	spinlock_acquire(&p->p_lock);
+	KASSERT(p->p_nuthreads > 1);
+	p->p_nuthreads--;
+	wchan_wakeall(p->p_uthreadwchan);
+	spinlock_release(&p->p_lock);
+
+	thread_exit();
+}
+
+void
+uthread_checkexit(void)
+{
+	struct proc *p = curproc;
+	bool leave;
+
+	/*
+	 * This runs on every return to user mode, so look without the
+	 * lock first. If we miss p_exiting being set, we'll see it
+	 * next time; _exit waits for us.
+	 */
+	if (!p->p_exiting) {
+		return;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	leave = p->p_exiter != curthread;
+	spinlock_release(&p->p_lock);
+
+	if (leave) {
+		/* The exiting thread is still here, so we aren't last. */
+		uthread_leave(NULL);
+		panic("uthread_checkexit: last thread left the process\n");
+	}
+}
+
+/*
+ * Called from sys__exit. Stop all the other threads, and return once
+ * the current thread is the only one left. If another thread is
+ * already exiting, leave instead.
+ */
+void
+uthread_exitall(void)
+{
+	struct proc *p = curproc;
+
+	spinlock_acquire(&p->p_lock);
+	if (p->p_exiting) {
+		spinlock_release(&p->p_lock);
+		uthread_leave(NULL);
+		panic("uthread_exitall: last thread left the process\n");
+	}
+	p->p_exiting = true;
+	p->p_exiter = curthread;
+
+	/* Get threads out of thread_join and futex_wait. */
+	wchan_wakeall(p->p_uthreadwchan);
+	spinlock_release(&p->p_lock);
+	futex_wakeproc(p);
+	spinlock_acquire(&p->p_lock);
+
+	while (p->p_nuthreads > 1) {
+		wchan_lock(p->p_uthreadwchan);
+		spinlock_release(&p->p_lock);
+		wchan_sleep(p->p_uthreadwchan);
+		spinlock_acquire(&p->p_lock);
+	}
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * First thing a new user thread runs.
+ */
+static
+void
+uthread_start(void *data1, unsigned long tid)
+{
+	struct uthread_startinfo *usp = data1;
+	struct uthread_startinfo us;
+
+	us = *usp;
+	kfree(usp);
+
+	curthread->t_tid = tid;
+
+	/* Don't start if the process is already on its way out. */
+	uthread_checkexit();
+
+	enter_new_thread(us.us_entry, us.us_func, us.us_arg, us.us_stack,
+			 us.us_gp);
+	panic("enter_new_thread returned\n");
+}
+
+/*
+ * Start a thread running ENTRY(FUNC, ARG). The C library passes its
+ * own start routine as ENTRY, which calls FUNC(ARG) and then
+ * thread_exit with the result. GP is the caller's global pointer.
+ */
+int
+sys___thread_create(userptr_t entry, userptr_t func, userptr_t arg,
+		    vaddr_t gp, int *retval)
+{
+	struct proc *p = curproc;
+	struct uthread_startinfo *us;
+	char name[32];
+	unsigned slot;
+	int tid, result;
+
+	us = kmalloc(sizeof(*us));
+	if (us == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	if (p->p_exiting) {
+		spinlock_release(&p->p_lock);
+		kfree(us);
+		return EAGAIN;
+	}
+	for (slot=1; slot<THREAD_MAX; slot++) {
+		if (p->p_uthreads[slot].ut_state == UT_FREE) {
+			break;
+		}
+	}
+	if (slot == THREAD_MAX) {
+		spinlock_release(&p->p_lock);
+		kfree(us);
+		return EAGAIN;
+	}
+	p->p_uthreads[slot].ut_state = UT_RUNNING;
+	p->p_nuthreads++;
+	tid = p->p_uthreads[slot].ut_gen * THREAD_MAX + slot;
+	spinlock_release(&p->p_lock);
+
+	/* The slot is ours now, so nobody else is using its stack. */
+	result = as_define_threadstack(p->p_addrspace, slot, &us->us_stack);
+	if (result) {
+		goto fail;
+	}
+	us->us_entry = (vaddr_t)entry;
+	us->us_func = (vaddr_t)func;
+	us->us_arg = (vaddr_t)arg;
+	us->us_gp = gp;
+
+	snprintf(name, sizeof(name), "%s/%d", p->p_name, tid);
+	result = thread_fork(name, p, uthread_start, us, tid);
+	if (result) {
+		goto fail;
+	}
+
+	*retval = tid;
+	return 0;
+
+ fail:
+	kfree(us);
+	spinlock_acquire(&p->p_lock);
+	uthread_free(p, slot);
+	p->p_nuthreads--;
+	wchan_wakeall(p->p_uthreadwchan);
+	spinlock_release(&p->p_lock);
+	return result;
+}
+
+/*
+ * Exit the current thread. The last thread exiting exits the process
+ * with status 0.
+ */
+void
+sys_thread_exit(userptr_t value)
+{
+	uthread_leave(value);
+	sys__exit(0);
+}
+
+/*
+ * Wait for thread TID to exit, and collect its value. Each thread can
+ * be joined once; after that its id may be reused.
+ */
+int
+sys_thread_join(int tid, userptr_t valueptr)
+{
+	struct proc *p = curproc;
+	struct uthread *ut;
+	userptr_t value;
+
+	if (tid < 0 || tid == curthread->t_tid) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	ut = &p->p_uthreads[tid % THREAD_MAX];
+	if (ut->ut_state == UT_FREE ||
+	    ut->ut_gen != (unsigned)tid / THREAD_MAX) {
+		spinlock_release(&p->p_lock);
+		return ESRCH;
+	}
+	if (ut->ut_joining) {
+		spinlock_release(&p->p_lock);
+		return EINVAL;
+	}
+	ut->ut_joining = true;
+	while (ut->ut_state != UT_EXITED && !p->p_exiting) {
+		wchan_lock(p->p_uthreadwchan);
+		spinlock_release(&p->p_lock);
+		wchan_sleep(p->p_uthreadwchan);
+		spinlock_acquire(&p->p_lock);
+	}
+	if (ut->ut_state != UT_EXITED) {
+		/* _exit in another thread; we're about to go anyway. */
+		ut->ut_joining = false;
+		spinlock_release(&p->p_lock);
+		return EINTR;
+	}
+	value = ut->ut_value;
+	uthread_free(p, tid % THREAD_MAX);
+	spinlock_release(&p->p_lock);
+
+	if (valueptr != NULL) {
+		return copyout(&value, valueptr, sizeof(value));
+	}
+	return 0;
+}
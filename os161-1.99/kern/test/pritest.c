@@ -0,0 +1,158 @@
+/*
+ * Test code for thread priorities and priority inheritance.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+/*
+ * The setup: a low-priority thread holds lock A. A medium-priority
+ * thread holds lock B and waits for A. A high-priority thread waits
+ * for B. The low thread should end up running at high priority,
+ * through the medium one, and go back to low when it lets go of A.
+ */
+#define PT_LOW		(PRI_DEFAULT + 4)
+#define PT_MID		(PRI_DEFAULT + 2)
+#define PT_HIGH		(PRI_DEFAULT - 2)
+
+/* How long to wait for something to happen, in hardclocks. */
+#define PT_PATIENCE	100
+
+static struct lock *pt_locka, *pt_lockb;
+static struct semaphore *pt_ready, *pt_go, *pt_done;
+static struct thread *volatile pt_lowthread;
+static volatile unsigned pt_lowafter;
+
+static
+void
+pt_low(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	thread_setpriority(PT_LOW);
+	lock_acquire(pt_locka);
+	pt_lowthread = curthread;
+	V(pt_ready);
+	P(pt_go);
+	lock_release(pt_locka);
+	pt_lowafter = curthread->t_priority;
+	V(pt_done);
+}
+
+static
+void
+pt_mid(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	thread_setpriority(PT_MID);
+	lock_acquire(pt_lockb);
+	V(pt_ready);
+	lock_acquire(pt_locka);
+	lock_release(pt_locka);
+	lock_release(pt_lockb);
+	V(pt_done);
+}
+
+static
+void
+pt_high(void *junk, unsigned long junk2)
+{
+	(void)junk;
+	(void)junk2;
+
+	thread_setpriority(PT_HIGH);
+	lock_acquire(pt_lockb);
+	lock_release(pt_lockb);
+	V(pt_done);
+}
+
+/*
+ * Wait for the low thread to be running at priority PRI, which
+ * happens once the thread lending it has gone to sleep.
+ */
+static
+void
+pt_expect(const char *what, unsigned pri)
+{
+	unsigned i;
+
+	for (i=0; i<PT_PATIENCE && pt_lowthread->t_priority != pri; i++) {
+		clocknap(1);
+	}
+	kprintf("  %s: low thread at priority %u\n", what,
+		pt_lowthread->t_priority);
+	if (pt_lowthread->t_priority != pri) {
+		panic("pritest: expected priority %u\n", pri);
+	}
+}
+
+static
+void
+pt_fork(const char *name, void (*func)(void *, unsigned long))
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, 0);
+	if (result) {
+		panic("pritest: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+int
+pritest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting priority inheritance test...\n");
+
+	pt_locka = lock_create("pritest A");
+	pt_lockb = lock_create("pritest B");
+	pt_ready = sem_create("pritest ready", 0);
+	pt_go = sem_create("pritest go", 0);
+	pt_done = sem_create("pritest done", 0);
+	if (pt_locka == NULL || pt_lockb == NULL || pt_ready == NULL ||
+	    pt_go == NULL || pt_done == NULL) {
+		panic("pritest: out of memory\n");
+	}
+	pt_lowthread = NULL;
+
+	pt_fork("pritest low", pt_low);
+	P(pt_ready);
+	if (pt_lowthread->t_priority != PT_LOW) {
+		panic("pritest: low thread at priority %u, not %u\n",
+		      pt_lowthread->t_priority, PT_LOW);
+	}
+
+	pt_fork("pritest mid", pt_mid);
+	P(pt_ready);
+	pt_expect("mid waiting", PT_MID);
+
+	pt_fork("pritest high", pt_high);
+	pt_expect("high waiting", PT_HIGH);
+
+	V(pt_go);
+	P(pt_done);
+	P(pt_done);
+	P(pt_done);
+	kprintf("  released: low thread at priority %u\n", pt_lowafter);
+	if (pt_lowafter != PT_LOW) {
+		panic("pritest: expected priority %u\n", PT_LOW);
+	}
+
+	sem_destroy(pt_done);
+	sem_destroy(pt_go);
+	sem_destroy(pt_ready);
+	lock_destroy(pt_lockb);
+	lock_destroy(pt_locka);
+
+	kprintf("Priority inheritance test done.\n");
+	return 0;
+}
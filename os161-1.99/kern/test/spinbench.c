@@ -0,0 +1,292 @@
+/*
+ * Spinlock latency benchmark: plain test-and-test-and-set locks
+ * against queued (MCS) locks.
+ *
+ * For each cpu count, one thread per cpu hammers a single lock and
+ * times every acquire, from asking for the lock to getting it, in cpu
+ * cycles. Averages hide unfairness, so we report the tail: the 50th
+ * and 99th percentile and the worst case. Percentiles come from a
+ * power-of-two histogram, so they're upper bounds.
+ *
+ * The cycle counter goes back to zero at every hardclock, even with
+ * interrupts off, so an acquire that straddles a tick can't be timed.
+ * Those show up as the end coming before the start, and are left out
+ * and counted as dropped.
+ *
+ * Use sys161.conf to set the number of cpus. Counts bigger than that
+ * are skipped.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <mainbus.h>
+#include <test.h>
+
+/* Acquires per thread per run. */
+#define SB_ITERS	2000
+
+/* Work done holding the lock, and between acquires. */
+#define SB_HOLDLOOPS	20
+#define SB_GAPLOOPS	50
+
+/* How many times a thread yields looking for a cpu of its own. */
+#define SB_PATIENCE	1000
+
+#define SB_NBUCKETS	32
+
+static const unsigned sb_cpucounts[] = { 2, 4, 8, 16, 32 };
+#define SB_NCOUNTS (sizeof(sb_cpucounts) / sizeof(sb_cpucounts[0]))
+
+struct sb_result {
+	unsigned sr_hist[SB_NBUCKETS];	/* acquires by log2 of cycles */
+	uint64_t sr_total;		/* sum of cycles */
+	uint32_t sr_max;		/* worst */
+	unsigned sr_count;
+	unsigned sr_dropped;		/* spanned a counter reset */
+};
+
+static struct spinlock sb_plainlock = SPINLOCK_INITIALIZER;
+static struct spinlock sb_queuedlock = SPINLOCK_INITIALIZER_QUEUED;
+
+/* Setup state, protected by sb_setuplock. */
+static struct spinlock sb_setuplock = SPINLOCK_INITIALIZER;
+static uint32_t sb_cpusclaimed;
+static struct sb_result sb_total;
+
+static struct semaphore *sb_ready, *sb_done;
+static volatile bool sb_go;
+static volatile unsigned sb_counter;
+
+static
+unsigned
+sb_log2(uint32_t x)
+{
+	unsigned i = 0;
+
+	while (x > 1 && i < SB_NBUCKETS - 1) {
+		x >>= 1;
+		i++;
+	}
+	return i;
+}
+
+static
+void
+sb_delay(unsigned loops)
+{
+	volatile unsigned i;
+
+	for (i=0; i<loops; i++) {
+		/* nothing */
+	}
+}
+
+/*
+ * Try to get a cpu no other benchmark thread is on. Idle cpus steal
+ * work, so yielding a while usually spreads the threads out; if it
+ * doesn't, go ahead anyway and share.
+ */
+static
+void
+sb_claimcpu(void)
+{
+	unsigned i, me;
+	bool gotit;
+
+	for (i=0; i<SB_PATIENCE; i++) {
+		spinlock_acquire(&sb_setuplock);
+		me = curcpu->c_number;
+		gotit = (sb_cpusclaimed & (1U << me)) == 0;
+		if (gotit) {
+			sb_cpusclaimed |= 1U << me;
+		}
+		spinlock_release(&sb_setuplock);
+		if (gotit) {
+			return;
+		}
+		thread_yield();
+	}
+}
+
+static
+void
+sb_thread(void *lkv, unsigned long junk)
+{
+	struct spinlock *lk = lkv;
+	struct sb_result mine;
+	uint32_t start, end, cycles;
+	unsigned i;
+	int spl;
+
+	(void)junk;
+
+	bzero(&mine, sizeof(mine));
+
+	sb_claimcpu();
+	V(sb_ready);
+	while (!sb_go) {
+		/* Don't yield, or we might lose our cpu. */
+	}
+
+	for (i=0; i<SB_ITERS; i++) {
+		spl = splhigh();
+		start = mainbus_cycles();
+		spinlock_acquire(lk);
+		end = mainbus_cycles();
+		sb_counter++;
+		sb_delay(SB_HOLDLOOPS);
+		spinlock_release(lk);
+		splx(spl);
+
+		if (end < start) {
+			/* The counter was reset in between. */
+			mine.sr_dropped++;
+		}
+		else {
+			cycles = end - start;
+			mine.sr_hist[sb_log2(cycles)]++;
+			mine.sr_total += cycles;
+			if (cycles > mine.sr_max) {
+				mine.sr_max = cycles;
+			}
+			mine.sr_count++;
+		}
+
+		sb_delay(SB_GAPLOOPS);
+	}
+
+	spinlock_acquire(&sb_setuplock);
+	for (i=0; i<SB_NBUCKETS; i++) {
+		sb_total.sr_hist[i] += mine.sr_hist[i];
+	}
+	sb_total.sr_total += mine.sr_total;
+	if (mine.sr_max > sb_total.sr_max) {
+		sb_total.sr_max = mine.sr_max;
+	}
+	sb_total.sr_count += mine.sr_count;
+	sb_total.sr_dropped += mine.sr_dropped;
+	spinlock_release(&sb_setuplock);
+
+	V(sb_done);
+}
+
+/* Upper bound of the bucket containing percentile PCT. */
+static
+uint32_t
+sb_percentile(const struct sb_result *sr, unsigned pct)
+{
+	unsigned i, seen, want;
+
+	want = DIVROUNDUP(sr->sr_count * pct, 100);
+	seen = 0;
+	for (i=0; i<SB_NBUCKETS; i++) {
+		seen += sr->sr_hist[i];
+		if (seen >= want) {
+			return i == SB_NBUCKETS - 1 ? sr->sr_max : (2U << i) - 1;
+		}
+	}
+	return sr->sr_max;
+}
+
+static
+unsigned
+sb_popcount(uint32_t x)
+{
+	unsigned n = 0;
+
+	while (x != 0) {
+		x &= x - 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Run NTHREADS threads against lock LK and print a line of results.
+ */
+static
+void
+sb_run(const char *what, struct spinlock *lk, unsigned nthreads)
+{
+	char name[32];
+	unsigned i, ncpus;
+	int result;
+
+	bzero(&sb_total, sizeof(sb_total));
+	sb_cpusclaimed = 0;
+	sb_go = false;
+
+	for (i=0; i<nthreads; i++) {
+		snprintf(name, sizeof(name), "spinbench %u", i);
+		result = thread_fork(name, NULL, sb_thread, lk, 0);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sb_ready);
+	}
+	spinlock_acquire(&sb_setuplock);
+	ncpus = sb_popcount(sb_cpusclaimed);
+	spinlock_release(&sb_setuplock);
+
+	sb_go = true;
+	for (i=0; i<nthreads; i++) {
+		P(sb_done);
+	}
+
+	if (sb_total.sr_count == 0) {
+		kprintf("%-6s %7u %6u (no samples)\n", what, nthreads, ncpus);
+		return;
+	}
+	kprintf("%-6s %7u %6u %9llu %9u %9u %9u %7u\n", what, nthreads,
+		ncpus,
+		(unsigned long long)(sb_total.sr_total / sb_total.sr_count),
+		sb_percentile(&sb_total, 50), sb_percentile(&sb_total, 99),
+		sb_total.sr_max, sb_total.sr_dropped);
+}
+
+int
+spinlockbench(int nargs, char **args)
+{
+	unsigned i, numcpus;
+
+	(void)nargs;
+	(void)args;
+
+	numcpus = cpu_count();
+	if (numcpus < 2) {
+		kprintf("spinbench: needs at least 2 cpus "
+			"(see sys161.conf)\n");
+		return 0;
+	}
+
+	sb_ready = sem_create("spinbench ready", 0);
+	sb_done = sem_create("spinbench done", 0);
+	if (sb_ready == NULL || sb_done == NULL) {
+		panic("spinbench: sem_create failed\n");
+	}
+
+	kprintf("Spinlock acquire latency, %u acquires per thread "
+		"(cycles):\n", SB_ITERS);
+	kprintf("%-6s %7s %6s %9s %9s %9s %9s %7s\n", "lock", "threads",
+		"cpus", "mean", "p50<=", "p99<=", "max", "dropped");
+	for (i=0; i<SB_NCOUNTS && sb_cpucounts[i] <= numcpus; i++) {
+		sb_run("plain", &sb_plainlock, sb_cpucounts[i]);
+		sb_run("queued", &sb_queuedlock, sb_cpucounts[i]);
+	}
+	kprintf("(\"cpus\" is how many cpus the threads ended up on; "
+		"\"dropped\" acquires\n spanned a clock tick and weren't "
+		"timed)\n");
+
+	sem_destroy(sb_done);
+	sem_destroy(sb_ready);
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
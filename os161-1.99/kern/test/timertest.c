@@ -0,0 +1,153 @@
+/*
+ * Test code for kernel timers and thread_sleep_until.
+ */
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+/* Delays in hardclocks. Some land in level 0 of the wheel, some don't. */
+static const unsigned tt_delays[] = { 1, 3, 63, 64, 70, 200 };
+#define NTIMERS (sizeof(tt_delays) / sizeof(tt_delays[0]))
+
+/* Far enough off to go in level 2; cancelled before it's due. */
+#define TT_LONGDELAY	10000
+
+struct tt_timer {
+	struct timer tt_timer;
+	unsigned tt_firedat;		/* c_hardclocks when it went off */
+	unsigned tt_fires;		/* how many times it went off */
+	struct semaphore *tt_sem;
+};
+
+static
+void
+tt_fire(void *data)
+{
+	struct tt_timer *tt = data;
+
+	tt->tt_firedat = curcpu->c_hardclocks;
+	tt->tt_fires++;
+	if (tt->tt_sem != NULL) {
+		V(tt->tt_sem);
+	}
+}
+
+/*
+ * Start a batch of timers with different delays and check that each
+ * goes off exactly once, and not before it was due. Then check that
+ * cancelling works, and that a cancelled timer stays quiet.
+ */
+static
+void
+timertest_timers(void)
+{
+	struct tt_timer tts[NTIMERS], longtt;
+	struct semaphore *sem;
+	unsigned i;
+
+	sem = sem_create("timertest", 0);
+	if (sem == NULL) {
+		panic("timertest: sem_create failed\n");
+	}
+
+	kprintf("Starting %u timers...\n", (unsigned)NTIMERS);
+	for (i=0; i<NTIMERS; i++) {
+		tts[i].tt_firedat = 0;
+		tts[i].tt_fires = 0;
+		tts[i].tt_sem = sem;
+		timer_init(&tts[i].tt_timer, tt_fire, &tts[i]);
+		timer_start(&tts[i].tt_timer, tt_delays[i]);
+	}
+	for (i=0; i<NTIMERS; i++) {
+		P(sem);
+	}
+	for (i=0; i<NTIMERS; i++) {
+		if (tts[i].tt_fires != 1) {
+			panic("timertest: timer %u went off %u times\n",
+			      i, tts[i].tt_fires);
+		}
+		if ((int)(tts[i].tt_firedat -
+			  tts[i].tt_timer.tm_expires) < 0) {
+			panic("timertest: timer %u went off at %u, "
+			      "due at %u\n", i, tts[i].tt_firedat,
+			      tts[i].tt_timer.tm_expires);
+		}
+		kprintf("  delay %4u: due %u, went off %u\n", tt_delays[i],
+			tts[i].tt_timer.tm_expires, tts[i].tt_firedat);
+	}
+
+	kprintf("Cancelling a timer...\n");
+	longtt.tt_firedat = 0;
+	longtt.tt_fires = 0;
+	longtt.tt_sem = NULL;
+	timer_init(&longtt.tt_timer, tt_fire, &longtt);
+	if (timer_cancel(&longtt.tt_timer)) {
+		panic("timertest: cancelled a timer that wasn't started\n");
+	}
+	timer_start(&longtt.tt_timer, TT_LONGDELAY);
+	clocknap(2);
+	if (!timer_cancel(&longtt.tt_timer)) {
+		panic("timertest: couldn't cancel a pending timer\n");
+	}
+	if (timer_cancel(&longtt.tt_timer)) {
+		panic("timertest: cancelled a timer twice\n");
+	}
+	if (longtt.tt_fires != 0) {
+		panic("timertest: cancelled timer went off\n");
+	}
+
+	sem_destroy(sem);
+}
+
+/*
+ * Sleep until a deadline a little way off and check we didn't wake
+ * up early.
+ */
+static
+void
+timertest_sleep(void)
+{
+	struct timespec deadline;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+
+	for (i=1; i<=3; i++) {
+		gettime(&secs, &nsecs);
+		nsecs += i * 150000000;
+		deadline.tv_sec = secs + nsecs / 1000000000;
+		deadline.tv_nsec = nsecs % 1000000000;
+
+		thread_sleep_until(&deadline);
+
+		gettime(&secs, &nsecs);
+		if (secs < deadline.tv_sec ||
+		    (secs == deadline.tv_sec &&
+		     nsecs < (uint32_t)deadline.tv_nsec)) {
+			panic("timertest: woke up early\n");
+		}
+		getinterval(deadline.tv_sec, deadline.tv_nsec, secs, nsecs,
+			    &secs, &nsecs);
+		kprintf("  slept %u ms: woke %lu.%09lu s late\n", i * 150,
+			(unsigned long)secs, (unsigned long)nsecs);
+	}
+}
+
+int
+timertest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting timer test...\n");
+	timertest_timers();
+	timertest_sleep();
+	kprintf("Timer test done.\n");
+
+	return 0;
+}
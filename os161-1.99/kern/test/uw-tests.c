@@ -291,3 +291,148 @@ uwvmstatstest(int nargs, char **args)
 }
 
 
+
+/*-----------------------------------------------------------------------*/
+
+/*
+ * Reader-writer lock stress test. Writers bump two counters together;
+ * readers check they never see them differ and never see a writer
+ * in with them. Readers outnumber writers, as they would on a
+ * read-mostly structure.
+ */
+
+#define NRWREADERS    (12)
+#define NRWWRITERS    (4)
+
+static struct rwlock *testrwlock = NULL;
+static struct spinlock rw_inside_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rw_readers_inside = 0;
+static volatile unsigned rw_writers_inside = 0;
+static volatile int rw_value1 = START_VALUE;
+static volatile int rw_value2 = START_VALUE;
+static volatile unsigned rw_errors = 0;
+
+static
+void
+rw_reader_thread(void *junk, unsigned long num)
+{
+	int i, v1, v2;
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NTESTLOOPS; i++) {
+		rwlock_acquire_read(testrwlock);
+
+		spinlock_acquire(&rw_inside_lock);
+		rw_readers_inside++;
+		if (rw_writers_inside != 0) {
+			rw_errors++;
+		}
+		spinlock_release(&rw_inside_lock);
+
+		v1 = rw_value1;
+		v2 = rw_value2;
+		if (v1 != v2) {
+			rw_errors++;
+		}
+
+		spinlock_acquire(&rw_inside_lock);
+		rw_readers_inside--;
+		spinlock_release(&rw_inside_lock);
+
+		rwlock_release_read(testrwlock);
+	}
+	V(donesem);
+	thread_exit();
+}
+
+static
+void
+rw_writer_thread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NTESTLOOPS / 8; i++) {
+		rwlock_acquire_write(testrwlock);
+
+		spinlock_acquire(&rw_inside_lock);
+		rw_writers_inside++;
+		if (rw_readers_inside != 0 || rw_writers_inside != 1) {
+			rw_errors++;
+		}
+		spinlock_release(&rw_inside_lock);
+
+		/* Leave a window in which a reader could see them differ. */
+		rw_value1 = rw_value1 + 1;
+		thread_yield();
+		rw_value2 = rw_value2 + 1;
+
+		spinlock_acquire(&rw_inside_lock);
+		rw_writers_inside--;
+		spinlock_release(&rw_inside_lock);
+
+		rwlock_release_write(testrwlock);
+	}
+	V(donesem);
+	thread_exit();
+}
+
+int
+uwrwlocktest(int nargs, char **args)
+{
+	int i, result;
+	char name[NAME_LEN];
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("uwrwlocktest: rwlock_create failed\n");
+	}
+	rw_value1 = rw_value2 = START_VALUE;
+	rw_errors = 0;
+	kprintf("Starting uwrwlocktest...\n");
+
+	for (i=0; i<NRWREADERS; i++) {
+		snprintf(name, NAME_LEN, "rw_reader %d", i);
+		result = thread_fork(name, NULL, rw_reader_thread, NULL, i);
+		if (result) {
+			panic("uwrwlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWWRITERS; i++) {
+		snprintf(name, NAME_LEN, "rw_writer %d", i);
+		result = thread_fork(name, NULL, rw_writer_thread, NULL, i);
+		if (result) {
+			panic("uwrwlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NRWREADERS + NRWWRITERS; i++) {
+		P(donesem);
+	}
+
+	rwlock_printstats(testrwlock);
+	kprintf("value = %d should be %d, %u errors\n", rw_value1,
+		START_VALUE + NRWWRITERS * (NTESTLOOPS / 8), rw_errors);
+	if (rw_errors == 0 && rw_value1 == rw_value2 &&
+	    rw_value1 == START_VALUE + NRWWRITERS * (NTESTLOOPS / 8)) {
+		kprintf("TEST SUCCEEDED\n");
+	} else {
+		kprintf("TEST FAILED\n");
+	}
+	KASSERT(rw_errors == 0);
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+	cleanitems();
+	kprintf("uwrwlocktest done.\n");
+
+	return 0;
+}
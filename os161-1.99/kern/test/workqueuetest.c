@@ -0,0 +1,241 @@
+/*
+ * Test code for workqueues.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define WT_NITEMS	64
+
+struct wt_item {
+	struct work wi_work;
+	unsigned wi_index;
+};
+
+static struct wt_item wt_items[WT_NITEMS];
+
+static struct spinlock wt_lock = SPINLOCK_INITIALIZER;
+static unsigned wt_ran;			/* items that have run */
+static unsigned wt_order[WT_NITEMS];	/* indexes in the order run */
+static unsigned wt_inside;		/* items running right now */
+static unsigned wt_maxinside;		/* most at once */
+
+static
+void
+wt_reset(void)
+{
+	spinlock_acquire(&wt_lock);
+	wt_ran = 0;
+	wt_inside = 0;
+	wt_maxinside = 0;
+	spinlock_release(&wt_lock);
+}
+
+static
+void
+wt_func(void *data)
+{
+	struct wt_item *wi = data;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&wt_lock);
+	wt_inside++;
+	if (wt_inside > wt_maxinside) {
+		wt_maxinside = wt_inside;
+	}
+	spinlock_release(&wt_lock);
+
+	/* Give other workers a chance to overlap with us. */
+	thread_yield();
+
+	spinlock_acquire(&wt_lock);
+	wt_order[wt_ran++] = wi->wi_index;
+	wt_inside--;
+	spinlock_release(&wt_lock);
+}
+
+static
+void
+wt_submitall(struct workqueue *wq)
+{
+	unsigned i;
+
+	for (i=0; i<WT_NITEMS; i++) {
+		wt_items[i].wi_index = i;
+		work_init(&wt_items[i].wi_work, wt_func, &wt_items[i]);
+		if (!workqueue_submit(wq, &wt_items[i].wi_work)) {
+			panic("workqueuetest: fresh item %u was pending\n", i);
+		}
+	}
+}
+
+/*
+ * Every item on an unordered queue runs once, and flush waits for
+ * them all.
+ */
+static
+void
+wt_unordered(void)
+{
+	struct workqueue *wq;
+
+	kprintf("Unordered queue...\n");
+	wq = workqueue_create("wqtest unordered", false);
+	if (wq == NULL) {
+		panic("workqueuetest: workqueue_create failed\n");
+	}
+	wt_reset();
+	wt_submitall(wq);
+	workqueue_flush(wq);
+	if (wt_ran != WT_NITEMS) {
+		panic("workqueuetest: %u of %u items ran\n", wt_ran, WT_NITEMS);
+	}
+	kprintf("  %u items ran, at most %u at once\n", wt_ran,
+		wt_maxinside);
+	workqueue_destroy(wq);
+}
+
+/*
+ * Items on an ordered queue run one at a time, in order.
+ */
+static
+void
+wt_ordered(void)
+{
+	struct workqueue *wq;
+	unsigned i;
+
+	kprintf("Ordered queue...\n");
+	wq = workqueue_create("wqtest ordered", true);
+	if (wq == NULL) {
+		panic("workqueuetest: workqueue_create failed\n");
+	}
+	wt_reset();
+	wt_submitall(wq);
+	workqueue_flush(wq);
+	if (wt_ran != WT_NITEMS) {
+		panic("workqueuetest: %u of %u items ran\n", wt_ran, WT_NITEMS);
+	}
+	if (wt_maxinside != 1) {
+		panic("workqueuetest: %u ordered items ran at once\n",
+		      wt_maxinside);
+	}
+	for (i=0; i<WT_NITEMS; i++) {
+		if (wt_order[i] != i) {
+			panic("workqueuetest: item %u ran in place %u\n",
+			      wt_order[i], i);
+		}
+	}
+	kprintf("  %u items ran in order\n", wt_ran);
+	workqueue_destroy(wq);
+}
+
+static struct semaphore *wt_gate, *wt_sem;
+
+static
+void
+wt_block(void *junk)
+{
+	(void)junk;
+	P(wt_gate);
+}
+
+static
+void
+wt_signal(void *junk)
+{
+	(void)junk;
+	KASSERT(!curthread->t_in_interrupt);
+	V(wt_sem);
+}
+
+/*
+ * An item that's still pending can't be submitted again. Stall an
+ * ordered queue so the second item is sure to be waiting.
+ */
+static
+void
+wt_pending(void)
+{
+	struct workqueue *wq;
+	struct work blocker, item;
+
+	kprintf("Resubmitting a pending item...\n");
+	wq = workqueue_create("wqtest pending", true);
+	if (wq == NULL) {
+		panic("workqueuetest: workqueue_create failed\n");
+	}
+	work_init(&blocker, wt_block, NULL);
+	work_init(&item, wt_signal, NULL);
+	workqueue_submit(wq, &blocker);
+	if (!workqueue_submit(wq, &item)) {
+		panic("workqueuetest: fresh item was pending\n");
+	}
+	if (workqueue_submit(wq, &item)) {
+		panic("workqueuetest: pending item submitted twice\n");
+	}
+	V(wt_gate);
+	P(wt_sem);
+	workqueue_flush(wq);
+	if (!workqueue_submit(wq, &item)) {
+		panic("workqueuetest: finished item still pending\n");
+	}
+	P(wt_sem);
+	workqueue_destroy(wq);
+}
+
+static
+void
+wt_timerfunc(void *data)
+{
+	workqueue_submit(workqueue_system, data);
+}
+
+/*
+ * Work submitted from interrupt context runs in a thread.
+ */
+static
+void
+wt_frominterrupt(void)
+{
+	struct timer timer;
+	struct work item;
+
+	kprintf("Submitting from a timer...\n");
+	work_init(&item, wt_signal, NULL);
+	timer_init(&timer, wt_timerfunc, &item);
+	timer_start(&timer, 2);
+	P(wt_sem);
+}
+
+int
+workqueuetest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting workqueue test...\n");
+
+	wt_gate = sem_create("wqtest gate", 0);
+	wt_sem = sem_create("wqtest", 0);
+	if (wt_gate == NULL || wt_sem == NULL) {
+		panic("workqueuetest: sem_create failed\n");
+	}
+
+	wt_unordered();
+	wt_ordered();
+	wt_pending();
+	wt_frominterrupt();
+
+	sem_destroy(wt_sem);
+	sem_destroy(wt_gate);
+	kprintf("Workqueue test done.\n");
+	return 0;
+}
@@ -28,20 +28,24 @@
  */
 
 #include <types.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <spl.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
+#include <mainbus.h>
+#include <prof.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Timed events are kept on a timer wheel on each cpu and run from
+ * hardclock(); see below.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,82 +55,527 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+/* Length of a hardclock, in nanoseconds. */
+#define NSECS_PER_HARDCLOCK	(1000000000 / HZ)
+
+////////////////////////////////////////////////////////////
+//
+// Timer wheel
+
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Each cpu has a hierarchical timing wheel ("Hashed and Hierarchical
+ * Timing Wheels", Varghese and Lauck) of TW_LEVELS levels of TW_SIZE
+ * slots. Times are in that cpu's hardclocks (c_hardclocks).
+ *
+ * A timer due less than TW_SIZE ticks ahead goes in level 0, in the
+ * slot for its exact expiry tick. One due further ahead goes in the
+ * level where its distance fits, in the slot for the corresponding
+ * bits of its expiry time. Each time the level 0 index wraps round,
+ * the current slot of level 1 is emptied and its timers reinserted,
+ * which puts them in level 0; and likewise upwards. So adding and
+ * cancelling are constant time, and each tick only looks at the
+ * timers that are due (plus, now and then, a cascade).
+ *
+ * Timers due beyond the reach of the wheel are parked in the last
+ * level and simply reinserted when they come round.
+ *
+ * tw_next is the next tick to process. Everything in a wheel is
+ * protected by its tw_lock; timer functions are called without it.
  */
-static struct wchan *lbolt;
+#define TW_BITS		6
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+#define TW_RANGE	(1U << (TW_BITS * TW_LEVELS))
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	unsigned tw_next;		/* next tick to process */
+	unsigned tw_count;		/* number of timers pending */
+	struct timer *tw_slots[TW_LEVELS][TW_SIZE];
+
+	/* Statistics; protected by tw_lock. */
+	unsigned tw_started;		/* timer_start calls */
+	unsigned tw_fired;		/* timers that went off */
+	unsigned tw_cancelled;		/* timers cancelled while pending */
+	unsigned tw_cascaded;		/* timers moved down a level */
+};
+
+static void hardclock_catchup(struct cpu *c);
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Set up the timer wheel for a new cpu. Called from cpu_create.
  */
-static struct wchan *minibolt;
+void
+timer_cpu_init(struct cpu *c)
+{
+	struct timerwheel *tw;
+	unsigned i, j;
+
+	tw = kmalloc(sizeof(*tw));
+	if (tw == NULL) {
+		panic("timer_cpu_init: Out of memory\n");
+	}
+	spinlock_init(&tw->tw_lock);
+	spinlock_setname(&tw->tw_lock, "timerwheel");
+	tw->tw_next = c->c_hardclocks + 1;
+	tw->tw_count = 0;
+	for (i=0; i<TW_LEVELS; i++) {
+		for (j=0; j<TW_SIZE; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+	tw->tw_started = 0;
+	tw->tw_fired = 0;
+	tw->tw_cancelled = 0;
+	tw->tw_cascaded = 0;
+	c->c_timerwheel = tw;
+}
 
-/* 
- * number of minibolts per second
+/*
+ * Put T in the right slot of TW.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+static
+void
+tw_insert(struct timerwheel *tw, struct timer *t)
+{
+	struct timer **slot;
+	unsigned delta, expires, level;
+
+	KASSERT(spinlock_do_i_hold(&tw->tw_lock));
+
+	expires = t->tm_expires;
+	delta = expires - tw->tw_next;
+	if ((int)delta < 0) {
+		/* Already due; run it on the next tick processed. */
+		expires = tw->tw_next;
+		delta = 0;
+	}
+	else if (delta >= TW_RANGE) {
+		/* Too far off; park it at the end of the wheel. */
+		expires = tw->tw_next + TW_RANGE - 1;
+		delta = TW_RANGE - 1;
+	}
+
+	for (level = 0; delta >= (1U << (TW_BITS * (level + 1))); level++) {
+		/* nothing */
+	}
+	slot = &tw->tw_slots[level][(expires >> (TW_BITS * level)) & TW_MASK];
+
+	t->tm_next = *slot;
+	if (t->tm_next != NULL) {
+		t->tm_next->tm_pprev = &t->tm_next;
+	}
+	t->tm_pprev = slot;
+	*slot = t;
+}
+
+static
+void
+tw_remove(struct timer *t)
+{
+	*t->tm_pprev = t->tm_next;
+	if (t->tm_next != NULL) {
+		t->tm_next->tm_pprev = t->tm_pprev;
+	}
+	t->tm_next = NULL;
+	t->tm_pprev = NULL;
+}
 
 /*
- * minibolt countdown
+ * Reinsert everything in slot SLOT of level LEVEL. Returns SLOT, so
+ * the caller knows whether this level's index wrapped too.
  */
-static int minicount;
+static
+unsigned
+tw_cascade(struct timerwheel *tw, unsigned level, unsigned slot)
+{
+	struct timer *t, *next;
+
+	t = tw->tw_slots[level][slot];
+	tw->tw_slots[level][slot] = NULL;
+	for (; t != NULL; t = next) {
+		next = t->tm_next;
+		t->tm_next = NULL;
+		t->tm_pprev = NULL;
+		tw_insert(tw, t);
+		tw->tw_cascaded++;
+	}
+	return slot;
+}
 
 /*
- * Setup.
+ * Process ticks on the current cpu's wheel up to and including
+ * c_hardclocks, and call the functions of the timers that expired.
+ * Called from hardclock().
  */
+static
 void
-hardclock_bootstrap(void)
+tw_run(struct cpu *c)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	struct timerwheel *tw = c->c_timerwheel;
+	struct timer *t, *next, *expired;
+	unsigned index, level;
+
+	expired = NULL;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0) {
+		/* Nothing to do; skip straight to now. */
+		tw->tw_next = c->c_hardclocks + 1;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	while ((int)(c->c_hardclocks - tw->tw_next) >= 0) {
+		index = tw->tw_next & TW_MASK;
+		for (level = 1; index == 0 && level < TW_LEVELS; level++) {
+			index = tw_cascade(tw, level,
+				(tw->tw_next >> (TW_BITS * level)) & TW_MASK);
+		}
+		index = tw->tw_next & TW_MASK;
+		t = tw->tw_slots[0][index];
+		tw->tw_slots[0][index] = NULL;
+		for (; t != NULL; t = next) {
+			next = t->tm_next;
+			t->tm_next = NULL;
+			t->tm_pprev = NULL;
+			if ((int)(t->tm_expires - tw->tw_next) > 0) {
+				/* Parked; not due yet. */
+				tw_insert(tw, t);
+				continue;
+			}
+			t->tm_cpu = NULL;
+			t->tm_next = expired;
+			expired = t;
+			tw->tw_count--;
+			tw->tw_fired++;
+		}
+		tw->tw_next++;
+	}
+	spinlock_release(&tw->tw_lock);
+
+	/*
+	 * Once tm_cpu is NULL the timer is no longer ours; its function
+	 * might restart it, so grab the link first.
+	 */
+	for (t = expired; t != NULL; t = next) {
+		next = t->tm_next;
+		t->tm_next = NULL;
+		t->tm_func(t->tm_data);
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
 }
 
 /*
- * This is called once every every LT_GRANULARITY usec, on one processor,
- * by the timer code.
+ * Number of hardclocks from now until the current cpu's wheel next
+ * needs looking at, or 0 if it's empty. That's either the first
+ * timer in level 0 or, if there's none, the next cascade.
  */
+static
+unsigned
+tw_nextevent(struct cpu *c)
+{
+	struct timerwheel *tw = c->c_timerwheel;
+	unsigned i, ret;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0) {
+		ret = 0;
+	}
+	else {
+		/* The next cascade, unless something in level 0 is sooner. */
+		ret = ((TW_SIZE - (tw->tw_next & TW_MASK)) & TW_MASK) + 1;
+		for (i=0; i+1 < ret; i++) {
+			if (tw->tw_slots[0][(tw->tw_next + i) & TW_MASK]
+			    != NULL) {
+				ret = i + 1;
+				break;
+			}
+		}
+		/* Allow for ticks not yet processed. */
+		ret += tw->tw_next - 1 - c->c_hardclocks;
+	}
+	spinlock_release(&tw->tw_lock);
+	return ret;
+}
+
 void
-timerclock(void)
+timer_init(struct timer *t, void (*func)(void *), void *data)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	t->tm_next = NULL;
+	t->tm_pprev = NULL;
+	t->tm_cpu = NULL;
+	t->tm_expires = 0;
+	t->tm_func = func;
+	t->tm_data = data;
+}
+
+void
+timer_start(struct timer *t, unsigned ticks)
+{
+	struct cpu *c;
+	struct timerwheel *tw;
+	int spl;
+
+	KASSERT(t->tm_cpu == NULL);
+	KASSERT(ticks > 0);
+
+	/* Don't get moved to another cpu halfway through. */
+	spl = splhigh();
+	c = curcpu->c_self;
+	tw = c->c_timerwheel;
+
+	if (c->c_tickless) {
+		/*
+		 * We're in an interrupt on an idle cpu whose clock is
+		 * stopped. Bring c_hardclocks up to date, and make sure
+		 * the wheel gets looked at so the clock gets stopped
+		 * again with this timer taken into account.
+		 */
+		hardclock_catchup(c);
+		mainbus_hardclock_set(1);
+	}
+
+	spinlock_acquire(&tw->tw_lock);
+	t->tm_cpu = c;
+	t->tm_expires = c->c_hardclocks + ticks;
+	tw_insert(tw, t);
+	tw->tw_count++;
+	tw->tw_started++;
+	spinlock_release(&tw->tw_lock);
+
+	splx(spl);
+}
+
+bool
+timer_cancel(struct timer *t)
+{
+	struct cpu *c;
+	struct timerwheel *tw;
+
+	/*
+	 * The timer can go off (and even be restarted elsewhere) while
+	 * we're getting the lock, so check tm_cpu again once we have it.
+	 */
+	while ((c = t->tm_cpu) != NULL) {
+		tw = c->c_timerwheel;
+		spinlock_acquire(&tw->tw_lock);
+		if (t->tm_cpu == c) {
+			tw_remove(t);
+			t->tm_cpu = NULL;
+			tw->tw_count--;
+			tw->tw_cancelled++;
+			spinlock_release(&tw->tw_lock);
+			return true;
+		}
+		spinlock_release(&tw->tw_lock);
 	}
+	return false;
+}
+
+/*
+ * Print the timer wheel statistics for C.
+ */
+void
+timer_printstats(struct cpu *c)
+{
+	struct timerwheel *tw = c->c_timerwheel;
+
+	spinlock_acquire(&tw->tw_lock);
+	kprintf("%3u  %7u %8u %8u %8u %8u\n", c->c_number, tw->tw_count,
+		tw->tw_started, tw->tw_fired, tw->tw_cancelled,
+		tw->tw_cascaded);
+	spinlock_release(&tw->tw_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// hardclock
+
+/*
+ * Bring c_hardclocks up to date on a cpu whose clock is stopped, by
+ * adding the number of whole hardclock periods since the last one
+ * accounted for.
+ */
+static
+void
+hardclock_catchup(struct cpu *c)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t elapsed;
+	unsigned ticks;
+
+	KASSERT(c->c_tickless);
+
+	gettime(&secs, &nsecs);
+	getinterval(c->c_tickstop_secs, c->c_tickstop_nsecs, secs, nsecs,
+		    &secs, &nsecs);
+	elapsed = (uint64_t)secs * 1000000000 + nsecs;
+	ticks = elapsed / NSECS_PER_HARDCLOCK;
+
+	/* Keep the leftover fraction for next time. */
+	elapsed = c->c_tickstop_nsecs +
+		(uint64_t)ticks * NSECS_PER_HARDCLOCK;
+	c->c_tickstop_secs += elapsed / 1000000000;
+	c->c_tickstop_nsecs = elapsed % 1000000000;
+
+	c->c_hardclocks += ticks;
+	c->c_ticksskipped += ticks;
+}
+
+/*
+ * Stop the periodic hardclock on an idle cpu, arranging to be woken
+ * only for its next pending timer. Work arriving from elsewhere comes
+ * with an IPI, which brings the cpu out of cpu_idle(); then
+ * thread_switch calls hardclock_resume.
+ */
+static
+void
+hardclock_stop(void)
+{
+	struct cpu *c = curcpu->c_self;
+
+	if (!c->c_tickless) {
+		gettime(&c->c_tickstop_secs, &c->c_tickstop_nsecs);
+		c->c_tickless = true;
+		c->c_tickstops++;
+	}
+	mainbus_hardclock_set(tw_nextevent(c));
+}
+
+/*
+ * Restart the hardclock on a cpu that's leaving the idle loop, if it
+ * was stopped. c_hardclocks is advanced by the ticks that were skipped,
+ * so it still measures time. Called with interrupts off, from
+ * thread_switch with the run queue locked; so the timer wheel is left
+ * for the next hardclock, which comes one tick from now.
+ */
+void
+hardclock_resume(void)
+{
+	struct cpu *c = curcpu->c_self;
+
+	if (!c->c_tickless) {
+		return;
+	}
+	hardclock_catchup(c);
+	c->c_tickless = false;
+	mainbus_hardclock_set(1);
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, except while the processor is idle. Then it's called only
+ * when a timer is due.
  */
 void
 hardclock(void)
 {
-	/*
-	 * Collect statistics here as desired.
-	 */
+	struct cpu *c = curcpu->c_self;
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	/* Profile what the clock interrupted. */
+	PROF_TICK(c);
+
+	if (c->c_tickless) {
+		hardclock_catchup(c);
+	}
+	else {
+		c->c_hardclocks++;
+	}
+
+	tw_run(c);
+
+	if (c->c_isidle) {
+		/*
+		 * The cpu is sitting in cpu_idle() and there's nothing
+		 * more here for it to do. Stop ticking until there is.
+		 */
+		hardclock_stop();
+		return;
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	if ((c->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (schedule()) {
+		thread_yield();
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sleeping
+
+static
+void
+thread_sleep_wakeup(void *data)
+{
+	struct wchan *wc = data;
+
+	wchan_wakeone(wc);
+}
+
+/*
+ * Sleep until the time of day is DEADLINE or later. Each sleeper has
+ * its own timer and wait channel, so nobody else is woken for it.
+ */
+void
+thread_sleep_until(const struct timespec *deadline)
+{
+	struct wchan *wc;
+	struct timer tm;
+	time_t secs;
+	uint32_t nsecs;
+	int64_t left;
+
+	/* The wait channel is only for us; if there isn't one, poll. */
+	wc = wchan_create("sleep");
+	timer_init(&tm, thread_sleep_wakeup, wc);
+
+	while (1) {
+		gettime(&secs, &nsecs);
+		left = (int64_t)(deadline->tv_sec - secs) * 1000000000 +
+			((int64_t)deadline->tv_nsec - nsecs);
+		if (left <= 0) {
+			break;
+		}
+		if (wc == NULL) {
+			thread_yield();
+			continue;
+		}
+
+		/*
+		 * The first hardclock can come any time in the next
+		 * period, so this can wake us a little early; in that
+		 * case we go round again. Lock the channel first so the
+		 * wakeup can't happen before we're asleep.
+		 */
+		wchan_lock(wc);
+		timer_start(&tm, DIVROUNDUP(left, NSECS_PER_HARDCLOCK));
+		wchan_sleep(wc);
+	}
+
+	if (wc != NULL) {
+		KASSERT(tm.tm_cpu == NULL);
+		wchan_destroy(wc);
+	}
+}
+
+/*
+ * Sleep for NSECS nanoseconds from now.
+ */
+static
+void
+clock_sleepns(uint64_t nsecs)
+{
+	struct timespec deadline;
+	time_t secs;
+	uint32_t now;
+
+	gettime(&secs, &now);
+	nsecs += now;
+	deadline.tv_sec = secs + nsecs / 1000000000;
+	deadline.tv_nsec = nsecs % 1000000000;
+	thread_sleep_until(&deadline);
 }
 
 /*
@@ -135,11 +584,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clock_sleepns((uint64_t)num_secs * 1000000000);
+	}
 }
 
 /*
@@ -149,9 +596,7 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	if (num_ticks > 0) {
+		clock_sleepns((uint64_t)num_ticks * LT_GRANULARITY * 1000);
+	}
 }
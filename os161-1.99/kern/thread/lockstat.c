@@ -0,0 +1,309 @@
+/*
+ * Lock contention profiling.
+ *
+ * The specification of the interface is in lockstat.h.
+ *
+ * Records live in a fixed table, since we can be called from inside
+ * spinlock_acquire and kmalloc itself uses spinlocks. For the same
+ * reason the table and each record are protected by bare lock words
+ * (spinlock_data_t) taken with interrupts off, not by spinlocks. The
+ * table is searched linearly; that only happens when a lock is
+ * created or named, or an unnamed spinlock is first used.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <lockstat.h>
+#include <clock.h>
+
+#if OPT_LOCKSTAT
+
+#define LOCKSTAT_MAXRECS	256
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	volatile spinlock_data_t ls_lock;
+	unsigned ls_kind;		/* LOCKSTAT_SPIN etc. */
+	const void *ls_addr;		/* for unnamed spinlocks */
+	char ls_name[LOCKSTAT_NAMELEN];	/* empty if unnamed */
+
+	unsigned ls_acquires;		/* total acquisitions */
+	unsigned ls_contended;		/* ...that had to wait */
+	uint64_t ls_spins;		/* trips round wait loops */
+	unsigned ls_holds;		/* hold times measured */
+	uint64_t ls_holdtime;		/* total of those */
+	uint64_t ls_maxhold;		/* longest of those */
+};
+
+static volatile spinlock_data_t lockstat_tablelock =
+	SPINLOCK_DATA_INITIALIZER;
+static struct lockstat lockstat_table[LOCKSTAT_MAXRECS];
+static unsigned lockstat_nrecs;
+
+/* For printing: a copy, sorted, so we don't print holding anything. */
+static struct lockstat lockstat_snap[LOCKSTAT_MAXRECS];
+
+/* Record everything goes in once the table is full. */
+#define LOCKSTAT_OVERFLOW	(&lockstat_table[0])
+
+/* Set once gettime() can be called. */
+static bool lockstat_timing;
+
+static
+void
+lockstat_lockword(volatile spinlock_data_t *word)
+{
+	while (spinlock_data_get(word) != 0 ||
+	       spinlock_data_testandset(word) != 0) {
+		/* spin */
+	}
+}
+
+static
+void
+lockstat_unlockword(volatile spinlock_data_t *word)
+{
+	spinlock_data_set(word, 0);
+}
+
+/* Copy NAME into a record's name buffer, cutting it off if need be. */
+static
+void
+lockstat_copyname(char *buf, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		buf[i] = name[i];
+	}
+	buf[i] = 0;
+}
+
+static
+const char *
+lockstat_kindname(unsigned kind)
+{
+	switch (kind) {
+	    case LOCKSTAT_SPIN: return "spin";
+	    case LOCKSTAT_LOCK: return "lock";
+	    case LOCKSTAT_SEM: return "sem";
+	}
+	return "?";
+}
+
+struct lockstat *
+lockstat_get(unsigned kind, const char *name, const void *addr)
+{
+	struct lockstat *ls;
+	char key[LOCKSTAT_NAMELEN];
+	unsigned i;
+
+	if (name != NULL) {
+		lockstat_copyname(key, name);
+	}
+
+	splraise(IPL_NONE, IPL_HIGH);
+	lockstat_lockword(&lockstat_tablelock);
+
+	if (lockstat_nrecs == 0) {
+		/* Slot 0 is the overflow record. */
+		ls = LOCKSTAT_OVERFLOW;
+		ls->ls_kind = LOCKSTAT_SPIN;
+		strcpy(ls->ls_name, "(table full)");
+		lockstat_nrecs = 1;
+	}
+
+	for (i=1; i<lockstat_nrecs; i++) {
+		ls = &lockstat_table[i];
+		if (ls->ls_kind != kind) {
+			continue;
+		}
+		if (name == NULL ? ls->ls_addr == addr :
+		    (ls->ls_addr == NULL && !strcmp(ls->ls_name, key))) {
+			goto done;
+		}
+	}
+
+	if (lockstat_nrecs == LOCKSTAT_MAXRECS) {
+		ls = LOCKSTAT_OVERFLOW;
+		goto done;
+	}
+
+	/* The table is static, so the counters start out zero. */
+	ls = &lockstat_table[lockstat_nrecs++];
+	ls->ls_kind = kind;
+	if (name == NULL) {
+		ls->ls_addr = addr;
+		ls->ls_name[0] = 0;
+	}
+	else {
+		ls->ls_addr = NULL;
+		strcpy(ls->ls_name, key);
+	}
+
+ done:
+	lockstat_unlockword(&lockstat_tablelock);
+	spllower(IPL_HIGH, IPL_NONE);
+	return ls;
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool contended, unsigned spins)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	lockstat_lockword(&ls->ls_lock);
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+	}
+	ls->ls_spins += spins;
+	lockstat_unlockword(&ls->ls_lock);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * The cpus' cycle counters would be cheaper, but the timer code resets
+ * them at every hardclock, and sleep locks can be held across many
+ * ticks and released on another cpu.
+ */
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_timing) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+void
+lockstat_held(struct lockstat *ls, uint64_t start)
+{
+	uint64_t now, held;
+
+	if (start == 0) {
+		/* Acquired before the clock was up. */
+		return;
+	}
+	now = lockstat_now();
+	held = now - start;
+
+	splraise(IPL_NONE, IPL_HIGH);
+	lockstat_lockword(&ls->ls_lock);
+	ls->ls_holds++;
+	ls->ls_holdtime += held;
+	if (held > ls->ls_maxhold) {
+		ls->ls_maxhold = held;
+	}
+	lockstat_unlockword(&ls->ls_lock);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+void
+lockstat_print(unsigned n)
+{
+	struct lockstat *ls, tmp;
+	unsigned i, j, nrecs;
+	char addrname[LOCKSTAT_NAMELEN];
+
+	/* Copy the table; the counts may be a little inconsistent. */
+	splraise(IPL_NONE, IPL_HIGH);
+	lockstat_lockword(&lockstat_tablelock);
+	nrecs = lockstat_nrecs;
+	for (i=0; i<nrecs; i++) {
+		lockstat_snap[i] = lockstat_table[i];
+	}
+	lockstat_unlockword(&lockstat_tablelock);
+	spllower(IPL_HIGH, IPL_NONE);
+
+	/* Sort by contended acquisitions; the table isn't big. */
+	for (i=1; i<nrecs; i++) {
+		tmp = lockstat_snap[i];
+		for (j=i; j>0 &&
+			     lockstat_snap[j-1].ls_contended < tmp.ls_contended;
+		     j--) {
+			lockstat_snap[j] = lockstat_snap[j-1];
+		}
+		lockstat_snap[j] = tmp;
+	}
+
+	kprintf("%-4s %-24s %9s %9s %10s %9s %9s\n", "kind", "name",
+		"acquires", "contended", "spins", "avghold", "maxhold");
+	for (i=j=0; i<nrecs && j<n; i++) {
+		ls = &lockstat_snap[i];
+		if (ls->ls_acquires == 0) {
+			continue;
+		}
+		j++;
+		if (ls->ls_addr != NULL) {
+			snprintf(addrname, sizeof(addrname), "%p", ls->ls_addr);
+		}
+		else {
+			strcpy(addrname, ls->ls_name);
+		}
+		kprintf("%-4s %-24s %9u %9u %10llu %9llu %9llu\n",
+			lockstat_kindname(ls->ls_kind), addrname,
+			ls->ls_acquires, ls->ls_contended,
+			(unsigned long long)ls->ls_spins,
+			ls->ls_holds == 0 ? 0ULL :
+			(unsigned long long)(ls->ls_holdtime / ls->ls_holds),
+			(unsigned long long)ls->ls_maxhold);
+	}
+	kprintf("(%u records; hold times in nsec)\n", nrecs);
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+
+	splraise(IPL_NONE, IPL_HIGH);
+	lockstat_lockword(&lockstat_tablelock);
+	for (i=0; i<lockstat_nrecs; i++) {
+		ls = &lockstat_table[i];
+		lockstat_lockword(&ls->ls_lock);
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_spins = 0;
+		ls->ls_holds = 0;
+		ls->ls_holdtime = 0;
+		ls->ls_maxhold = 0;
+		lockstat_unlockword(&ls->ls_lock);
+	}
+	lockstat_unlockword(&lockstat_tablelock);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_timing = true;
+}
+
+#else /* !OPT_LOCKSTAT */
+
+void
+lockstat_print(unsigned n)
+{
+	(void)n;
+	kprintf("ls: lock profiling not compiled in (options lockstat)\n");
+}
+
+void
+lockstat_reset(void)
+{
+	kprintf("ls: lock profiling not compiled in (options lockstat)\n");
+}
+
+void
+lockstat_bootstrap(void)
+{
+}
+
+#endif /* OPT_LOCKSTAT */
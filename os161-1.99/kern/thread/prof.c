@@ -0,0 +1,346 @@
+/*
+ * Sampling profiler.
+ *
+ * The specification of the interface is in prof.h.
+ *
+ * A table is an open-addressed hash of PROF_NSLOTS buckets; a bucket
+ * with no samples is empty. A new bucket goes in the first empty slot
+ * within PROF_MAXPROBE of where it hashes to, or the sample is
+ * dropped. Only the owning cpu's hardclock writes a table, and
+ * prof_dump and prof_save stop sampling before reading them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <proc.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <prof.h>
+
+#if OPT_PROF
+
+/* Buckets per cpu; must be a power of 2. */
+#define PROF_NSLOTS		1024
+
+/* How far to look for a bucket before giving up. */
+#define PROF_MAXPROBE		16
+
+struct prof_table {
+	uint32_t pt_nsamples;		/* samples taken */
+	uint32_t pt_idle;		/* of those, in the idle loop */
+	uint32_t pt_dropped;		/* of those, not kept */
+	uint32_t pt_nentries;		/* buckets in use */
+	struct prof_entry pt_entries[PROF_NSLOTS];
+};
+
+volatile bool prof_on;
+
+void
+prof_cpu_init(struct cpu *c)
+{
+	c->c_prof = kmalloc(sizeof(*c->c_prof));
+	if (c->c_prof == NULL) {
+		panic("prof_cpu_init: Out of memory\n");
+	}
+	bzero(c->c_prof, sizeof(*c->c_prof));
+}
+
+/*
+ * Add COUNT samples to the bucket for (PC, PID, USER) in the table
+ * ENTRIES of NSLOTS buckets, a power of 2, starting the bucket if
+ * need be. Returns false if there was no room for it.
+ */
+static
+bool
+prof_add(struct prof_entry *entries, unsigned nslots, uint32_t pc,
+	 int32_t pid, uint32_t user, uint32_t count, uint32_t *nentries)
+{
+	struct prof_entry *pe;
+	uint32_t h;
+	unsigned i;
+
+	/* Fibonacci hashing; the top bits are the best mixed. */
+	h = ((pc >> 2) + (uint32_t)pid * 31 + user) * 2654435761U;
+	h = h ^ (h >> 16);
+
+	for (i=0; i<PROF_MAXPROBE; i++) {
+		pe = &entries[(h + i) & (nslots - 1)];
+		if (pe->pe_count == 0) {
+			pe->pe_pc = pc;
+			pe->pe_pid = pid;
+			pe->pe_user = user;
+			pe->pe_count = count;
+			(*nentries)++;
+			return true;
+		}
+		if (pe->pe_pc == pc && pe->pe_pid == pid &&
+		    pe->pe_user == user) {
+			pe->pe_count += count;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Called from hardclock, with interrupts off.
+ */
+void
+prof_sample(struct cpu *c)
+{
+	struct prof_table *pt = c->c_prof;
+	struct proc *p;
+	int32_t pid;
+
+	pt->pt_nsamples++;
+	if (c->c_isidle) {
+		pt->pt_idle++;
+		return;
+	}
+
+	/* Kernel work done for a process is charged to it. */
+	p = curthread->t_proc;
+	pid = (p == NULL) ? 0 : p->p_pid;
+
+	if (!prof_add(pt->pt_entries, PROF_NSLOTS, c->c_intrpc, pid,
+		      c->c_intruser ? 1 : 0, 1, &pt->pt_nentries)) {
+		pt->pt_dropped++;
+	}
+}
+
+void
+prof_start(void)
+{
+	unsigned i, numcpus;
+
+	prof_on = false;
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		bzero(cpu_get(i)->c_prof, sizeof(struct prof_table));
+	}
+	prof_on = true;
+}
+
+void
+prof_stop(void)
+{
+	prof_on = false;
+}
+
+void
+prof_dump(unsigned n)
+{
+	struct prof_table *pt;
+	struct prof_entry *merged, *pe, *best;
+	unsigned i, j, numcpus, nslots;
+	uint32_t total, idle, dropped, nentries, tenths;
+
+	prof_stop();
+
+	/* Add the cpus' tables together, in one at most half full. */
+	numcpus = cpu_count();
+	total = idle = dropped = nentries = 0;
+	for (i=0; i<numcpus; i++) {
+		pt = cpu_get(i)->c_prof;
+		total += pt->pt_nsamples;
+		idle += pt->pt_idle;
+		dropped += pt->pt_dropped;
+		nentries += pt->pt_nentries;
+	}
+	for (nslots = PROF_NSLOTS; nslots < 2 * nentries; nslots *= 2) {
+		/* nothing */
+	}
+	merged = kmalloc(nslots * sizeof(*merged));
+	if (merged == NULL) {
+		kprintf("pr: Out of memory\n");
+		return;
+	}
+	bzero(merged, nslots * sizeof(*merged));
+	nentries = 0;
+	for (i=0; i<numcpus; i++) {
+		pt = cpu_get(i)->c_prof;
+		for (j=0; j<PROF_NSLOTS; j++) {
+			pe = &pt->pt_entries[j];
+			if (pe->pe_count == 0) {
+				continue;
+			}
+			if (!prof_add(merged, nslots, pe->pe_pc, pe->pe_pid,
+				      pe->pe_user, pe->pe_count, &nentries)) {
+				dropped += pe->pe_count;
+			}
+		}
+	}
+
+	kprintf("pr: %u samples on %u cpus, %u idle, %u dropped\n",
+		total, numcpus, idle, dropped);
+	kprintf("%8s %6s %6s %4s  %s\n", "samples", "%", "pid", "mode",
+		"pc");
+
+	/* Print the biggest N, taking each out as it's printed. */
+	for (i=0; i<n; i++) {
+		best = NULL;
+		for (j=0; j<nslots; j++) {
+			pe = &merged[j];
+			if (pe->pe_count > 0 &&
+			    (best == NULL || pe->pe_count > best->pe_count)) {
+				best = pe;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		tenths = (uint64_t)best->pe_count * 1000 / total;
+		kprintf("%8u %4u.%u %6d %4s  0x%08x\n", best->pe_count,
+			tenths / 10, tenths % 10, best->pe_pid,
+			best->pe_user ? "user" : "kern", best->pe_pc);
+		best->pe_count = 0;
+	}
+
+	kfree(merged);
+}
+
+/*
+ * Write LEN bytes from BUF to VN at *POS, and advance *POS.
+ */
+static
+int
+prof_write(struct vnode *vn, void *buf, size_t len, off_t *pos)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, *pos, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid > 0) {
+		return ENOSPC;
+	}
+	*pos += len;
+	return 0;
+}
+
+/*
+ * Move PT's buckets to the front of the table so they can be written
+ * in one piece. This breaks the hashing, but nothing looks anything up
+ * again before prof_start clears the table.
+ */
+static
+void
+prof_compact(struct prof_table *pt)
+{
+	unsigned i, j;
+
+	for (i=j=0; i<PROF_NSLOTS; i++) {
+		if (pt->pt_entries[i].pe_count == 0) {
+			continue;
+		}
+		if (i != j) {
+			pt->pt_entries[j] = pt->pt_entries[i];
+			pt->pt_entries[i].pe_count = 0;
+		}
+		j++;
+	}
+	KASSERT(j == pt->pt_nentries);
+}
+
+int
+prof_save(const char *path)
+{
+	struct prof_filehdr ph;
+	struct prof_cpuhdr pc;
+	struct prof_table *pt;
+	struct vnode *vn;
+	char *pathcopy;
+	unsigned i, numcpus;
+	off_t pos;
+	int result;
+
+	prof_stop();
+
+	/* vfs_open may scribble on the name. */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(pathcopy, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	kfree(pathcopy);
+	if (result) {
+		return result;
+	}
+
+	numcpus = cpu_count();
+	ph.ph_magic = PROF_MAGIC;
+	ph.ph_version = PROF_VERSION;
+	ph.ph_ncpus = numcpus;
+	ph.ph_hz = HZ;
+	pos = 0;
+	result = prof_write(vn, &ph, sizeof(ph), &pos);
+
+	for (i=0; i<numcpus && result == 0; i++) {
+		pt = cpu_get(i)->c_prof;
+		prof_compact(pt);
+		pc.pc_cpu = i;
+		pc.pc_nentries = pt->pt_nentries;
+		pc.pc_nsamples = pt->pt_nsamples;
+		pc.pc_idle = pt->pt_idle;
+		pc.pc_dropped = pt->pt_dropped;
+		pc.pc_reserved = 0;
+		result = prof_write(vn, &pc, sizeof(pc), &pos);
+		if (result) {
+			break;
+		}
+		result = prof_write(vn, pt->pt_entries,
+				    pt->pt_nentries * sizeof(struct prof_entry),
+				    &pos);
+	}
+
+	vfs_close(vn);
+	return result;
+}
+
+#else /* !OPT_PROF */
+
+void
+prof_cpu_init(struct cpu *c)
+{
+	c->c_prof = NULL;
+}
+
+void
+prof_start(void)
+{
+	kprintf("pr: profiling not compiled in (options prof)\n");
+}
+
+void
+prof_stop(void)
+{
+	kprintf("pr: profiling not compiled in (options prof)\n");
+}
+
+void
+prof_dump(unsigned n)
+{
+	(void)n;
+	kprintf("pr: profiling not compiled in (options prof)\n");
+}
+
+int
+prof_save(const char *path)
+{
+	(void)path;
+	kprintf("pr: profiling not compiled in (options prof)\n");
+	return 0;
+}
+
+#endif /* OPT_PROF */
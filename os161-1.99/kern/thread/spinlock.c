@@ -36,11 +36,19 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <mainbus.h>
+#include <lockstat.h>
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Queue entries used before curcpu exists. There's only one cpu
+ * running then, so one extra set will do.
+ */
+static struct spinlock_qnode spinlock_bootqnodes[SPINLOCK_NQNODES];
+static unsigned spinlock_bootqnodesused;
 
 /*
  * Initialize spinlock.
@@ -50,8 +58,33 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+	lk->lk_queued = false;
+	lk->lk_qnode = NULL;
+#if OPT_LOCKSTAT
+	/* Looked up on first use, unless it gets a name first. */
+	lk->lk_stat = NULL;
+	lk->lk_acqtime = 0;
+#endif
+}
+
+/*
+ * Initialize a queued spinlock.
+ */
+void
+spinlock_init_queued(struct spinlock *lk)
+{
+	spinlock_init(lk);
+	lk->lk_queued = true;
 }
 
+#if OPT_LOCKSTAT
+void
+spinlock_setname(struct spinlock *lk, const char *name)
+{
+	lk->lk_stat = lockstat_get(LOCKSTAT_SPIN, name, lk);
+}
+#endif
+
 /*
  * Clean up spinlock.
  */
@@ -63,29 +96,129 @@ spinlock_cleanup(struct spinlock *lk)
 }
 
 /*
- * Get the lock.
- *
- * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * Take a free queue entry from MYCPU's set, or the boot set if MYCPU
+ * is NULL. Interrupts are off, so nothing else on this cpu can be
+ * using the set.
  */
+static
+struct spinlock_qnode *
+spinlock_qnode_get(struct cpu *mycpu)
+{
+	struct spinlock_qnode *nodes;
+	unsigned *used;
+	unsigned i;
+
+	if (mycpu != NULL) {
+		nodes = mycpu->c_qnodes;
+		used = &mycpu->c_qnodesused;
+	}
+	else {
+		nodes = spinlock_bootqnodes;
+		used = &spinlock_bootqnodesused;
+	}
+
+	for (i=0; i<SPINLOCK_NQNODES; i++) {
+		if ((*used & (1U << i)) == 0) {
+			*used |= 1U << i;
+			return &nodes[i];
+		}
+	}
+	panic("Too many queued spinlocks held on one cpu\n");
+	return NULL;
+}
+
+/*
+ * Give back a queue entry. It always comes from the cpu we're on,
+ * since spinlocks are released on the cpu that got them.
+ */
+static
 void
-spinlock_acquire(struct spinlock *lk)
+spinlock_qnode_put(struct cpu *mycpu, struct spinlock_qnode *node)
 {
-	struct cpu *mycpu;
+	unsigned i;
 
-	splraise(IPL_NONE, IPL_HIGH);
+	if (node >= spinlock_bootqnodes &&
+	    node < spinlock_bootqnodes + SPINLOCK_NQNODES) {
+		i = node - spinlock_bootqnodes;
+		spinlock_bootqnodesused &= ~(1U << i);
+		return;
+	}
+	KASSERT(mycpu != NULL);
+	i = node - mycpu->c_qnodes;
+	KASSERT(i < SPINLOCK_NQNODES);
+	mycpu->c_qnodesused &= ~(1U << i);
+}
 
-	/* this must work before curcpu initialization */
-	if (CURCPU_EXISTS()) {
-		mycpu = curcpu->c_self;
-		if (lk->lk_holder == mycpu) {
-			panic("Deadlock on spinlock %p\n", lk);
+/*
+ * Get a queued lock: swap our queue entry in as the new tail, and if
+ * there was a cpu in line already, link ourselves behind it and spin
+ * on our own entry until it hands the lock over. Returns the number
+ * of trips round the wait loop.
+ */
+static
+unsigned
+spinlock_acquire_queued(struct spinlock *lk, struct cpu *mycpu)
+{
+	struct spinlock_qnode *node, *prev;
+	unsigned spins = 0;
+
+	node = spinlock_qnode_get(mycpu);
+	node->qn_next = NULL;
+	node->qn_wait = true;
+
+	prev = (struct spinlock_qnode *)
+		spinlock_data_swap(&lk->lk_lock, (spinlock_data_t)node);
+	if (prev != NULL) {
+		prev->qn_next = node;
+		while (node->qn_wait) {
+			spins++;
 		}
 	}
-	else {
-		mycpu = NULL;
+
+	lk->lk_qnode = node;
+	return spins;
+}
+
+/*
+ * Let go of a queued lock: hand it to the next cpu in line. If there
+ * doesn't seem to be one, try to mark the lock free; if that fails,
+ * someone has just swapped themselves in as the tail and will link
+ * themselves to us in a moment, so wait for that.
+ */
+static
+void
+spinlock_release_queued(struct spinlock *lk, struct cpu *mycpu)
+{
+	struct spinlock_qnode *node, *next;
+
+	node = lk->lk_qnode;
+	lk->lk_qnode = NULL;
+
+	next = node->qn_next;
+	if (next == NULL) {
+		if (spinlock_data_compareandswap(&lk->lk_lock,
+						 (spinlock_data_t)node, 0)
+		    == (spinlock_data_t)node) {
+			spinlock_qnode_put(mycpu, node);
+			return;
+		}
+		while ((next = node->qn_next) == NULL) {
+			/* spin */
+		}
 	}
+	next->qn_wait = false;
+	spinlock_qnode_put(mycpu, node);
+}
+
+/*
+ * Get a plain lock by spinning on the lock word. Returns the number
+ * of trips round the wait loop.
+ */
+static
+unsigned
+spinlock_acquire_plain(struct spinlock *lk)
+{
+	unsigned spins = 0;
 
 	while (1) {
 		/*
@@ -99,15 +232,62 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			spins++;
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			spins++;
 			continue;
 		}
 		break;
 	}
+	return spins;
+}
+
+/*
+ * Get the lock.
+ *
+ * First disable interrupts (otherwise, if we get a timer interrupt we
+ * might come back to this lock and deadlock), then use a machine-level
+ * atomic operation to wait for the lock to be free.
+ */
+void
+spinlock_acquire(struct spinlock *lk)
+{
+	struct cpu *mycpu;
+	unsigned spins;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (lk->lk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", lk);
+		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	if (lk->lk_queued) {
+		spins = spinlock_acquire_queued(lk, mycpu);
+	}
+	else {
+		spins = spinlock_acquire_plain(lk);
+	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKSTAT
+	if (lk->lk_stat == NULL) {
+		lk->lk_stat = lockstat_get(LOCKSTAT_SPIN, NULL, lk);
+	}
+	lockstat_acquired(lk->lk_stat, spins > 0, spins);
+	lk->lk_acqtime = lockstat_now();
+#else
+	(void)spins;
+#endif
 }
 
 /*
@@ -116,13 +296,28 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+	struct cpu *mycpu;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
-		KASSERT(lk->lk_holder == curcpu->c_self);
+		mycpu = curcpu->c_self;
+		KASSERT(lk->lk_holder == mycpu);
 	}
+	else {
+		mycpu = NULL;
+	}
+
+#if OPT_LOCKSTAT
+	lockstat_held(lk->lk_stat, lk->lk_acqtime);
+#endif
 
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	if (lk->lk_queued) {
+		spinlock_release_queued(lk, mycpu);
+	}
+	else {
+		spinlock_data_set(&lk->lk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
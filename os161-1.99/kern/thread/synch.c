@@ -37,13 +37,96 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+#include <mainbus.h>
+
+/* Object caches for semaphores, locks, CVs and rwlocks. */
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+static struct kmem_cache *rwlock_cache;
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static
+void
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+static
+void
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_lock);
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+}
+
+static
+void
+rwlock_ctor(void *obj)
+{
+	struct rwlock *rw = obj;
+
+	spinlock_init(&rw->rw_lock);
+}
+
+static
+void
+rwlock_dtor(void *obj)
+{
+	struct rwlock *rw = obj;
+
+	spinlock_cleanup(&rw->rw_lock);
+}
+
+/*
+ * Set up the object caches. Call once during system startup, before
+ * anything makes a semaphore.
+ */
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       lock_ctor, lock_dtor);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), NULL, NULL);
+	rwlock_cache = kmem_cache_create("rwlock", sizeof(struct rwlock),
+					 rwlock_ctor, rwlock_dtor);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL ||
+	    rwlock_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,26 +134,30 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
+	/* sem_lock is set up by sem_ctor */
+	spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
+#if OPT_LOCKSTAT
+	sem->sem_stat = lockstat_get(LOCKSTAT_SEM, sem->sem_name, sem);
+#endif
 
         return sem;
 }
@@ -80,16 +167,20 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
+	/* wchan_destroy will assert if anyone's waiting on it */
+	KASSERT(sem->sem_lock.lk_holder == NULL);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
 }
 
 void 
 P(struct semaphore *sem)
 {
+#if OPT_LOCKSTAT
+	bool slept = false;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -121,12 +212,19 @@ P(struct semaphore *sem)
 		wchan_lock(sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
                 wchan_sleep(sem->sem_wchan);
+#if OPT_LOCKSTAT
+		slept = true;
+#endif
 
 		spinlock_acquire(&sem->sem_lock);
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
 	spinlock_release(&sem->sem_lock);
+
+#if OPT_LOCKSTAT
+	lockstat_acquired(sem->sem_stat, slept, 0);
+#endif
 }
 
 void
@@ -147,24 +245,65 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times to look at the lock while spinning on it before
+ * giving up and going to sleep. This wants to be somewhat longer than
+ * a typical short critical section, and a lot shorter than the cost
+ * of sleeping and being woken up again.
+ */
+#define LOCK_SPIN_LIMIT	1000
+
+/* Contention statistics for all locks together. */
+static struct spinlock lock_stats_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned contended;	/* acquires that found the lock held */
+	unsigned spun;		/* ...and got it by spinning */
+	unsigned slept;		/* ...and had to sleep */
+	unsigned spinloops;	/* total trips around the spin loop */
+	unsigned rwreadwaits;	/* rwlock readers that had to wait */
+	unsigned rwwritewaits;	/* rwlock writers that had to wait */
+} lock_stats;
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+	unsigned i;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	lock->lk_wchan = wchan_create(lock->lk_name);
+	if (lock->lk_wchan == NULL) {
+		kfree(lock->lk_name);
+		kmem_cache_free(lock_cache, lock);
+		return NULL;
+	}
+
+	/* lk_lock is set up by lock_ctor */
+	spinlock_setname(&lock->lk_lock, lock->lk_name);
+	lock->lk_holder = NULL;
+	lock->lk_heldnext = NULL;
+	lock->lk_nwaiters = 0;
+	lock->lk_acquires = 0;
+	lock->lk_spinacquires = 0;
+	lock->lk_sleepacquires = 0;
+	for (i=0; i<=PRI_LOWEST; i++) {
+		lock->lk_waitpri[i] = 0;
+	}
+#if OPT_LOCKSTAT
+	lock->lk_stat = lockstat_get(LOCKSTAT_LOCK, lock->lk_name, lock);
+	lock->lk_acqtime = 0;
+#endif
+
         return lock;
 }
 
@@ -172,37 +311,348 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nwaiters == 0);
 
-        // add stuff here as needed
-        
+	/* wchan_destroy will assert if anyone's waiting on it */
+	wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
+}
+
+/*
+ * Spin while LOCK is held by a thread that's running on some other
+ * cpu, for at most LOCK_SPIN_LIMIT loops. Returns the number of loops.
+ * Called without lk_lock; the caller must check the lock again
+ * afterwards.
+ *
+ * The holder can exit and its struct thread be freed while we're
+ * looking at it; that's all right because thread structures come from
+ * an object cache and stay thread structures. The worst we can see is
+ * a stale state, which just means we spin or sleep when we shouldn't
+ * have.
+ */
+static
+unsigned
+lock_spin(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned loops;
+
+	for (loops = 0; loops < LOCK_SPIN_LIMIT; loops++) {
+		holder = lock->lk_holder;
+		if (holder == NULL) {
+			break;
+		}
+		if (holder->t_state != S_RUN || holder->t_cpu == curcpu) {
+			break;
+		}
+	}
+	return loops;
+}
+
+/*
+ * Priority inheritance.
+ *
+ * A thread about to sleep waiting for a lock lends its priority to
+ * the holder. If the holder is itself asleep waiting for another
+ * lock, the loan is passed on to that lock's holder, and so on down
+ * the chain. Each lock counts its waiters at each priority in
+ * lk_waitpri, so when a thread lets go of a lock it can work out what
+ * it's still owed by the waiters on the locks it still holds.
+ *
+ * lock_pilock protects every thread's t_priority and t_waitlock and
+ * every lock's lk_waitpri. It's also held while clearing lk_holder of
+ * a lock that has waiters, so the chain can't change under a thread
+ * walking it. It comes after lk_lock and before the run queue locks.
+ */
+static struct spinlock lock_pilock = SPINLOCK_INITIALIZER;
+
+/* Longest chain followed; a longer one is probably a deadlock. */
+#define LOCK_PI_MAXDEPTH	16
+
+/*
+ * Change T's priority, keeping the count on the lock it's waiting
+ * for, if any, up to date.
+ */
+static
+void
+lock_setpriority(struct thread *t, unsigned pri)
+{
+	struct lock *waitlock;
+
+	KASSERT(spinlock_do_i_hold(&lock_pilock));
+
+	waitlock = t->t_waitlock;
+	if (waitlock != NULL) {
+		KASSERT(waitlock->lk_waitpri[t->t_priority] > 0);
+		waitlock->lk_waitpri[t->t_priority]--;
+		waitlock->lk_waitpri[pri]++;
+	}
+	thread_changepriority(t, pri);
+}
+
+/*
+ * Best priority among the threads waiting for LOCK, or PRI_LOWEST if
+ * there aren't any.
+ */
+static
+unsigned
+lock_waiterpriority(struct lock *lock)
+{
+	unsigned pri;
+
+	KASSERT(spinlock_do_i_hold(&lock_pilock));
+
+	for (pri = PRI_HIGHEST; pri < PRI_LOWEST; pri++) {
+		if (lock->lk_waitpri[pri] > 0) {
+			break;
+		}
+	}
+	return pri;
+}
+
+/*
+ * The priority the current thread is entitled to: its own, or that of
+ * the most urgent thread waiting for a lock it holds.
+ */
+static
+unsigned
+lock_heldpriority(void)
+{
+	struct lock *lock;
+	unsigned pri, wpri;
+
+	KASSERT(spinlock_do_i_hold(&lock_pilock));
+
+	pri = curthread->t_basepri;
+	for (lock = curthread->t_heldlocks; lock != NULL;
+	     lock = lock->lk_heldnext) {
+		wpri = lock_waiterpriority(lock);
+		if (wpri < pri) {
+			pri = wpri;
+		}
+	}
+	return pri;
+}
+
+/*
+ * The current thread is about to sleep waiting for LOCK. Count it as
+ * a waiter and pass its priority along the chain of holders.
+ */
+static
+void
+lock_startwait(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned pri, depth;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	spinlock_acquire(&lock_pilock);
+	pri = curthread->t_priority;
+	curthread->t_waitlock = lock;
+	lock->lk_waitpri[pri]++;
+
+	for (depth = 0; lock != NULL && depth < LOCK_PI_MAXDEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL || holder->t_priority <= pri) {
+			break;
+		}
+		lock_setpriority(holder, pri);
+		lock = holder->t_waitlock;
+	}
+	spinlock_release(&lock_pilock);
+}
+
+/*
+ * The current thread has woken up and is no longer waiting for LOCK.
+ */
+static
+void
+lock_endwait(struct lock *lock)
+{
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	spinlock_acquire(&lock_pilock);
+	KASSERT(curthread->t_waitlock == lock);
+	KASSERT(lock->lk_waitpri[curthread->t_priority] > 0);
+	lock->lk_waitpri[curthread->t_priority]--;
+	curthread->t_waitlock = NULL;
+	spinlock_release(&lock_pilock);
+}
+
+void
+lock_repriority(void)
+{
+	spinlock_acquire(&lock_pilock);
+	lock_setpriority(curthread, lock_heldpriority());
+	spinlock_release(&lock_pilock);
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	struct thread *holder;
+	bool spun = false, slept = false;
+	unsigned loops = 0, pri;
+
+	KASSERT(lock != NULL);
+
+	/* May not block in an interrupt handler. */
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock->lk_holder != curthread);
+
+	spinlock_acquire(&lock->lk_lock);
+	while (lock->lk_holder != NULL) {
+		holder = lock->lk_holder;
+		if (!slept && !spun && holder->t_state == S_RUN &&
+		    holder->t_cpu != curcpu) {
+			/*
+			 * The holder is running; it'll probably let go
+			 * soon. Watch for that without the spinlock, so
+			 * as not to hold up the release. Only spin once
+			 * per acquire: if it didn't work the first time,
+			 * the holder is staying a while.
+			 */
+			spinlock_release(&lock->lk_lock);
+			loops += lock_spin(lock);
+			spun = true;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+
+		/* Same dance as in P(). */
+		lock->lk_nwaiters++;
+		lock_startwait(lock);
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+		wchan_sleep(lock->lk_wchan);
+		slept = true;
+
+		spinlock_acquire(&lock->lk_lock);
+		lock_endwait(lock);
+		KASSERT(lock->lk_nwaiters > 0);
+		lock->lk_nwaiters--;
+	}
+	lock->lk_holder = curthread;
+	lock->lk_heldnext = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+	lock->lk_acquires++;
+	if (slept) {
+		lock->lk_sleepacquires++;
+	}
+	else if (spun) {
+		lock->lk_spinacquires++;
+	}
+	if (lock->lk_nwaiters > 0) {
+		/* Take over the loans of those still waiting. */
+		spinlock_acquire(&lock_pilock);
+		pri = lock_waiterpriority(lock);
+		if (pri < curthread->t_priority) {
+			lock_setpriority(curthread, pri);
+		}
+		spinlock_release(&lock_pilock);
+	}
+	spinlock_release(&lock->lk_lock);
+
+	if (spun || slept) {
+		spinlock_acquire(&lock_stats_lock);
+		lock_stats.contended++;
+		if (slept) {
+			lock_stats.slept++;
+		}
+		else {
+			lock_stats.spun++;
+		}
+		lock_stats.spinloops += loops;
+		spinlock_release(&lock_stats_lock);
+	}
 
-        (void)lock;  // suppress warning until code gets written
+#if OPT_LOCKSTAT
+	lockstat_acquired(lock->lk_stat, spun || slept, loops);
+	lock->lk_acqtime = lockstat_now();
+#endif
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
+	struct lock **lp;
+
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
+#if OPT_LOCKSTAT
+	lockstat_held(lock->lk_stat, lock->lk_acqtime);
+#endif
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder == curthread);
+
+	/* Locks are usually released in reverse order; this is short. */
+	for (lp = &curthread->t_heldlocks; *lp != lock;
+	     lp = &(*lp)->lk_heldnext) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_heldnext;
+	lock->lk_heldnext = NULL;
+
+	/*
+	 * If nobody's waiting and we haven't been lent a priority,
+	 * there's no inheritance state to fix up. (A loan can only
+	 * arrive through a lock with waiters, and if that's some other
+	 * lock we hold, we're still entitled to it.)
+	 *
+	 * If we drop back to a lower priority, we don't yield here,
+	 * since cv_wait calls us with its wchan locked; the next
+	 * hardclock preempts us if someone more urgent is waiting.
+	 */
+	if (lock->lk_nwaiters > 0 ||
+	    curthread->t_priority != curthread->t_basepri) {
+		spinlock_acquire(&lock_pilock);
+		lock->lk_holder = NULL;
+		lock_setpriority(curthread, lock_heldpriority());
+		spinlock_release(&lock_pilock);
+	}
+	else {
+		lock->lk_holder = NULL;
+	}
+	if (lock->lk_nwaiters > 0) {
+		wchan_wakeone(lock->lk_wchan);
+	}
+	spinlock_release(&lock->lk_lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
+	/* Only we can set it to us, so no need for the spinlock. */
+	return lock->lk_holder == curthread;
+}
 
-        return true; // dummy until code gets written
+void
+lock_printstats(void)
+{
+	unsigned contended, spun, slept, spinloops;
+	unsigned readwaits, writewaits;
+
+	spinlock_acquire(&lock_stats_lock);
+	contended = lock_stats.contended;
+	spun = lock_stats.spun;
+	slept = lock_stats.slept;
+	spinloops = lock_stats.spinloops;
+	readwaits = lock_stats.rwreadwaits;
+	writewaits = lock_stats.rwwritewaits;
+	spinlock_release(&lock_stats_lock);
+
+	kprintf("Locks: %u contended acquires\n", contended);
+	kprintf("    %u got by spinning, %u by sleeping\n", spun, slept);
+	kprintf("    %u spin loops, %u per contended acquire\n", spinloops,
+		contended == 0 ? 0 : spinloops / contended);
+	kprintf("RW locks: %u reader waits, %u writer waits\n",
+		readwaits, writewaits);
 }
 
 ////////////////////////////////////////////////////////////
@@ -215,19 +665,24 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(cv_cache, cv);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	cv->cv_wchan = wchan_create(cv->cv_name);
+	if (cv->cv_wchan == NULL) {
+		kfree(cv->cv_name);
+		kmem_cache_free(cv_cache, cv);
+		return NULL;
+	}
+
         return cv;
 }
 
@@ -236,32 +691,242 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
-        
+	/* wchan_destroy will assert if anyone's waiting on it */
+	wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Lock the wchan before letting go of the lock, so a signal
+	 * sent by whoever gets the lock next can't be lost.
+	 */
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(cv->cv_wchan);
+	lock_acquire(lock);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeone(cv->cv_wchan);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeall(cv->cv_wchan);
+}
+
+////////////////////////////////////////////////////////////
+//
+// RW lock
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmem_cache_alloc(rwlock_cache);
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kmem_cache_free(rwlock_cache, rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kmem_cache_free(rwlock_cache, rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kmem_cache_free(rwlock_cache, rw);
+		return NULL;
+	}
+
+	/* rw_lock is set up by rwlock_ctor */
+	spinlock_setname(&rw->rw_lock, rw->rw_name);
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_waitreaders = 0;
+	rw->rw_waitwriters = 0;
+	rw->rw_readgen = 0;
+	rw->rw_readacquires = 0;
+	rw->rw_writeacquires = 0;
+	rw->rw_readwaits = 0;
+	rw->rw_writewaits = 0;
+	rw->rw_maxreaders = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+
+	/* wchan_destroy will assert if anyone's waiting on them */
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kmem_cache_free(rwlock_cache, rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	unsigned gen;
+	bool waited = false;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	if (rw->rw_writer != NULL || rw->rw_waitwriters > 0) {
+		/*
+		 * Wait until there's no writer and either no writer is
+		 * waiting or a writer has let waiting readers in since
+		 * we started.
+		 */
+		gen = rw->rw_readgen;
+		rw->rw_waitreaders++;
+		rw->rw_readwaits++;
+		waited = true;
+		while (rw->rw_writer != NULL ||
+		       (rw->rw_waitwriters > 0 && rw->rw_readgen == gen)) {
+			wchan_lock(rw->rw_readwchan);
+			spinlock_release(&rw->rw_lock);
+			wchan_sleep(rw->rw_readwchan);
+			spinlock_acquire(&rw->rw_lock);
+		}
+		KASSERT(rw->rw_waitreaders > 0);
+		rw->rw_waitreaders--;
+	}
+	rw->rw_readers++;
+	rw->rw_readacquires++;
+	if (rw->rw_readers > rw->rw_maxreaders) {
+		rw->rw_maxreaders = rw->rw_readers;
+	}
+	spinlock_release(&rw->rw_lock);
+
+	if (waited) {
+		spinlock_acquire(&lock_stats_lock);
+		lock_stats.rwreadwaits++;
+		spinlock_release(&lock_stats_lock);
+	}
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	bool waited = false;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	if (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_waitwriters++;
+		rw->rw_writewaits++;
+		waited = true;
+		while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+			wchan_lock(rw->rw_writewchan);
+			spinlock_release(&rw->rw_lock);
+			wchan_sleep(rw->rw_writewchan);
+			spinlock_acquire(&rw->rw_lock);
+		}
+		KASSERT(rw->rw_waitwriters > 0);
+		rw->rw_waitwriters--;
+	}
+	rw->rw_writer = curthread;
+	rw->rw_writeacquires++;
+	spinlock_release(&rw->rw_lock);
+
+	if (waited) {
+		spinlock_acquire(&lock_stats_lock);
+		lock_stats.rwwritewaits++;
+		spinlock_release(&lock_stats_lock);
+	}
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_waitreaders > 0) {
+		/* Readers' turn: let in everyone waiting now. */
+		rw->rw_readgen++;
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	else if (rw->rw_waitwriters > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	/* Only we can set it to us, so no need for the spinlock. */
+	return rw->rw_writer == curthread;
+}
+
+void
+rwlock_printstats(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	kprintf("%s: %u read acquires (%u waited, at most %u at once), "
+		"%u write acquires (%u waited)\n", rw->rw_name,
+		rw->rw_readacquires, rw->rw_readwaits, rw->rw_maxreaders,
+		rw->rw_writeacquires, rw->rw_writewaits);
+	spinlock_release(&rw->rw_lock);
 }
@@ -50,6 +50,9 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
+#include <clock.h>
+#include <trace.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +75,29 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
+/* Cache-hot threshold for migration, in hardclocks; see thread.h. */
+#define THREAD_MIGRATE_COST	2
+unsigned thread_migrate_cost = THREAD_MIGRATE_COST;
+
+/* Set by thread_start_cpus, once there's a clock to read. */
+static bool thread_usage_on;
+
+/* The current time, as a number of nanoseconds. */
+static
+uint64_t
+thread_usage_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -112,44 +138,93 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Constructor and destructor for thread_cache. Threads freed back to
+ * the cache must have their list node unlinked.
  */
 static
-struct thread *
-thread_create(const char *name)
+void
+thread_ctor(void *obj)
 {
-	struct thread *thread;
+	struct thread *thread = obj;
 
-	DEBUGASSERT(name != NULL);
+	threadlistnode_init(&thread->t_listnode, thread);
+}
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
-	}
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
+/*
+ * Initialize the fields of a new or recycled thread, other than
+ * t_name, t_listnode, and t_stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_listnode is set up by thread_ctor */
+	/* t_stack is set up by the caller */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_level = 0;
+	thread->t_ticks = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_lastran = 0;
+	thread->t_migrations = 0;
+	thread->t_bound = false;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
+	thread->t_usagestamp = 0;
+	thread->t_basepri = PRI_DEFAULT;
+	thread->t_priority = PRI_DEFAULT;
+	thread->t_heldlocks = NULL;
+	thread->t_waitlock = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_tid = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmem_cache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		kmem_cache_free(thread_cache, thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -166,6 +241,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -180,14 +256,44 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tickless = false;
+	c->c_tickstop_secs = 0;
+	c->c_tickstop_nsecs = 0;
+	c->c_tickstops = 0;
+	c->c_ticksskipped = 0;
+	timer_cpu_init(c);
+	kmalloc_cpu_init(c);
+	workqueue_cpu_init(c);
+	trace_cpu_init(c);
+	prof_cpu_init(c);
+	c->c_intrpc = 0;
+	c->c_intruser = false;
+	c->c_boosts = 0;
+	c->c_lastboost = 0;
+	c->c_demotions = 0;
+	c->c_steals = 0;
+	threadlist_init(&c->c_threadpool);
+	c->c_poollow = 0;
+	c->c_pooltrimtime = 0;
+	c->c_poolhits = 0;
+	c->c_poolmisses = 0;
+	c->c_pooltrimmed = 0;
+	c->c_qnodesused = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	/* Every cpu goes after these when idle, so keep them fair. */
+	spinlock_init_queued(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		c->c_runlevels[i] = 0;
+	}
+	c->c_promotions = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "ipi");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -227,6 +333,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus created so far. Once thread_start_cpus has run,
+ * that's all of them.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -252,19 +374,134 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Thread pool.
+ *
+ * Rather than freeing dead threads, exorcise() keeps up to
+ * THREADPOOL_MAX of them per cpu, with their stacks, and thread_fork
+ * reuses them. This saves allocating and freeing the thread structure
+ * and stack (and restamping the stack guard) on every fork and exit.
+ *
+ * To avoid hanging on to memory after a burst of forks, the pool is
+ * trimmed every THREADPOOL_TRIM_HARDCLOCKS: the smallest number of
+ * threads that sat in the pool at any time since the last trim were
+ * not needed during that time, so that many are freed.
+ *
+ * The pool belongs to its cpu and is only touched at splhigh.
+ */
+#define THREADPOOL_MAX			8	/* high-water mark */
+#define THREADPOOL_TRIM_HARDCLOCKS	HZ	/* once a second */
+
+/*
+ * Get a thread from the pool and give it the name NAME. Returns NULL
+ * if the pool is empty or if out of memory for the name.
+ */
+static
+struct thread *
+threadpool_get(const char *name)
+{
+	struct cpu *c;
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	thread = threadlist_remhead(&c->c_threadpool);
+	if (thread != NULL) {
+		c->c_poolhits++;
+		if (c->c_threadpool.tl_count < c->c_poollow) {
+			c->c_poollow = c->c_threadpool.tl_count;
+		}
+	}
+	else {
+		c->c_poolmisses++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	/* The stack guard was checked when the thread exited. */
+	thread_init(thread);
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		thread_destroy(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+/*
+ * Put a dead thread in the current cpu's pool, or destroy it if the
+ * pool is full. Called from exorcise(), at splhigh.
+ */
+static
+void
+threadpool_put(struct thread *thread)
+{
+	struct cpu *c = curcpu->c_self;
+
+	KASSERT(thread->t_proc == NULL);
+	KASSERT(thread->t_state == S_ZOMBIE);
+
+	/* The boot threads run on stacks that can't be reused. */
+	if (thread->t_stack == NULL ||
+	    c->c_threadpool.tl_count >= THREADPOOL_MAX) {
+		thread_destroy(thread);
+		return;
+	}
+
+	thread_machdep_cleanup(&thread->t_machdep);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "POOLED";
+	threadlist_addhead(&c->c_threadpool, thread);
+}
+
+/*
+ * Free whatever the pool didn't need since the last trim. Called from
+ * exorcise(), at splhigh.
+ */
+static
+void
+threadpool_trim(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *thread;
+	unsigned n;
+
+	if (c->c_hardclocks - c->c_pooltrimtime < THREADPOOL_TRIM_HARDCLOCKS) {
+		return;
+	}
+
+	/* Take the ones from the tail; they've been there longest. */
+	for (n = c->c_poollow; n > 0; n--) {
+		thread = threadlist_remtail(&c->c_threadpool);
+		KASSERT(thread != NULL);
+		thread_destroy(thread);
+		c->c_pooltrimmed++;
+	}
+	c->c_poollow = c->c_threadpool.tl_count;
+	c->c_pooltrimtime = c->c_hardclocks;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them, or to be put in the
+ * thread pool.)
  *
  * The list of zombies is per-cpu.
  */
@@ -277,8 +514,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		threadpool_put(z);
 	}
+	threadpool_trim();
 }
 
 /*
@@ -306,6 +544,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	bzero(curcpu->c_runlevels, sizeof(curcpu->c_runlevels));
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +590,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -413,9 +658,16 @@ void
 thread_start_cpus(void)
 {
 	unsigned i;
+	int spl;
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* The clock is attached by now; start charging for time. */
+	spl = splhigh();
+	curthread->t_usagestamp = thread_usage_now();
+	thread_usage_on = true;
+	splx(spl);
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,6 +678,267 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue handling.
+ *
+ * The run queue is kept sorted by priority, then by scheduler level
+ * (smaller numbers first for both), and FIFO among threads that tie.
+ * So taking from the head gets the next thread to run and taking from
+ * the tail gets the least urgent one, which is what migration wants.
+ * The per-level counts in c_runlevels are kept up to date alongside.
+ */
+
+/* Scheduler parameters; see schedule() below. */
+#define SCHED_QUANTUM(level)	(1U << (level))	/* in hardclocks */
+#define SCHED_BOOST_HARDCLOCKS	HZ		/* once a second */
+
+/* True if A should run before B. */
+static
+bool
+thread_before(struct thread *a, struct thread *b)
+{
+	if (a->t_priority != b->t_priority) {
+		return a->t_priority < b->t_priority;
+	}
+	return a->t_level < b->t_level;
+}
+
+/* Add T to C's run queue after everything as urgent or more. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct thread *t2;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_level < SCHED_NLEVELS);
+
+	/* Usually the tail qualifies and this loop runs once. */
+	THREADLIST_FORALL_REV(t2, c->c_runqueue) {
+		if (!thread_before(t, t2)) {
+			threadlist_insertafter(&c->c_runqueue, t2, t);
+			c->c_runlevels[t->t_level]++;
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+	c->c_runlevels[t->t_level]++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	t = threadlist_remhead(&c->c_runqueue);
+	if (t != NULL) {
+		KASSERT(c->c_runlevels[t->t_level] > 0);
+		c->c_runlevels[t->t_level]--;
+	}
+	return t;
+}
+
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	t = threadlist_remtail(&c->c_runqueue);
+	if (t != NULL) {
+		KASSERT(c->c_runlevels[t->t_level] > 0);
+		c->c_runlevels[t->t_level]--;
+	}
+	return t;
+}
+
+static
+void
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	threadlist_remove(&c->c_runqueue, t);
+	KASSERT(c->c_runlevels[t->t_level] > 0);
+	c->c_runlevels[t->t_level]--;
+}
+
+/*
+ * Check if T is likely to still have cache state on the cpu it last
+ * ran on: that is, if it ran there within the last
+ * thread_migrate_cost hardclocks. Threads that have never run have
+ * nothing to lose. The other cpu's clock count is read without
+ * locking; it's only a hint.
+ */
+static
+bool
+thread_cachehot(struct thread *t)
+{
+	if (t->t_lastcpu == NULL) {
+		return false;
+	}
+	return t->t_lastcpu->c_hardclocks - t->t_lastran <
+		thread_migrate_cost;
+}
+
+/*
+ * Take up to MAX threads that are not cache-hot off C's run queue,
+ * starting from the tail, and put them on LIST in queue order.
+ * Returns the number taken.
+ *
+ * Threads bound to C are never taken, and neither is C's current
+ * thread. Ordinarily that isn't on the run queue, but it can be if
+ * it went to sleep, C went idle so it stayed curthread, and it was
+ * woken again before C has fully unidled. Migrating it then would be
+ * a disaster.
+ */
+static
+unsigned
+runqueue_takecold(struct cpu *c, struct threadlist *list, unsigned max)
+{
+	struct thread *t, *prev;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	n = 0;
+	t = c->c_runqueue.tl_tail.tln_prev->tln_self;
+	while (t != NULL && n < max) {
+		prev = t->t_listnode.tln_prev->tln_self;
+		if (t != c->c_curthread && !t->t_bound &&
+		    !thread_cachehot(t)) {
+			runqueue_remove(c, t);
+			threadlist_addhead(list, t);
+			n++;
+		}
+		t = prev;
+	}
+	return n;
+}
+
+/*
+ * First thread on C's run queue, or NULL if there isn't one.
+ */
+static
+struct thread *
+runqueue_head(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	return c->c_runqueue.tl_head.tln_next->tln_self;
+}
+
+/*
+ * Work stealing.
+ *
+ * Called by a cpu that has run out of things to do, before it goes
+ * to sleep in cpu_idle(), without its own run queue lock. Find the
+ * cpu with the most threads waiting and take half of them (rounded
+ * up) from the tail of its run queue, which is where the least
+ * urgent ones are. Threads that are still cache-hot on the victim are
+ * passed over; but if that leaves nothing and the victim has more
+ * than one thread waiting, take one anyway, since sitting in a queue
+ * costs more than a cold cache. Returns the number of threads taken.
+ *
+ * The queue lengths used to pick the victim are read without any
+ * locking. They are only a hint; if one is stale, the worst that
+ * happens is a wasted attempt and another trip round the idle loop.
+ * We never hold two run queue locks at once.
+ */
+static
+unsigned
+thread_steal(void)
+{
+	struct cpu *self, *c, *victim;
+	struct threadlist stolen;
+	struct thread *t;
+	unsigned i, numcpus, count, most, n;
+
+	self = curcpu->c_self;
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == self) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > most) {
+			most = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return 0;
+	}
+
+	threadlist_init(&stolen);
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	count = DIVROUNDUP(victim->c_runqueue.tl_count, 2);
+	n = runqueue_takecold(victim, &stolen, count);
+	if (n == 0 && victim->c_runqueue.tl_count > 1) {
+		t = runqueue_remtail(victim);
+		if (t == victim->c_curthread || t->t_bound) {
+			runqueue_add(victim, t);
+		}
+		else {
+			threadlist_addhead(&stolen, t);
+			n++;
+		}
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (n > 0) {
+		spinlock_acquire(&self->c_runqueue_lock);
+		while ((t = threadlist_remhead(&stolen)) != NULL) {
+			TRACE(TRACE_MIGRATE, victim->c_number, t,
+			      self->c_number);
+			t->t_cpu = self;
+			t->t_migrations++;
+			runqueue_add(self, t);
+		}
+		spinlock_release(&self->c_runqueue_lock);
+		self->c_steals += n;
+		DEBUG(DB_THREADS, "cpu %u stole %u threads from cpu %u\n",
+		      self->c_number, n, victim->c_number);
+	}
+
+	threadlist_cleanup(&stolen);
+	return n;
+}
+
+/*
+ * Put a thread on the run queue of its cpu, which must be locked.
+ * Doesn't wake the cpu up if it's idle; that's up to the caller.
+ */
+static
+void
+runqueue_wake(struct cpu *targetcpu, struct thread *target)
+{
+	KASSERT(target->t_cpu == targetcpu);
+
+	if (target->t_state == S_SLEEP) {
+		TRACE(TRACE_WAKEUP, targetcpu->c_number, target, 0);
+
+		/*
+		 * Waking up. If the thread went to sleep without using
+		 * much of its time at this level, it's waiting for I/O
+		 * more than it's computing; move it up a level.
+		 */
+		if (target->t_level > 0 &&
+		    target->t_ticks < SCHED_QUANTUM(target->t_level) / 2) {
+			target->t_level--;
+			target->t_ticks = 0;
+			targetcpu->c_promotions++;
+		}
+	}
+
+	runqueue_add(targetcpu, target);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +963,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_wake(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -471,14 +984,17 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
  * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * process is inherited from the caller. It will start on cpu C, or on
+ * the same CPU as the caller if C is null. If BOUND is true it stays
+ * on that cpu; otherwise the scheduler may move it.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_common(const char *name,
+		   struct proc *proc,
+		   struct cpu *c, bool bound,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -487,25 +1003,32 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if we can. */
+	newthread = threadpool_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = c != NULL ? c : curthread->t_cpu;
+	newthread->t_bound = bound;
+	newthread->t_basepri = curthread->t_basepri;
+	newthread->t_priority = curthread->t_basepri;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -528,12 +1051,34 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the new thread's cpu's run queue and make it runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, NULL, false,
+				  entrypoint, data1, data2);
+}
+
+int
+thread_fork_bound(const char *name,
+		  struct proc *proc,
+		  struct cpu *c,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
+{
+	KASSERT(c != NULL);
+	return thread_fork_common(name, proc, c, true,
+				  entrypoint, data1, data2);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -573,13 +1118,30 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. This
+	 * includes yielding when everything waiting is less urgent
+	 * than we are; we'd only be picked again.
+	 */
+	next = runqueue_head(curcpu->c_self);
+	if (newstate == S_READY && (next == NULL || thread_before(cur, next))) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/*
+	 * Charge cur for its time so far, before any idling below,
+	 * which is nobody's, and count the switch.
+	 */
+	thread_chargetime(false);
+	if (newstate == S_SLEEP) {
+		cur->t_usage.tu_nvcsw++;
+	}
+	else if (newstate == S_READY) {
+		cur->t_usage.tu_nivcsw++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -613,7 +1175,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal
+	 * some from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -632,14 +1195,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (thread_steal() == 0) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	hardclock_resume();
+
+	/* Record it while curthread is still cur, for spl's sake. */
+	TRACE(TRACE_SWITCH, newstate, cur, next);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -651,6 +1220,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	/* Remember where and when cur last ran, for thread_cachehot. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastran = curcpu->c_hardclocks;
+
+	/* next's time starts now. */
+	if (thread_usage_on) {
+		next->t_usagestamp = thread_usage_now();
+	}
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -820,27 +1398,306 @@ thread_yield(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Scheduler.
+ * Resource usage.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Time comes from gettime. The cycle counter would be cheaper, but
+ * the timer code resets it. gettime uses spl itself, so callers must
+ * already be at splhigh; otherwise its splx could turn interrupts on
+ * in the middle of the trap code.
  */
 
 void
+thread_chargetime(bool user)
+{
+	struct thread *cur = curthread;
+	uint64_t now;
+
+	KASSERT(cur->t_curspl > 0);
+	if (!thread_usage_on) {
+		return;
+	}
+	now = thread_usage_now();
+	if (user) {
+		cur->t_usage.tu_utime += now - cur->t_usagestamp;
+	}
+	else {
+		cur->t_usage.tu_stime += now - cur->t_usagestamp;
+	}
+	cur->t_usagestamp = now;
+}
+
+void
+thread_usage_add(struct thread_usage *to, const struct thread_usage *from)
+{
+	to->tu_utime += from->tu_utime;
+	to->tu_stime += from->tu_stime;
+	to->tu_nvcsw += from->tu_nvcsw;
+	to->tu_nivcsw += from->tu_nivcsw;
+	to->tu_minflt += from->tu_minflt;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler.
+ *
+ * This is a multi-level feedback queue. Each thread has a level, 0
+ * through SCHED_NLEVELS-1, and the run queue is kept in level order
+ * so the best thread waiting is always at the head. The rules are:
+ *
+ *   - a thread at level L runs for up to SCHED_QUANTUM(L) hardclocks
+ *     before it has to let other threads at level L have a turn;
+ *   - once it has used a whole quantum at level L, counting across
+ *     any sleeps in between, it drops to level L+1 (decay);
+ *   - if it wakes up having used less than half a quantum at its
+ *     level, it moves up one (see thread_make_runnable);
+ *   - every SCHED_BOOST_HARDCLOCKS, everything on the run queue and
+ *     the running thread go back to level 0, so CPU-bound threads
+ *     don't starve (boost);
+ *   - a thread is preempted at the next hardclock when something at
+ *     a better level is waiting.
+ *
+ * Lower levels get longer quanta, so CPU-bound work gets switched
+ * less often, while interactive threads stay near the top and get
+ * the processor back quickly. Level 0's quantum is one hardclock,
+ * the same as plain round-robin.
+ *
+ * schedule() is called from hardclock() on every cpu, at every
+ * hardclock, and returns true if the current thread should yield.
+ */
+bool
 schedule(void)
 {
+	struct cpu *c = curcpu->c_self;
+	struct thread *cur = curthread;
+	struct thread *t;
+	bool ret;
+	unsigned i;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Boost. c_hardclocks jumps when the clock was stopped while
+	 * idle, so go by the time since the last boost rather than
+	 * waiting for a multiple of SCHED_BOOST_HARDCLOCKS.
+	 *
+	 * If the cpu is idle, curthread is whatever was running last;
+	 * it might be asleep, or even on some run queue, so leave it
+	 * alone.
 	 */
+	if (c->c_hardclocks - c->c_lastboost >= SCHED_BOOST_HARDCLOCKS) {
+		/* Setting every level to 0 keeps the queue in order. */
+		THREADLIST_FORALL(t, c->c_runqueue) {
+			t->t_level = 0;
+			t->t_ticks = 0;
+		}
+		for (i=0; i<SCHED_NLEVELS; i++) {
+			c->c_runlevels[i] = 0;
+		}
+		c->c_runlevels[0] = c->c_runqueue.tl_count;
+		if (!c->c_isidle) {
+			cur->t_level = 0;
+			cur->t_ticks = 0;
+		}
+		c->c_boosts++;
+		c->c_lastboost = c->c_hardclocks;
+	}
+
+	if (c->c_isidle) {
+		spinlock_release(&c->c_runqueue_lock);
+		return false;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_level)) {
+		/* Used up its quantum; down a level and round-robin. */
+		cur->t_ticks = 0;
+		if (cur->t_level < SCHED_NLEVELS - 1) {
+			cur->t_level++;
+			c->c_demotions++;
+		}
+		ret = true;
+	}
+	else {
+		/* Preempt if someone better is waiting. */
+		t = runqueue_head(c);
+		ret = t != NULL && thread_before(t, cur);
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+	return ret;
+}
+
+void
+thread_setpriority(unsigned pri)
+{
+	KASSERT(pri <= PRI_LOWEST);
+
+	curthread->t_basepri = pri;
+	lock_repriority();
+
+	/* If that made us less urgent than someone waiting, let them in. */
+	thread_yield();
+}
+
+/*
+ * The caller holds the priority inheritance lock, so T's priority
+ * can't change under us, but T may be moving between cpus. Moving it
+ * takes it off one run queue and puts it on another under separate
+ * locks; if we catch it in between, it isn't on either queue, and
+ * runqueue_add will put it in the right place with the new priority
+ * when it gets there.
+ */
+void
+thread_changepriority(struct thread *t, unsigned pri)
+{
+	struct cpu *c;
+	struct thread *t2;
+
+	KASSERT(pri <= PRI_LOWEST);
+
+	if (t->t_priority == pri) {
+		return;
+	}
+
+	while (1) {
+		c = t->t_cpu;
+		if (c == NULL) {
+			/* Not started yet; it isn't on any queue. */
+			t->t_priority = pri;
+			return;
+		}
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	t->t_priority = pri;
+	THREADLIST_FORALL(t2, c->c_runqueue) {
+		if (t2 == t) {
+			runqueue_remove(c, t);
+			runqueue_add(c, t);
+			break;
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Print the threads on C's run queue, with their scheduling and
+ * affinity state. Prints while holding the run queue lock, so this
+ * goes out on the polled console path; it's for debugging only.
+ */
+static
+void
+thread_printrunqueue(struct cpu *c)
+{
+	struct thread *t;
+
+	kprintf("cpu%u:\n", c->c_number);
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (!c->c_isidle) {
+		t = c->c_curthread;
+		kprintf("    %-16s run   P%-2u L%u  %6u migrations\n",
+			t->t_name, t->t_priority, t->t_level,
+			t->t_migrations);
+	}
+	THREADLIST_FORALL(t, c->c_runqueue) {
+		kprintf("    %-16s ready P%-2u L%u  %6u migrations", t->t_name,
+			t->t_priority, t->t_level, t->t_migrations);
+		if (t->t_lastcpu != NULL) {
+			kprintf(", ran on cpu%u %u ticks ago%s",
+				t->t_lastcpu->c_number,
+				t->t_lastcpu->c_hardclocks - t->t_lastran,
+				thread_cachehot(t) ? " (hot)" : "");
+		}
+		kprintf("\n");
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Print the run queue lengths for each level on each cpu.
+ */
+void
+thread_printschedstats(bool showthreads)
+{
+	unsigned i, j, numcpus;
+	unsigned levels[SCHED_NLEVELS];
+	unsigned promotions, curlevel;
+	bool idle;
+	struct cpu *c;
+
+	kprintf("cpu  cur");
+	for (j=0; j<SCHED_NLEVELS; j++) {
+		kprintf("   L%u", j);
+	}
+	kprintf("   boosts   demote  promote   steals\n");
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			levels[j] = c->c_runlevels[j];
+		}
+		promotions = c->c_promotions;
+		idle = c->c_isidle;
+		curlevel = c->c_curthread->t_level;
+		spinlock_release(&c->c_runqueue_lock);
+
+		kprintf("%3u", c->c_number);
+		if (idle) {
+			kprintf("    -");
+		}
+		else {
+			kprintf("   L%u", curlevel);
+		}
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf(" %4u", levels[j]);
+		}
+		kprintf(" %8u %8u %8u %8u\n", c->c_boosts, c->c_demotions,
+			promotions, c->c_steals);
+	}
+	kprintf("Migration cost: %u hardclocks\n", thread_migrate_cost);
+
+	kprintf("cpu  hardclocks  tickstops  skipped\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %10u %10u %8u\n", c->c_number,
+			c->c_hardclocks, c->c_tickstops, c->c_ticksskipped);
+	}
+
+	kprintf("cpu  pending  started    fired   cancel cascaded\n");
+	for (i=0; i<numcpus; i++) {
+		timer_printstats(cpuarray_get(&allcpus, i));
+	}
+
+	kprintf("cpu  pooled     hits   misses  trimmed\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %6u %8u %8u %8u\n", c->c_number,
+			c->c_threadpool.tl_count, c->c_poolhits,
+			c->c_poolmisses, c->c_pooltrimmed);
+	}
+
+	if (showthreads) {
+		for (i=0; i<numcpus; i++) {
+			thread_printrunqueue(cpuarray_get(&allcpus, i));
+		}
+	}
 }
 
 /*
  * Thread migration.
  *
  * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * CPU is busy and other CPUs are less busy, it should move threads
+ * across to those other other CPUs. (CPUs that run out of work don't
+ * wait for this; they steal from the busiest CPU before idling. See
+ * thread_steal.)
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
@@ -848,9 +1705,12 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * So we only push threads that have not run recently (see
+ * thread_cachehot), picking them from the tail of the run queue.
+ * Threads that ran within the last thread_migrate_cost hardclocks
+ * stay where they are, even if that leaves things a bit unbalanced.
+ * System/161 doesn't model caches, so setting thread_migrate_cost
+ * to 0 to get maximally aggressive balancing costs nothing there.
  */
 void
 thread_consider_migration(void)
@@ -861,16 +1721,19 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	/*
+	 * Count without locking; as in thread_steal, the numbers are
+	 * only a guide. Taking every cpu's lock here, from every cpu,
+	 * at every migration tick, is not worth it.
+	 */
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
 		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
 			my_count = c->c_runqueue.tl_count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -881,10 +1744,8 @@ thread_consider_migration(void)
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	/* This also copes with the unlocked count being out of date. */
+	to_send = runqueue_takecold(curcpu->c_self, &victims, to_send);
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -895,36 +1756,14 @@ thread_consider_migration(void)
 		spinlock_acquire(&c->c_runqueue_lock);
 		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+			/* runqueue_takecold never takes curthread. */
+			KASSERT(t != curthread);
 
+			TRACE(TRACE_MIGRATE, curcpu->c_number, t,
+			      c->c_number);
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			t->t_migrations++;
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1787,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -963,6 +1802,45 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor and destructor for wchan_cache. Wait channels freed
+ * back to the cache are empty and unlocked, as wchan_destroy
+ * requires, so they're ready to be handed out again.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. This has to happen before anything
+ * makes a semaphore, which is earlier than thread_bootstrap.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,13 +1854,12 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+	spinlock_setname(&wc->wc_lock, name);
 	return wc;
 }
 
@@ -993,9 +1870,9 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(wc->wc_lock.lk_holder == NULL);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1034,11 +1911,22 @@ wchan_sleep(struct wchan *wc)
 void
 wchan_wakeone(struct wchan *wc)
 {
-	struct thread *target;
+	struct thread *target, *t;
 
-	/* Lock the channel and grab a thread from it */
+	/*
+	 * Lock the channel and grab the most urgent thread from it.
+	 * The list is in the order the threads went to sleep.
+	 */
 	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	target = NULL;
+	THREADLIST_FORALL(t, wc->wc_threads) {
+		if (target == NULL || t->t_priority < target->t_priority) {
+			target = t;
+		}
+	}
+	if (target != NULL) {
+		threadlist_remove(&wc->wc_threads, target);
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1060,9 +1948,12 @@ void
 wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
-	struct threadlist list;
+	struct threadlist list, others;
+	struct cpu *targetcpu;
+	bool isidle;
 
 	threadlist_init(&list);
+	threadlist_init(&others);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
@@ -1079,14 +1970,37 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Wake the threads a cpu at a time: lock the first thread's
+	 * cpu, queue every thread on the list that belongs there, and
+	 * set the rest aside for the next round. That way a broadcast
+	 * takes each run queue lock once and sends each idle cpu one
+	 * IPI, rather than once per thread. Sleeping threads don't
+	 * migrate, so t_cpu holds still while we do this.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		targetcpu = target->t_cpu;
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		isidle = targetcpu->c_isidle;
+		runqueue_wake(targetcpu, target);
+		while ((target = threadlist_remhead(&list)) != NULL) {
+			if (target->t_cpu == targetcpu) {
+				runqueue_wake(targetcpu, target);
+			}
+			else {
+				threadlist_addtail(&others, target);
+			}
+		}
+		if (isidle) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+
+		while ((target = threadlist_remhead(&others)) != NULL) {
+			threadlist_addtail(&list, target);
+		}
 	}
 
+	threadlist_cleanup(&others);
 	threadlist_cleanup(&list);
 }
 
@@ -0,0 +1,338 @@
+/*
+ * Event tracing.
+ *
+ * The specification of the interface is in trace.h.
+ *
+ * A ring is a power-of-two array of events and a count of events ever
+ * recorded; the next one goes at tr_head % TRACE_NEVENTS. Reading a
+ * ring while its cpu is still recording could catch an event half
+ * written, so trace_dump and trace_save stop recording first.
+ *
+ * Events are stamped with gettime(), which is the same clock on every
+ * cpu, so times from different cpus can be compared directly. (The
+ * cpus' cycle counters can't be used: the timer code resets them at
+ * every hardclock.)
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <trace.h>
+
+#if OPT_TRACE
+
+/* Events kept per cpu; must be a power of 2. */
+#define TRACE_NEVENTS		2048
+
+struct trace_ring {
+	uint32_t tr_head;		/* events ever recorded */
+	struct trace_event tr_events[TRACE_NEVENTS];
+};
+
+volatile bool trace_on;
+
+void
+trace_cpu_init(struct cpu *c)
+{
+	c->c_trace = kmalloc(sizeof(*c->c_trace));
+	if (c->c_trace == NULL) {
+		panic("trace_cpu_init: Out of memory\n");
+	}
+	c->c_trace->tr_head = 0;
+}
+
+void
+trace_record(unsigned type, unsigned info, uint32_t a, uint32_t b)
+{
+	struct trace_ring *tr;
+	struct trace_event *te;
+	time_t secs;
+	uint32_t nsecs;
+	int spl;
+
+	/* Keep interrupts on this cpu from recording in the middle. */
+	spl = splhigh();
+	gettime(&secs, &nsecs);
+	tr = curcpu->c_trace;
+	te = &tr->tr_events[tr->tr_head % TRACE_NEVENTS];
+	tr->tr_head++;
+	te->te_time = (uint64_t)secs * 1000000000 + nsecs;
+	te->te_type = type;
+	te->te_info = info;
+	te->te_a = a;
+	te->te_b = b;
+	te->te_reserved = 0;
+	splx(spl);
+}
+
+void
+trace_start(void)
+{
+	unsigned i, numcpus;
+
+	trace_on = false;
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		cpu_get(i)->c_trace->tr_head = 0;
+	}
+	trace_on = true;
+}
+
+void
+trace_stop(void)
+{
+	trace_on = false;
+}
+
+/*
+ * Index in TR's array of the oldest of its last N events, and how
+ * many of those there actually are.
+ */
+static
+uint32_t
+trace_oldest(struct trace_ring *tr, uint32_t n, uint32_t *count)
+{
+	uint32_t have;
+
+	have = tr->tr_head < TRACE_NEVENTS ? tr->tr_head : TRACE_NEVENTS;
+	if (n > have) {
+		n = have;
+	}
+	*count = n;
+	return (tr->tr_head - n) % TRACE_NEVENTS;
+}
+
+static const char *const trace_statenames[] = {
+	"run", "ready", "sleep", "zombie",
+};
+
+static
+void
+trace_print(unsigned cpu, const struct trace_event *te, uint64_t t0)
+{
+	const char *state;
+
+	kprintf("%12llu %3u  ", te->te_time - t0, cpu);
+	switch (te->te_type) {
+	    case TRACE_SWITCH:
+		state = te->te_info < 4 ? trace_statenames[te->te_info] : "?";
+		kprintf("switch   0x%x -> 0x%x (old one %s)\n",
+			te->te_a, te->te_b, state);
+		break;
+	    case TRACE_WAKEUP:
+		kprintf("wakeup   0x%x on cpu %u\n", te->te_a, te->te_info);
+		break;
+	    case TRACE_MIGRATE:
+		kprintf("migrate  0x%x cpu %u -> %u\n", te->te_a,
+			te->te_info, te->te_b);
+		break;
+	    case TRACE_SYSCALL:
+		kprintf("syscall  %u by 0x%x\n", te->te_info, te->te_a);
+		break;
+	    case TRACE_SYSRET:
+		kprintf("sysret   %u by 0x%x: %s\n", te->te_info, te->te_a,
+			te->te_b == 0 ? "ok" : strerror(te->te_b));
+		break;
+	    case TRACE_FAULT:
+		kprintf("fault    code %u addr 0x%x epc 0x%x\n", te->te_info,
+			te->te_a, te->te_b);
+		break;
+	    case TRACE_IRQ:
+		kprintf("irq      cause 0x%x epc 0x%x\n", te->te_a, te->te_b);
+		break;
+	    case TRACE_IRQDONE:
+		kprintf("irqdone\n");
+		break;
+	    default:
+		kprintf("type %u? %u 0x%x 0x%x\n", te->te_type, te->te_info,
+			te->te_a, te->te_b);
+		break;
+	}
+}
+
+void
+trace_dump(unsigned n)
+{
+	unsigned numcpus, i, best;
+	uint32_t pos[MAXCPUS], left[MAXCPUS];
+	struct trace_ring *tr;
+	const struct trace_event *te, *bestte;
+	bool first = true;
+	uint64_t t0 = 0;
+
+	trace_stop();
+
+	numcpus = cpu_count();
+	KASSERT(numcpus <= MAXCPUS);
+	for (i=0; i<numcpus; i++) {
+		pos[i] = trace_oldest(cpu_get(i)->c_trace, n, &left[i]);
+	}
+
+	kprintf("%12s %3s  %s\n", "nsec", "cpu", "event");
+
+	/* Merge the cpus' events in time order. */
+	while (1) {
+		bestte = NULL;
+		best = 0;
+		for (i=0; i<numcpus; i++) {
+			if (left[i] == 0) {
+				continue;
+			}
+			te = &cpu_get(i)->c_trace->tr_events[pos[i]];
+			if (bestte == NULL || te->te_time < bestte->te_time) {
+				bestte = te;
+				best = i;
+			}
+		}
+		if (bestte == NULL) {
+			break;
+		}
+		if (first) {
+			t0 = bestte->te_time;
+			first = false;
+		}
+		trace_print(best, bestte, t0);
+		pos[best] = (pos[best] + 1) % TRACE_NEVENTS;
+		left[best]--;
+	}
+
+	for (i=0; i<numcpus; i++) {
+		tr = cpu_get(i)->c_trace;
+		if (tr->tr_head > TRACE_NEVENTS) {
+			kprintf("cpu %u: %u older events overwritten\n", i,
+				tr->tr_head - TRACE_NEVENTS);
+		}
+	}
+}
+
+/*
+ * Write LEN bytes from BUF to VN at *POS, and advance *POS.
+ */
+static
+int
+trace_write(struct vnode *vn, void *buf, size_t len, off_t *pos)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, *pos, UIO_WRITE);
+	result = VOP_WRITE(vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid > 0) {
+		return ENOSPC;
+	}
+	*pos += len;
+	return 0;
+}
+
+int
+trace_save(const char *path)
+{
+	struct trace_filehdr th;
+	struct trace_cpuhdr tc;
+	struct trace_ring *tr;
+	struct vnode *vn;
+	char *pathcopy;
+	unsigned i, numcpus;
+	uint32_t start, count, chunk;
+	off_t pos;
+	int result;
+
+	trace_stop();
+
+	/* vfs_open may scribble on the name. */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(pathcopy, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	kfree(pathcopy);
+	if (result) {
+		return result;
+	}
+
+	numcpus = cpu_count();
+	th.th_magic = TRACE_MAGIC;
+	th.th_version = TRACE_VERSION;
+	th.th_ncpus = numcpus;
+	th.th_reserved = 0;
+	pos = 0;
+	result = trace_write(vn, &th, sizeof(th), &pos);
+
+	for (i=0; i<numcpus && result == 0; i++) {
+		tr = cpu_get(i)->c_trace;
+		start = trace_oldest(tr, TRACE_NEVENTS, &count);
+		tc.tc_cpu = i;
+		tc.tc_nevents = count;
+		tc.tc_lost = tr->tr_head - count;
+		tc.tc_reserved = 0;
+		result = trace_write(vn, &tc, sizeof(tc), &pos);
+		if (result) {
+			break;
+		}
+
+		/* Up to the end of the array, then any that wrapped. */
+		chunk = count < TRACE_NEVENTS - start ?
+			count : TRACE_NEVENTS - start;
+		result = trace_write(vn, &tr->tr_events[start],
+				     chunk * sizeof(struct trace_event), &pos);
+		if (result == 0 && chunk < count) {
+			result = trace_write(vn, &tr->tr_events[0],
+				(count - chunk) * sizeof(struct trace_event),
+				&pos);
+		}
+	}
+
+	vfs_close(vn);
+	return result;
+}
+
+#else /* !OPT_TRACE */
+
+void
+trace_cpu_init(struct cpu *c)
+{
+	c->c_trace = NULL;
+}
+
+void
+trace_start(void)
+{
+	kprintf("tr: event tracing not compiled in (options trace)\n");
+}
+
+void
+trace_stop(void)
+{
+	kprintf("tr: event tracing not compiled in (options trace)\n");
+}
+
+void
+trace_dump(unsigned n)
+{
+	(void)n;
+	kprintf("tr: event tracing not compiled in (options trace)\n");
+}
+
+int
+trace_save(const char *path)
+{
+	(void)path;
+	kprintf("tr: event tracing not compiled in (options trace)\n");
+	return 0;
+}
+
+#endif /* OPT_TRACE */
@@ -0,0 +1,366 @@
+/*
+ * Deferred work.
+ *
+ * The specification of the interface is in workqueue.h.
+ *
+ * Each cpu has a struct worker: a FIFO list of work items and a
+ * thread, bound to that cpu, that takes them off one at a time and
+ * runs them. Unordered queues put items straight on the submitting
+ * cpu's list. Ordered queues keep their own list, and put a single
+ * "runner" item on a worker's list; the runner runs one item and, if
+ * there are more, queues itself again at the back. So at most one of
+ * an ordered queue's items is running at a time, and a long ordered
+ * queue takes turns with everything else on that cpu instead of
+ * hogging it.
+ *
+ * Locking: a worker's list is protected by ww_lock, and a queue's
+ * counts, pending flags (wk_wq) and ordered list by wq_lock. Neither
+ * lock is ever held while taking the other.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <workqueue.h>
+
+/*
+ * Workers run a little ahead of ordinary threads, so work deferred
+ * from interrupt handlers doesn't wait behind compute-bound threads.
+ */
+#define WORKER_PRIORITY		(PRI_DEFAULT - 1)
+
+struct worker {
+	struct spinlock ww_lock;
+	struct work *ww_head;		/* next item to run */
+	struct work **ww_tailp;		/* where to link the next one */
+	struct wchan *ww_wchan;		/* worker sleeps here when idle */
+};
+
+struct workqueue {
+	char *wq_name;
+	bool wq_ordered;
+	struct spinlock wq_lock;
+	unsigned wq_pending;		/* submitted and not finished */
+	struct wchan *wq_flushwchan;	/* workqueue_flush waits here */
+
+	/* Ordered queues only. */
+	struct work *wq_head;		/* items not yet started */
+	struct work **wq_tailp;
+	bool wq_active;			/* runner queued or running */
+	struct work wq_runner;
+};
+
+struct workqueue *workqueue_system;
+
+////////////////////////////////////////////////////////////
+//
+// Workers
+
+void
+workqueue_cpu_init(struct cpu *c)
+{
+	struct worker *ww;
+
+	ww = kmalloc(sizeof(*ww));
+	if (ww == NULL) {
+		panic("workqueue_cpu_init: Out of memory\n");
+	}
+	spinlock_init(&ww->ww_lock);
+	spinlock_setname(&ww->ww_lock, "worker");
+	ww->ww_head = NULL;
+	ww->ww_tailp = &ww->ww_head;
+	ww->ww_wchan = wchan_create("worker");
+	if (ww->ww_wchan == NULL) {
+		panic("workqueue_cpu_init: Out of memory\n");
+	}
+	c->c_worker = ww;
+}
+
+/*
+ * Put W at the back of WW's list, and wake the worker if it might be
+ * asleep.
+ */
+static
+void
+worker_add(struct worker *ww, struct work *w)
+{
+	bool wasempty;
+
+	w->wk_next = NULL;
+	spinlock_acquire(&ww->ww_lock);
+	wasempty = ww->ww_head == NULL;
+	*ww->ww_tailp = w;
+	ww->ww_tailp = &w->wk_next;
+	spinlock_release(&ww->ww_lock);
+
+	if (wasempty) {
+		wchan_wakeone(ww->ww_wchan);
+	}
+}
+
+static
+struct work *
+worker_get(struct worker *ww)
+{
+	struct work *w;
+
+	spinlock_acquire(&ww->ww_lock);
+	while (ww->ww_head == NULL) {
+		/* Bridge to the wchan lock, as in P(). */
+		wchan_lock(ww->ww_wchan);
+		spinlock_release(&ww->ww_lock);
+		wchan_sleep(ww->ww_wchan);
+		spinlock_acquire(&ww->ww_lock);
+	}
+	w = ww->ww_head;
+	ww->ww_head = w->wk_next;
+	if (ww->ww_head == NULL) {
+		ww->ww_tailp = &ww->ww_head;
+	}
+	spinlock_release(&ww->ww_lock);
+
+	return w;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Running work
+
+/*
+ * Mark W not pending and call its function. Afterwards W may be gone.
+ */
+static
+void
+work_run(struct workqueue *wq, struct work *w)
+{
+	void (*func)(void *);
+	void *data;
+
+	func = w->wk_func;
+	data = w->wk_data;
+
+	spinlock_acquire(&wq->wq_lock);
+	KASSERT(w->wk_wq == wq);
+	w->wk_wq = NULL;
+	spinlock_release(&wq->wq_lock);
+
+	func(data);
+}
+
+/*
+ * Account for one of WQ's items finishing. Returns true if an ordered
+ * queue has more to run.
+ */
+static
+bool
+workqueue_done(struct workqueue *wq)
+{
+	bool more;
+
+	spinlock_acquire(&wq->wq_lock);
+	KASSERT(wq->wq_pending > 0);
+	wq->wq_pending--;
+	if (wq->wq_pending == 0) {
+		wchan_wakeall(wq->wq_flushwchan);
+	}
+	more = wq->wq_head != NULL;
+	if (wq->wq_ordered && !more) {
+		wq->wq_active = false;
+	}
+	spinlock_release(&wq->wq_lock);
+
+	return more;
+}
+
+/*
+ * The runner for an ordered queue. Run the first item, and if there
+ * are more, go to the back of the line on this cpu.
+ */
+static
+void
+workqueue_runordered(void *data)
+{
+	struct workqueue *wq = data;
+	struct work *w;
+
+	spinlock_acquire(&wq->wq_lock);
+	w = wq->wq_head;
+	KASSERT(w != NULL);
+	wq->wq_head = w->wk_next;
+	if (wq->wq_head == NULL) {
+		wq->wq_tailp = &wq->wq_head;
+	}
+	spinlock_release(&wq->wq_lock);
+
+	work_run(wq, w);
+
+	if (workqueue_done(wq)) {
+		worker_add(curcpu->c_worker, &wq->wq_runner);
+	}
+}
+
+static
+void
+worker_thread(void *vww, unsigned long junk)
+{
+	struct worker *ww = vww;
+	struct workqueue *wq;
+	struct work *w;
+
+	(void)junk;
+
+	thread_setpriority(WORKER_PRIORITY);
+	while (1) {
+		w = worker_get(ww);
+		wq = w->wk_wq;
+		if (wq == NULL) {
+			/* An ordered queue's runner. */
+			w->wk_func(w->wk_data);
+		}
+		else {
+			work_run(wq, w);
+			workqueue_done(wq);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+work_init(struct work *w, void (*func)(void *), void *data)
+{
+	w->wk_next = NULL;
+	w->wk_func = func;
+	w->wk_data = data;
+	w->wk_wq = NULL;
+}
+
+struct workqueue *
+workqueue_create(const char *name, bool ordered)
+{
+	struct workqueue *wq;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_name = kstrdup(name);
+	if (wq->wq_name == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_flushwchan = wchan_create(wq->wq_name);
+	if (wq->wq_flushwchan == NULL) {
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+	spinlock_init(&wq->wq_lock);
+	spinlock_setname(&wq->wq_lock, "workqueue");
+	wq->wq_ordered = ordered;
+	wq->wq_pending = 0;
+	wq->wq_head = NULL;
+	wq->wq_tailp = &wq->wq_head;
+	wq->wq_active = false;
+	work_init(&wq->wq_runner, workqueue_runordered, wq);
+
+	return wq;
+}
+
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	workqueue_flush(wq);
+
+	KASSERT(wq->wq_head == NULL);
+	KASSERT(!wq->wq_active);
+	spinlock_cleanup(&wq->wq_lock);
+	wchan_destroy(wq->wq_flushwchan);
+	kfree(wq->wq_name);
+	kfree(wq);
+}
+
+bool
+workqueue_submit(struct workqueue *wq, struct work *w)
+{
+	bool startrunner = false;
+
+	KASSERT(CURCPU_EXISTS());
+
+	spinlock_acquire(&wq->wq_lock);
+	if (w->wk_wq != NULL) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	w->wk_wq = wq;
+	wq->wq_pending++;
+	if (wq->wq_ordered) {
+		w->wk_next = NULL;
+		*wq->wq_tailp = w;
+		wq->wq_tailp = &w->wk_next;
+		if (!wq->wq_active) {
+			wq->wq_active = true;
+			startrunner = true;
+		}
+	}
+	spinlock_release(&wq->wq_lock);
+
+	if (!wq->wq_ordered) {
+		worker_add(curcpu->c_worker, w);
+	}
+	else if (startrunner) {
+		worker_add(curcpu->c_worker, &wq->wq_runner);
+	}
+	return true;
+}
+
+void
+workqueue_flush(struct workqueue *wq)
+{
+	KASSERT(!curthread->t_in_interrupt);
+
+	spinlock_acquire(&wq->wq_lock);
+	while (wq->wq_pending > 0) {
+		wchan_lock(wq->wq_flushwchan);
+		spinlock_release(&wq->wq_lock);
+		wchan_sleep(wq->wq_flushwchan);
+		spinlock_acquire(&wq->wq_lock);
+	}
+	spinlock_release(&wq->wq_lock);
+}
+
+/*
+ * Start a worker on every cpu, and make the system queue.
+ */
+void
+workqueue_bootstrap(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+	char name[16];
+	int result;
+
+	workqueue_system = workqueue_create("system", false);
+	if (workqueue_system == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		c = cpu_get(i);
+		snprintf(name, sizeof(name), "worker %u", i);
+		result = thread_fork_bound(name, kproc, c, worker_thread,
+					   c->c_worker, 0);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork_bound: %s\n",
+			      strerror(result));
+		}
+	}
+}
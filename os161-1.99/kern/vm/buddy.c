@@ -0,0 +1,267 @@
+/*
+ * Binary buddy allocator for physical pages.
+ *
+ * The specification of the interface is in buddy.h.
+ *
+ * Pages are numbered from buddy_base. For each one there's a byte in
+ * buddy_pageinfo saying whether it heads a free block, heads an
+ * allocated block, or is in the middle of some block; a head also
+ * records the block's order. The buddy of the block of order K at
+ * page I is the one at page I ^ (1<<K).
+ *
+ * Free blocks of each order are kept on a circular doubly-linked
+ * list whose links live in the first words of the free memory
+ * itself, so no other storage is needed for them. All state is
+ * protected by buddy_lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <buddy.h>
+
+#define BUDDY_NORDERS	(BUDDY_MAXORDER + 1)
+
+/* Bits in buddy_pageinfo[] */
+#define BP_ORDER	0x1f	/* order of the block this page heads */
+#define BP_FREE		0x40	/* page heads a free block */
+#define BP_ALLOC	0x80	/* page heads an allocated block */
+
+struct buddy_block {
+	struct buddy_block *bb_next;
+	struct buddy_block *bb_prev;
+};
+
+static struct spinlock buddy_lock = SPINLOCK_INITIALIZER;
+
+static paddr_t buddy_base;		/* physical address of page 0 */
+static unsigned buddy_npages;		/* number of pages managed */
+static uint8_t *buddy_pageinfo;		/* one byte per page */
+
+/* Free lists, one per order; the heads are sentinels */
+static struct buddy_block buddy_freelist[BUDDY_NORDERS];
+static unsigned buddy_nfree[BUDDY_NORDERS];
+
+/* Statistics; protected by buddy_lock. */
+static struct {
+	unsigned allocs;
+	unsigned frees;
+	unsigned splits;
+	unsigned merges;
+	unsigned failures;
+	unsigned freepages;
+} buddy_stats;
+
+/* Convert between page numbers and the blocks they head. */
+#define PAGE_TO_BLOCK(i) \
+	((struct buddy_block *)PADDR_TO_KVADDR(buddy_base + (i) * PAGE_SIZE))
+#define BLOCK_TO_PAGE(bb) \
+	((((vaddr_t)(bb) - MIPS_KSEG0) - buddy_base) / PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+static
+void
+buddy_addfree(unsigned page, unsigned order)
+{
+	struct buddy_block *bb, *head;
+
+	KASSERT(spinlock_do_i_hold(&buddy_lock));
+	KASSERT(order <= BUDDY_MAXORDER);
+	KASSERT(page + (1U << order) <= buddy_npages);
+	KASSERT((page & ((1U << order) - 1)) == 0);
+
+	head = &buddy_freelist[order];
+	bb = PAGE_TO_BLOCK(page);
+	bb->bb_next = head->bb_next;
+	bb->bb_prev = head;
+	head->bb_next->bb_prev = bb;
+	head->bb_next = bb;
+
+	buddy_pageinfo[page] = BP_FREE | order;
+	buddy_nfree[order]++;
+	buddy_stats.freepages += 1U << order;
+}
+
+static
+void
+buddy_remfree(unsigned page, unsigned order)
+{
+	struct buddy_block *bb;
+
+	KASSERT(buddy_pageinfo[page] == (BP_FREE | order));
+	KASSERT(buddy_nfree[order] > 0);
+
+	bb = PAGE_TO_BLOCK(page);
+	bb->bb_prev->bb_next = bb->bb_next;
+	bb->bb_next->bb_prev = bb->bb_prev;
+
+	buddy_pageinfo[page] = 0;
+	buddy_nfree[order]--;
+	buddy_stats.freepages -= 1U << order;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+buddy_bootstrap(paddr_t lo, paddr_t hi)
+{
+	unsigned npages, metapages, i, order;
+
+	lo = ROUNDUP(lo, PAGE_SIZE);
+	hi &= PAGE_FRAME;
+	KASSERT(lo < hi);
+	npages = (hi - lo) / PAGE_SIZE;
+
+	/* Take the page info table off the front. */
+	metapages = DIVROUNDUP(npages, PAGE_SIZE);
+	KASSERT(metapages < npages);
+	buddy_pageinfo = (uint8_t *)PADDR_TO_KVADDR(lo);
+	lo += metapages * PAGE_SIZE;
+	npages -= metapages;
+
+	spinlock_acquire(&buddy_lock);
+
+	buddy_base = lo;
+	buddy_npages = npages;
+	for (i=0; i<npages; i++) {
+		buddy_pageinfo[i] = 0;
+	}
+	for (order=0; order<BUDDY_NORDERS; order++) {
+		buddy_freelist[order].bb_next = &buddy_freelist[order];
+		buddy_freelist[order].bb_prev = &buddy_freelist[order];
+		buddy_nfree[order] = 0;
+	}
+
+	/* Carve the memory into the biggest aligned blocks that fit. */
+	i = 0;
+	while (i < npages) {
+		order = BUDDY_MAXORDER;
+		while (order > 0 && ((i & ((1U << order) - 1)) != 0 ||
+				     i + (1U << order) > npages)) {
+			order--;
+		}
+		buddy_addfree(i, order);
+		i += 1U << order;
+	}
+
+	spinlock_release(&buddy_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Alloc and free
+
+paddr_t
+buddy_alloc(unsigned long npages)
+{
+	unsigned order, k, page;
+
+	KASSERT(npages > 0);
+
+	for (order = 0; (1UL << order) < npages; order++) {
+		if (order == BUDDY_MAXORDER) {
+			/* too big to ever satisfy */
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&buddy_lock);
+
+	for (k = order; k <= BUDDY_MAXORDER && buddy_nfree[k] == 0; k++) {
+		/* nothing */
+	}
+	if (k > BUDDY_MAXORDER) {
+		buddy_stats.failures++;
+		spinlock_release(&buddy_lock);
+		return 0;
+	}
+
+	page = BLOCK_TO_PAGE(buddy_freelist[k].bb_next);
+	buddy_remfree(page, k);
+
+	/* Split it down to size, keeping the front half each time. */
+	while (k > order) {
+		k--;
+		buddy_addfree(page + (1U << k), k);
+		buddy_stats.splits++;
+	}
+
+	buddy_pageinfo[page] = BP_ALLOC | order;
+	buddy_stats.allocs++;
+
+	spinlock_release(&buddy_lock);
+
+	return buddy_base + page * PAGE_SIZE;
+}
+
+void
+buddy_free(paddr_t pa)
+{
+	unsigned page, order, buddy;
+
+	if (pa < buddy_base || pa >= buddy_base + buddy_npages * PAGE_SIZE) {
+		/* Not ours; probably allocated before we were set up. */
+		return;
+	}
+	KASSERT((pa & PAGE_FRAME) == pa);
+	page = (pa - buddy_base) / PAGE_SIZE;
+
+	spinlock_acquire(&buddy_lock);
+
+	if ((buddy_pageinfo[page] & BP_ALLOC) == 0) {
+		panic("buddy_free: 0x%x is not an allocated block\n", pa);
+	}
+	order = buddy_pageinfo[page] & BP_ORDER;
+	buddy_pageinfo[page] = 0;
+	buddy_stats.frees++;
+
+	/* Merge with our buddy for as long as it's free. */
+	while (order < BUDDY_MAXORDER) {
+		buddy = page ^ (1U << order);
+		if (buddy >= buddy_npages ||
+		    buddy_pageinfo[buddy] != (BP_FREE | order)) {
+			break;
+		}
+		buddy_remfree(buddy, order);
+		buddy_stats.merges++;
+		if (buddy < page) {
+			page = buddy;
+		}
+		order++;
+	}
+	buddy_addfree(page, order);
+
+	spinlock_release(&buddy_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+void
+buddy_printstats(void)
+{
+	unsigned order;
+
+	spinlock_acquire(&buddy_lock);
+
+	kprintf("Buddy allocator: %u of %u pages free\n",
+		buddy_stats.freepages, buddy_npages);
+	kprintf("    order  pages   free blocks\n");
+	for (order=0; order<BUDDY_NORDERS; order++) {
+		kprintf("    %5u  %5u   %u\n", order, 1U << order,
+			buddy_nfree[order]);
+	}
+	kprintf("    %u allocs, %u frees, %u splits, %u merges, "
+		"%u failures\n", buddy_stats.allocs, buddy_stats.frees,
+		buddy_stats.splits, buddy_stats.merges,
+		buddy_stats.failures);
+
+	spinlock_release(&buddy_lock);
+}
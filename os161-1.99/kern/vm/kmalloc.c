@@ -28,9 +28,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <cpu.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <current.h>
 #include <vm.h>
+#include <mainbus.h>
+#include "opt-khprof.h"
+#include "opt-kmfrag.h"
 
 /*
  * Kernel malloc.
@@ -83,8 +90,17 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * The classes between the powers of two are there because lots of
+ * common kernel objects (threads, procs, vnodes, names) land just
+ * past a power of two and would otherwise waste close to half their
+ * block. Build with "options kmfrag" to see how well a workload fits
+ * the classes.
+ */
+#define NSIZES 13
+static const size_t sizes[NSIZES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -118,47 +134,79 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Use one spinlock for the whole shared pool. Most kmalloc and kfree
+ * calls don't get this far; they're satisfied from the per-cpu
+ * magazines (see below) and only come here in batches. Those batches
+ * tend to arrive from all cpus at once, so it's a queued lock.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER_QUEUED;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs are allocated out of whole pages obtained from
+ * alloc_kpages, since this can't recursively use the subpage
+ * allocator. Each such page carries a small header with a bitmap of
+ * which of its pagerefs are in use, and the pages are chained
+ * together. When they're all full we get another one, so the amount
+ * of heap that can be managed grows with the amount of RAM.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Because these pages come from alloc_kpages they're page-aligned,
+ * and the page a pageref lives on can be found by masking its
+ * address.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define NPAGEREFS   253	/* as many as fit in one page; see below */
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS, 32)
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nfree;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
+
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;
+
+/*
+ * Reverse map from heap page to pageref, so kfree can find the
+ * pageref for a pointer in constant time. It's indexed by physical
+ * page number and covers all of RAM; entries for pages that aren't
+ * subpage allocator pages are NULL.
+ */
+static struct pageref **pagereftable;
+static unsigned pagereftable_size;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+#define PAGEREF_INDEX(vaddr)  (((vaddr) - MIPS_KSEG0) / PAGE_SIZE)
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct pagerefpage *prp;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nfree == 0) {
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (prp->inuse[i]==0xffffffff) {
+				/* full */
+				continue;
+			}
+			for (k=1,j=0; k!=0 && i*32+j < NPAGEREFS; k<<=1,j++) {
+				if ((prp->inuse[i] & k)==0) {
+					prp->inuse[i] |= k;
+					prp->nfree--;
+					return &prp->refs[i*32 + j];
+				}
 			}
 		}
+		/* nfree said there was one */
 		KASSERT(0);
 	}
 
@@ -170,32 +218,117 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
+	prp = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	j = p - prp->refs;
 	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nfree++;
 }
 
-////////////////////////////////////////
+/*
+ * Add a page of fresh pagerefs. Must be called with the kmalloc
+ * spinlock held; PAGEADDR is a page from alloc_kpages.
+ */
+static
+void
+addpagerefpage(vaddr_t pageaddr)
+{
+	struct pagerefpage *prp;
+	unsigned i;
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
-////////////////////////////////////////
+	prp = (struct pagerefpage *)pageaddr;
+	for (i=0; i<INUSE_WORDS; i++) {
+		prp->inuse[i] = 0;
+	}
+	prp->nfree = NPAGEREFS;
+	prp->next = pagerefpages;
+	pagerefpages = prp;
+	npagerefpages++;
+}
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Get a pageref, adding another page of them if necessary. Called
+ * with the kmalloc spinlock held; drops it around alloc_kpages.
  */
+static
+struct pageref *
+getpageref(void)
+{
+	struct pageref *pr;
+	vaddr_t newpage;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	while ((pr = allocpageref()) == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		newpage = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (newpage == 0) {
+			return NULL;
+		}
+		addpagerefpage(newpage);
+	}
+	return pr;
+}
+
+/*
+ * Set up pagereftable if it hasn't been yet. This is done on first
+ * use rather than at bootstrap so kmalloc works as soon as there's
+ * RAM to allocate. Called without the kmalloc spinlock.
+ */
+static
+int
+pagereftable_setup(void)
+{
+	unsigned size, npages, i;
+	vaddr_t table;
+	bool lost;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	lost = (pagereftable != NULL);
+	spinlock_release(&kmalloc_spinlock);
+	if (lost) {
+		return 0;
+	}
+
+	size = mainbus_ramsize() / PAGE_SIZE;
+	npages = DIVROUNDUP(size * sizeof(struct pageref *), PAGE_SIZE);
+	table = alloc_kpages(npages);
+	if (table == 0) {
+		return ENOMEM;
+	}
+	for (i=0; i<size; i++) {
+		((struct pageref **)table)[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	lost = (pagereftable != NULL);
+	if (!lost) {
+		pagereftable = (struct pageref **)table;
+		pagereftable_size = size;
+	}
+	spinlock_release(&kmalloc_spinlock);
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	if (lost) {
+		/* Someone else got there first. */
+		free_kpages(table);
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
 
 ////////////////////////////////////////
 
@@ -260,14 +393,15 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefpages * NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefpages * NPAGEREFS);
+		KASSERT(pagereftable[PAGEREF_INDEX(PR_PAGEADDR(pr))] == pr);
 		ac++;
 	}
 
@@ -330,6 +464,17 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_KHPROF
+static void khprof_printsites(void);	/* below */
+#else
+#define khprof_printsites()
+#endif
+#if OPT_KMFRAG
+static void kmfrag_print(void);		/* below */
+#else
+#define kmfrag_print()
+#endif
+
 void
 kheap_printstats(void)
 {
@@ -345,6 +490,9 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	khprof_printsites();
+	kmfrag_print();
 }
 
 ////////////////////////////////////////
@@ -392,64 +540,88 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off PR's freelist. Called with the kmalloc spinlock
+ * held; PR must have at least one free block.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-	spinlock_acquire(&kmalloc_spinlock);
+	return retptr;
+}
 
-	checksubpages();
+/*
+ * Allocate up to N blocks of size class BLKTYPE from the shared pool
+ * into BLOCKS, taking kmalloc_spinlock once. Returns the number of
+ * blocks actually allocated, which is 0 only if we're out of memory.
+ */
+static
+unsigned
+subpage_kmalloc_batch(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	unsigned got;		// number of blocks allocated so far
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	volatile int i;
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	KASSERT(blktype < NSIZES);
 
-		if (pr->nfree > 0) {
+	spinlock_acquire(&kmalloc_spinlock);
 
-		doalloc: /* comes here after getting a whole fresh page */
+	checksubpages();
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	got = 0;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+ again: /* comes here after getting a whole fresh page */
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
-			checksubpages();
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_takeblock(pr);
 		}
 	}
 
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -460,21 +632,25 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+	if (pagereftable_setup()) {
+		kprintf("kmalloc: Subpage allocator couldn't get page table\n");
+		return 0;
+	}
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
+	pr = getpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,59 +680,59 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	KASSERT(PAGEREF_INDEX(prpage) < pagereftable_size);
+	KASSERT(pagereftable[PAGEREF_INDEX(prpage)] == NULL);
+	pagereftable[PAGEREF_INDEX(prpage)] = pr;
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	goto again;
 }
 
+/*
+ * Find the pageref for the page PTRADDR is on, or NULL if it's not a
+ * subpage allocator page.
+ *
+ * This doesn't need kmalloc_spinlock when PTRADDR is a live block:
+ * the table entry for a page is only changed when the page is made
+ * or when its last block is freed, and neither can happen while
+ * someone holds a block on it.
+ */
 static
-int
-subpage_kfree(void *ptr)
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	if (pagereftable == NULL || ptraddr < MIPS_KSEG0 ||
+	    PAGEREF_INDEX(ptraddr) >= pagereftable_size) {
+		return NULL;
+	}
+	return pagereftable[PAGEREF_INDEX(ptraddr)];
+}
+
+/*
+ * Put the block PTR back on PR's freelist. Called with the kmalloc
+ * spinlock held. If that makes the whole page free, the page is taken
+ * off the lists and its address returned so the caller can give it
+ * back to the VM system; otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, void *ptr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
-	}
-
-	offset = ptraddr - prpage;
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
+	/* check for corruption */
+	KASSERT(prpage == ((vaddr_t)ptr & PAGE_FRAME));
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	offset = (vaddr_t)ptr - prpage;
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
@@ -577,13 +753,53 @@ subpage_kfree(void *ptr)
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
+		pagereftable[PAGEREF_INDEX(prpage)] = NULL;
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		return prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+/*
+ * Return N blocks to the shared pool, taking kmalloc_spinlock once.
+ * The blocks may be of any size class.
+ */
+static
+void
+subpage_kfree_batch(void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	vaddr_t page, freepages;
+	unsigned i;
+
+	/*
+	 * Pages that become completely free are chained together
+	 * through their first word and handed back to free_kpages
+	 * after we drop the spinlock.
+	 */
+	freepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		pr = subpage_lookup((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL);
+		page = subpage_putblock(pr, blocks[i]);
+		if (page != 0) {
+			*(vaddr_t *)page = freepages;
+			freepages = page;
+		}
+	}
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+
+	while (freepages != 0) {
+		page = freepages;
+		freepages = *(vaddr_t *)page;
+		free_kpages(page);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -591,16 +807,668 @@ subpage_kfree(void *ptr)
 	checksubpages();
 	spinlock_release(&kmalloc_spinlock);
 #endif
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a small stack ("magazine")
+//    of free blocks. kmalloc and kfree use the current cpu's
+//    magazine with interrupts off, which is enough to keep anyone
+//    else from touching it, and only go to the shared pool under
+//    kmalloc_spinlock when the magazine is empty or full. Then
+//    KM_BATCH blocks are moved at once.
+//
+//    As far as the shared pool is concerned, blocks sitting in a
+//    magazine are allocated. So kheap_printstats shows them as in
+//    use, and a page stays out of the VM system while any of its
+//    blocks are cached.
+//
+
+#define KM_MAGSIZE  32		/* blocks per magazine */
+#define KM_BATCH    (KM_MAGSIZE/2)	/* blocks moved to/from the pool */
+
+struct kmalloc_magazine {
+	unsigned km_nrounds;
+	void *km_rounds[KM_MAGSIZE];
+};
+
+struct kmalloc_cpu {
+	struct kmalloc_magazine kc_mags[NSIZES];
+};
+
+/*
+ * Set up the magazines for a new cpu. If we can't, the cpu just uses
+ * the shared pool directly.
+ */
+void
+kmalloc_cpu_init(struct cpu *c)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc != NULL) {
+		for (i=0; i<NSIZES; i++) {
+			kc->kc_mags[i].km_nrounds = 0;
+		}
+	}
+	c->c_kmalloc = kc;
+}
+
+/*
+ * Get the current cpu's magazines, or NULL if there aren't any. The
+ * caller must have raised the spl.
+ */
+static
+struct kmalloc_cpu *
+kmalloc_mycpu(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	return curcpu->c_kmalloc;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmalloc_cpu *kc;
+	struct kmalloc_magazine *mag;
+	void *batch[KM_BATCH];	// blocks from the shared pool
+	unsigned i, n;
+	void *retptr;
 
+	blktype = blocktype(sz);
+
+	/* Like spinlock_acquire, but without the spinlock. */
+	splraise(IPL_NONE, IPL_HIGH);
+
+	kc = kmalloc_mycpu();
+	if (kc == NULL) {
+		if (subpage_kmalloc_batch(blktype, &retptr, 1) == 0) {
+			retptr = NULL;
+		}
+		spllower(IPL_HIGH, IPL_NONE);
+		return retptr;
+	}
+
+	mag = &kc->kc_mags[blktype];
+	if (mag->km_nrounds == 0) {
+		/*
+		 * Refill through a local array. Getting a page can
+		 * end up calling kfree (the page cache gives memory
+		 * back when the page allocator runs short), which may
+		 * put blocks into this magazine behind our back.
+		 */
+		n = subpage_kmalloc_batch(blktype, batch, KM_BATCH);
+		if (n == 0) {
+			spllower(IPL_HIGH, IPL_NONE);
+			return NULL;
+		}
+		for (i=1; i<n && mag->km_nrounds < KM_MAGSIZE; i++) {
+			mag->km_rounds[mag->km_nrounds++] = batch[i];
+		}
+		if (i < n) {
+			subpage_kfree_batch(&batch[i], n - i);
+		}
+		spllower(IPL_HIGH, IPL_NONE);
+		return batch[0];
+	}
+	retptr = mag->km_rounds[--mag->km_nrounds];
+
+	spllower(IPL_HIGH, IPL_NONE);
+	return retptr;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	struct kmalloc_cpu *kc;
+	struct kmalloc_magazine *mag;
+
+	ptraddr = (vaddr_t)ptr;
+
+	pr = subpage_lookup(ptraddr);
+	if (pr==NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	/* Check for proper positioning and alignment */
+	if ((ptraddr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	kc = kmalloc_mycpu();
+	if (kc == NULL) {
+		subpage_kfree_batch(&ptr, 1);
+		spllower(IPL_HIGH, IPL_NONE);
+		return 0;
+	}
+
+	mag = &kc->kc_mags[blktype];
+	if (mag->km_nrounds == KM_MAGSIZE) {
+		/*
+		 * Full. Give back the oldest half, keeping the ones
+		 * freed most recently since they're likely still in
+		 * this cpu's cache.
+		 */
+		subpage_kfree_batch(mag->km_rounds, KM_BATCH);
+		memmove(mag->km_rounds, mag->km_rounds + KM_BATCH,
+			(KM_MAGSIZE - KM_BATCH) * sizeof(mag->km_rounds[0]));
+		mag->km_nrounds -= KM_BATCH;
+	}
+	mag->km_rounds[mag->km_nrounds++] = ptr;
+
+	spllower(IPL_HIGH, IPL_NONE);
 	return 0;
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-callsite heap profiling.
+//
+//    Compiled in with "options khprof". Every kmalloc is charged to
+//    its caller (the return address in kmalloc) and the block size it
+//    actually used; kfree looks the block up again and credits the
+//    same site. "kh" then lists the sites sorted by live bytes, and
+//    "kh snap" / "kh diff" show which sites grew or shrank in
+//    between, which is usually enough to find a leak.
+//
+//    Live blocks are remembered in a fixed-size hash table, since we
+//    can't call kmalloc from in here. If it fills up, further blocks
+//    aren't tracked (and are counted as such). Sites that don't fit
+//    in the site table are lumped together under address 0.
+//
+//    When the option is off none of this is compiled and kmalloc and
+//    kfree are unchanged.
+//
+
+#if OPT_KHPROF
+
+#define KHPROF_MAXSITES  256	/* distinct (caller, size) pairs */
+#define KHPROF_MAXLIVE   8192	/* live blocks we can track */
+#define KHPROF_HASHSIZE  1021
+
+struct khprof_site {
+	vaddr_t ks_caller;		/* return address in caller */
+	size_t ks_blksize;		/* block size actually used */
+	unsigned ks_allocs;		/* total allocations */
+	unsigned ks_frees;		/* total frees */
+	unsigned ks_liveblocks;		/* blocks allocated now */
+	size_t ks_livebytes;		/* bytes allocated now */
+	size_t ks_peakbytes;		/* high-water mark of ks_livebytes */
+	size_t ks_snapbytes;		/* ks_livebytes at last snapshot */
+	unsigned ks_snapblocks;		/* ks_liveblocks at last snapshot */
+};
+
+struct khprof_live {
+	vaddr_t kl_addr;
+	uint16_t kl_site;		/* index into khprof_sites */
+	int16_t kl_next;		/* hash chain or free list; -1 ends */
+};
+
+static struct spinlock khprof_lock = SPINLOCK_INITIALIZER;
+static struct khprof_site khprof_sites[KHPROF_MAXSITES];
+static unsigned khprof_nsites;
+static struct khprof_live khprof_live[KHPROF_MAXLIVE];
+static int16_t khprof_hash[KHPROF_HASHSIZE];
+static int16_t khprof_freelive;
+static bool khprof_ready;
+static unsigned khprof_untracked;	/* blocks we had no room for */
+static bool khprof_snapped;
+
+/* Scratch space for sorting; protected by khprof_lock. */
+static uint16_t khprof_order[KHPROF_MAXSITES];
+
+#define KHPROF_HASH(addr) (((addr) / SMALLEST_SUBPAGE_SIZE) % KHPROF_HASHSIZE)
+
+static
+void
+khprof_init(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&khprof_lock));
+	COMPILE_ASSERT(KHPROF_MAXLIVE <= 32767);
+
+	for (i=0; i<KHPROF_HASHSIZE; i++) {
+		khprof_hash[i] = -1;
+	}
+	for (i=0; i<KHPROF_MAXLIVE; i++) {
+		khprof_live[i].kl_next = (i+1 < KHPROF_MAXLIVE) ? (int)(i+1) : -1;
+	}
+	khprof_freelive = 0;
+
+	/* Site 0 is the overflow bucket. */
+	khprof_sites[0].ks_caller = 0;
+	khprof_sites[0].ks_blksize = 0;
+	khprof_nsites = 1;
+
+	khprof_ready = true;
+}
+
+static
+unsigned
+khprof_findsite(vaddr_t caller, size_t blksize)
+{
+	unsigned i;
+
+	for (i=1; i<khprof_nsites; i++) {
+		if (khprof_sites[i].ks_caller == caller &&
+		    khprof_sites[i].ks_blksize == blksize) {
+			return i;
+		}
+	}
+	if (khprof_nsites == KHPROF_MAXSITES) {
+		return 0;
+	}
+	khprof_sites[i].ks_caller = caller;
+	khprof_sites[i].ks_blksize = blksize;
+	khprof_nsites++;
+	return i;
+}
+
+/*
+ * Record that CALLER got a block of BLKSIZE bytes at PTR.
+ */
+static
+void
+khprof_alloc(void *ptr, size_t blksize, vaddr_t caller)
+{
+	struct khprof_site *ks;
+	unsigned site, h;
+	int16_t ix;
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_ready) {
+		khprof_init();
+	}
+
+	site = khprof_findsite(caller, blksize);
+	ks = &khprof_sites[site];
+	ks->ks_allocs++;
+
+	ix = khprof_freelive;
+	if (ix < 0) {
+		khprof_untracked++;
+		spinlock_release(&khprof_lock);
+		return;
+	}
+	khprof_freelive = khprof_live[ix].kl_next;
+
+	h = KHPROF_HASH((vaddr_t)ptr);
+	khprof_live[ix].kl_addr = (vaddr_t)ptr;
+	khprof_live[ix].kl_site = site;
+	khprof_live[ix].kl_next = khprof_hash[h];
+	khprof_hash[h] = ix;
+
+	ks->ks_liveblocks++;
+	ks->ks_livebytes += blksize;
+	if (ks->ks_livebytes > ks->ks_peakbytes) {
+		ks->ks_peakbytes = ks->ks_livebytes;
+	}
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Record that the block at PTR has been freed.
+ */
+static
+void
+khprof_free(void *ptr)
+{
+	struct khprof_site *ks;
+	int16_t *ixp, ix;
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_ready) {
+		spinlock_release(&khprof_lock);
+		return;
+	}
+
+	for (ixp = &khprof_hash[KHPROF_HASH((vaddr_t)ptr)]; *ixp >= 0;
+	     ixp = &khprof_live[*ixp].kl_next) {
+		if (khprof_live[*ixp].kl_addr == (vaddr_t)ptr) {
+			break;
+		}
+	}
+	ix = *ixp;
+	if (ix < 0) {
+		/* One of the untracked ones. */
+		spinlock_release(&khprof_lock);
+		return;
+	}
+	*ixp = khprof_live[ix].kl_next;
+
+	ks = &khprof_sites[khprof_live[ix].kl_site];
+	KASSERT(ks->ks_liveblocks > 0);
+	ks->ks_frees++;
+	ks->ks_liveblocks--;
+	ks->ks_livebytes -= ks->ks_blksize;
+
+	khprof_live[ix].kl_next = khprof_freelive;
+	khprof_freelive = ix;
+
+	spinlock_release(&khprof_lock);
+}
+
+/*
+ * Sort the sites into khprof_order[] by KEY, biggest first. There
+ * are few enough of them that insertion sort is fine.
+ */
+static
+void
+khprof_sort(long (*key)(const struct khprof_site *))
+{
+	unsigned i, j;
+	uint16_t t;
+
+	for (i=0; i<khprof_nsites; i++) {
+		t = i;
+		for (j=i; j>0 && key(&khprof_sites[khprof_order[j-1]]) <
+			     key(&khprof_sites[t]); j--) {
+			khprof_order[j] = khprof_order[j-1];
+		}
+		khprof_order[j] = t;
+	}
+}
+
+static
+long
+khprof_livekey(const struct khprof_site *ks)
+{
+	return ks->ks_livebytes;
+}
+
+static
+long
+khprof_deltakey(const struct khprof_site *ks)
+{
+	long delta = (long)ks->ks_livebytes - (long)ks->ks_snapbytes;
+
+	return delta < 0 ? -delta : delta;
+}
+
+static
+void
+khprof_printsites(void)
+{
+	struct khprof_site *ks;
+	unsigned i;
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_ready) {
+		khprof_init();
+	}
+	khprof_sort(khprof_livekey);
+
+	kprintf("Allocations by call site (by live bytes):\n");
+	kprintf("  %-10s %5s %8s %8s %7s %8s %8s\n", "caller", "size",
+		"allocs", "frees", "blocks", "bytes", "peak");
+	for (i=0; i<khprof_nsites; i++) {
+		ks = &khprof_sites[khprof_order[i]];
+		if (ks->ks_allocs == 0) {
+			continue;
+		}
+		kprintf("  0x%08lx %5lu %8u %8u %7u %8lu %8lu\n",
+			(unsigned long)ks->ks_caller,
+			(unsigned long)ks->ks_blksize,
+			ks->ks_allocs, ks->ks_frees, ks->ks_liveblocks,
+			(unsigned long)ks->ks_livebytes,
+			(unsigned long)ks->ks_peakbytes);
+	}
+	if (khprof_untracked > 0) {
+		kprintf("  (%u blocks not tracked; live table full)\n",
+			khprof_untracked);
+	}
+	spinlock_release(&khprof_lock);
+}
+
+void
+kheap_snapshot(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_ready) {
+		khprof_init();
+	}
+	for (i=0; i<KHPROF_MAXSITES; i++) {
+		khprof_sites[i].ks_snapbytes = khprof_sites[i].ks_livebytes;
+		khprof_sites[i].ks_snapblocks = khprof_sites[i].ks_liveblocks;
+	}
+	khprof_snapped = true;
+	spinlock_release(&khprof_lock);
+}
+
+void
+kheap_printdiff(void)
+{
+	struct khprof_site *ks;
+	unsigned i;
+	long total;
+
+	spinlock_acquire(&khprof_lock);
+	if (!khprof_snapped) {
+		spinlock_release(&khprof_lock);
+		kprintf("kh: no snapshot; use \"kh snap\" first\n");
+		return;
+	}
+	khprof_sort(khprof_deltakey);
+
+	kprintf("Change in live allocations since snapshot:\n");
+	kprintf("  %-10s %5s %8s %9s\n", "caller", "size", "blocks",
+		"bytes");
+	total = 0;
+	for (i=0; i<khprof_nsites; i++) {
+		ks = &khprof_sites[khprof_order[i]];
+		if (ks->ks_livebytes == ks->ks_snapbytes) {
+			continue;
+		}
+		kprintf("  0x%08lx %5lu %8d %9ld\n",
+			(unsigned long)ks->ks_caller,
+			(unsigned long)ks->ks_blksize,
+			(int)ks->ks_liveblocks - (int)ks->ks_snapblocks,
+			(long)ks->ks_livebytes - (long)ks->ks_snapbytes);
+		total += (long)ks->ks_livebytes - (long)ks->ks_snapbytes;
+	}
+	kprintf("  total %ld bytes\n", total);
+	spinlock_release(&khprof_lock);
+}
+
+#else /* !OPT_KHPROF */
+
+#define khprof_alloc(ptr, blksize, caller) ((void)(caller))
+#define khprof_free(ptr)
+
+void
+kheap_snapshot(void)
+{
+	kprintf("kh: heap profiling not compiled in (options khprof)\n");
+}
+
+void
+kheap_printdiff(void)
+{
+	kprintf("kh: heap profiling not compiled in (options khprof)\n");
+}
+
+#endif /* OPT_KHPROF */
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Size class fit measurement.
+//
+//    Compiled in with "options kmfrag". For each size class we count
+//    the allocations and the bytes asked for against the bytes
+//    handed out, and we keep a histogram of request sizes in
+//    KMFRAG_GRAIN-byte buckets. "kh" prints the wasted fraction of
+//    each class and the most common request sizes, which is what's
+//    needed to decide whether sizes[] should change.
+//
+
+#if OPT_KMFRAG
+
+#define KMFRAG_GRAIN	8
+#define KMFRAG_NBUCKETS	(LARGEST_SUBPAGE_SIZE / KMFRAG_GRAIN)
+#define KMFRAG_TOP	10
+
+static struct spinlock kmfrag_lock = SPINLOCK_INITIALIZER;
+
+/* One per size class, plus one for whole-page allocations. */
+static struct {
+	unsigned allocs;
+	unsigned reqbytes;		/* bytes asked for */
+	unsigned blkbytes;		/* bytes handed out */
+} kmfrag_stats[NSIZES + 1];
+
+static unsigned kmfrag_hist[KMFRAG_NBUCKETS];
+
+/*
+ * Record a request for SZ bytes satisfied with a block of BLKSIZE
+ * from class CLASS (NSIZES for whole pages). Rather than let the
+ * byte counts wrap, halve all of a class's counters first, and the
+ * request size histogram with them; the ratios are what matter. A
+ * histogram bucket counts requests from at most two classes, so it
+ * can't wrap before their byte counts do.
+ */
+static
+void
+kmfrag_record(unsigned class, size_t sz, size_t blksize)
+{
+	unsigned i;
+
+	KASSERT(class <= NSIZES);
+
+	spinlock_acquire(&kmfrag_lock);
+	if (kmfrag_stats[class].blkbytes + blksize <
+	    kmfrag_stats[class].blkbytes) {
+		kmfrag_stats[class].allocs /= 2;
+		kmfrag_stats[class].reqbytes /= 2;
+		kmfrag_stats[class].blkbytes /= 2;
+		for (i=0; i<KMFRAG_NBUCKETS; i++) {
+			kmfrag_hist[i] /= 2;
+		}
+	}
+	kmfrag_stats[class].allocs++;
+	kmfrag_stats[class].reqbytes += sz;
+	kmfrag_stats[class].blkbytes += blksize;
+	if (sz < LARGEST_SUBPAGE_SIZE) {
+		kmfrag_hist[sz / KMFRAG_GRAIN]++;
+	}
+	spinlock_release(&kmfrag_lock);
+}
+
+static
+void
+kmfrag_print(void)
+{
+	unsigned i, j, best, lastcount, lastbucket;
+	unsigned blk, req;
+
+	spinlock_acquire(&kmfrag_lock);
+
+	kprintf("Size class fit:\n");
+	kprintf("  %5s %8s %7s %6s\n", "class", "allocs", "avgreq", "waste");
+	for (i=0; i<=NSIZES; i++) {
+		if (kmfrag_stats[i].allocs == 0) {
+			continue;
+		}
+		blk = kmfrag_stats[i].blkbytes;
+		req = kmfrag_stats[i].reqbytes;
+		if (i < NSIZES) {
+			kprintf("  %5lu", (unsigned long)sizes[i]);
+		}
+		else {
+			kprintf("  %5s", "pages");
+		}
+		/* (avoid overflow in (blk - req) * 100) */
+		kprintf(" %8u %7u %5u%%\n", kmfrag_stats[i].allocs,
+			req / kmfrag_stats[i].allocs,
+			blk < 100 ? (blk - req) * 100 / blk :
+			(blk - req) / (blk / 100));
+	}
+
+	/*
+	 * Print the most common request sizes, biggest count first
+	 * (ties by size), by picking the next one each time around.
+	 */
+	kprintf("Most common request sizes:\n");
+	lastcount = (unsigned)-1;
+	lastbucket = 0;
+	for (i=0; i<KMFRAG_TOP; i++) {
+		best = KMFRAG_NBUCKETS;
+		for (j=0; j<KMFRAG_NBUCKETS; j++) {
+			if (kmfrag_hist[j] == 0) {
+				continue;
+			}
+			if (kmfrag_hist[j] > lastcount ||
+			    (kmfrag_hist[j] == lastcount && j <= lastbucket)) {
+				/* already printed */
+				continue;
+			}
+			if (best == KMFRAG_NBUCKETS ||
+			    kmfrag_hist[j] > kmfrag_hist[best]) {
+				best = j;
+			}
+		}
+		if (best == KMFRAG_NBUCKETS) {
+			break;
+		}
+		kprintf("  %4u-%4u bytes: %u\n", best * KMFRAG_GRAIN,
+			best * KMFRAG_GRAIN + KMFRAG_GRAIN - 1,
+			kmfrag_hist[best]);
+		lastcount = kmfrag_hist[best];
+		lastbucket = best;
+	}
+
+	spinlock_release(&kmfrag_lock);
+}
+
+#else /* !OPT_KMFRAG */
+
+#define kmfrag_record(class, sz, blksize)
+
+#endif /* OPT_KMFRAG */
+
+//
+////////////////////////////////////////////////////////////
+
 void *
 kmalloc(size_t sz)
 {
+	vaddr_t caller = (vaddr_t)__builtin_return_address(0);
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -612,10 +1480,17 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
+		khprof_alloc((void *)address, npages * PAGE_SIZE, caller);
+		kmfrag_record(NSIZES, sz, npages * PAGE_SIZE);
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	ptr = subpage_kmalloc(sz);
+	if (ptr != NULL) {
+		khprof_alloc(ptr, sizes[blocktype(sz)], caller);
+		kmfrag_record(blocktype(sz), sz, sizes[blocktype(sz)]);
+	}
+	return ptr;
 }
 
 void
@@ -626,9 +1501,10 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	khprof_free(ptr);
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -0,0 +1,274 @@
+/*
+ * Object caches.
+ *
+ * The specification of the interface is in kmem_cache.h.
+ *
+ * Each slab is a run of pages from alloc_kpages (normally just one)
+ * laid out as a small header followed by as many object slots as
+ * fit. A slot holds the object followed by a link word. The free
+ * list runs through the link words, not through the objects, so
+ * free objects keep their constructed contents.
+ *
+ * Slabs are never given back while the cache exists; a cache only
+ * grows to the largest number of its objects that have been in use
+ * at once. Everything in a cache is protected by its kc_lock. The
+ * constructor is run on a new slab's objects before the slab is
+ * added to the cache, with no locks held.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/* Alignment of objects in a slab; matches kmalloc's guarantee. */
+#define KMEM_ALIGN	8
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* other slabs of the same cache */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	size_t kc_linkoff;		/* offset of link word in a slot */
+	size_t kc_slotsize;		/* object plus link, aligned */
+	size_t kc_hdrsize;		/* slab header, aligned */
+	unsigned kc_slabpages;		/* pages per slab */
+	unsigned kc_perslab;		/* objects per slab */
+	void (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;
+	void *kc_freelist;		/* free (constructed) objects */
+	struct kmem_slab *kc_slabs;	/* all our slabs */
+
+	/* Statistics; protected by kc_lock. */
+	unsigned kc_nslabs;		/* slabs allocated */
+	unsigned kc_inuse;		/* objects allocated now */
+	unsigned kc_maxinuse;		/* high-water mark of kc_inuse */
+	unsigned kc_allocs;		/* calls to kmem_cache_alloc */
+	unsigned kc_frees;		/* calls to kmem_cache_free */
+	unsigned kc_ctors;		/* constructor calls */
+
+	struct kmem_cache *kc_next;	/* list of all caches */
+};
+
+/* List of all caches, for kmem_cache_printstats. */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/* Get the link word of the object OBJ. */
+#define KMEM_LINK(kc, obj) ((void **)((char *)(obj) + (kc)->kc_linkoff))
+
+////////////////////////////////////////////////////////////
+//
+// Create and destroy
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  void (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_linkoff = ROUNDUP(size, sizeof(void *));
+	kc->kc_slotsize = ROUNDUP(kc->kc_linkoff + sizeof(void *),
+				  KMEM_ALIGN);
+	kc->kc_hdrsize = ROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN);
+	KASSERT(kc->kc_hdrsize + kc->kc_slotsize <= PAGE_SIZE);
+	kc->kc_slabpages = 1;
+	kc->kc_perslab = (PAGE_SIZE - kc->kc_hdrsize) / kc->kc_slotsize;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	spinlock_setname(&kc->kc_lock, name);
+	kc->kc_freelist = NULL;
+	kc->kc_slabs = NULL;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_maxinuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_frees = 0;
+	kc->kc_ctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *slab;
+	unsigned i;
+	char *obj;
+
+	KASSERT(kc != NULL);
+	KASSERT(kc->kc_inuse == 0);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	while ((slab = kc->kc_slabs) != NULL) {
+		kc->kc_slabs = slab->ks_next;
+		if (kc->kc_dtor != NULL) {
+			obj = (char *)slab + kc->kc_hdrsize;
+			for (i=0; i<kc->kc_perslab; i++) {
+				kc->kc_dtor(obj);
+				obj += kc->kc_slotsize;
+			}
+		}
+		free_kpages((vaddr_t)slab);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Alloc and free
+
+/*
+ * Get and construct a new slab for KC. Its objects are chained
+ * together and returned in *HEAD and *TAIL. Called without kc_lock.
+ */
+static
+struct kmem_slab *
+kmem_cache_newslab(struct kmem_cache *kc, void **head, void **tail)
+{
+	struct kmem_slab *slab;
+	char *obj;
+	unsigned i;
+
+	slab = (struct kmem_slab *)alloc_kpages(kc->kc_slabpages);
+	if (slab == NULL) {
+		return NULL;
+	}
+
+	obj = (char *)slab + kc->kc_hdrsize;
+	*head = obj;
+	for (i=0; i<kc->kc_perslab; i++) {
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		*KMEM_LINK(kc, obj) = (i+1 < kc->kc_perslab) ?
+			obj + kc->kc_slotsize : NULL;
+		*tail = obj;
+		obj += kc->kc_slotsize;
+	}
+	return slab;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj, *head, *tail;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_freelist == NULL) {
+		/*
+		 * Need another slab. Make it without the lock, both
+		 * because alloc_kpages may come back to us and because
+		 * the constructor may want to allocate things.
+		 */
+		spinlock_release(&kc->kc_lock);
+		slab = kmem_cache_newslab(kc, &head, &tail);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+
+		slab->ks_next = kc->kc_slabs;
+		kc->kc_slabs = slab;
+		kc->kc_nslabs++;
+		kc->kc_ctors += kc->kc_ctor != NULL ? kc->kc_perslab : 0;
+
+		*KMEM_LINK(kc, tail) = kc->kc_freelist;
+		kc->kc_freelist = head;
+	}
+
+	obj = kc->kc_freelist;
+	kc->kc_freelist = *KMEM_LINK(kc, obj);
+
+	kc->kc_allocs++;
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_maxinuse) {
+		kc->kc_maxinuse = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	*KMEM_LINK(kc, obj) = kc->kc_freelist;
+	kc->kc_freelist = obj;
+	kc->kc_frees++;
+	kc->kc_inuse--;
+	spinlock_release(&kc->kc_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Statistics
+
+/*
+ * Print statistics for each cache. "waste" is the fraction of the
+ * slab memory not taken up by objects, counting free ones as used;
+ * compare with what the nearest kmalloc size class would waste.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	uint64_t total, used;
+	unsigned waste;
+
+	kprintf("%-14s %5s %5s %6s %6s %6s %8s %8s %6s %5s\n",
+		"cache", "size", "slabs", "objs", "inuse", "max",
+		"allocs", "frees", "ctors", "waste");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		/* In 64 bits; these overflow for big caches. */
+		total = (uint64_t)kc->kc_nslabs * kc->kc_slabpages * PAGE_SIZE;
+		used = (uint64_t)kc->kc_nslabs * kc->kc_perslab * kc->kc_size;
+		waste = total == 0 ? 0 : 100 - (unsigned)(used * 100 / total);
+		kprintf("%-14s %5lu %5u %6u %6u %6u %8u %8u %6u %4u%%\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_nslabs, kc->kc_nslabs * kc->kc_perslab,
+			kc->kc_inuse, kc->kc_maxinuse,
+			kc->kc_allocs, kc->kc_frees, kc->kc_ctors, waste);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
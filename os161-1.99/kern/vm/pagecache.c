@@ -0,0 +1,633 @@
+/*
+ * Unified page cache.
+ *
+ * The specification of the interface is in pagecache.h.
+ *
+ * Pages live in a hash table keyed by (vnode, offset) and on a
+ * single LRU list, least recently used at the head. Everything is
+ * protected by pagecache_lock. Page I/O is done with the lock
+ * released; while that's happening the page is marked busy and
+ * anyone else who wants it sleeps on pagecache_wchan.
+ *
+ * A page is pinned (pp_refcount > 0) while someone holds it from
+ * pagecache_get. Pinned and busy pages are never evicted.
+ *
+ * Frames that fall out of the cache (truncate, vnode reclaim, I/O
+ * errors) go on a private free list and are reused before any new
+ * frame is allocated. They are only handed back to the kernel by
+ * pagecache_reclaim.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <mainbus.h>
+#include <vm.h>
+#include <vnode.h>
+#include <pagecache.h>
+
+/*
+ * Tuning constants.
+ *
+ * The cache may own at most 1/PC_RAMFRACTION of physical memory,
+ * but never fewer than PC_MINFRAMES frames.
+ */
+#define PC_HASHSIZE	127
+#define PC_RAMFRACTION	8
+#define PC_MINFRAMES	4
+
+struct pcpage {
+	struct vnode *pp_vnode;		/* file the page belongs to */
+	off_t pp_offset;		/* page-aligned offset in file */
+	const struct pagecache_ops *pp_ops; /* how to read/write it */
+	vaddr_t pp_kvaddr;		/* the page itself */
+	unsigned pp_refcount;		/* number of pins */
+	bool pp_busy;			/* I/O in progress */
+	bool pp_dirty;			/* modified since read/written */
+	struct pcpage *pp_hashnext;	/* hash chain, or free list */
+	struct pcpage *pp_lrunext;	/* LRU list */
+	struct pcpage *pp_lruprev;
+};
+
+static struct spinlock pagecache_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pagecache_wchan;
+
+static struct pcpage *pc_hash[PC_HASHSIZE];
+static struct pcpage *pc_lruhead, *pc_lrutail;
+static struct pcpage *pc_freelist;
+
+static unsigned pc_nframes;		/* frames owned, incl. free list */
+static unsigned pc_maxframes;		/* limit on pc_nframes */
+
+/* Statistics; protected by pagecache_lock. */
+static struct {
+	unsigned hits;
+	unsigned misses;
+	unsigned evictions;
+	unsigned writebacks;
+	unsigned reclaimed;
+} pc_stats;
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+pagecache_bootstrap(void)
+{
+	pagecache_wchan = wchan_create("pagecache");
+	if (pagecache_wchan == NULL) {
+		panic("pagecache: Could not create wait channel\n");
+	}
+
+	pc_maxframes = mainbus_ramsize() / PAGE_SIZE / PC_RAMFRACTION;
+	if (pc_maxframes < PC_MINFRAMES) {
+		pc_maxframes = PC_MINFRAMES;
+	}
+	pc_nframes = 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// List maintenance. All of these require pagecache_lock.
+
+static
+unsigned
+pc_hashfunc(struct vnode *v, off_t offset)
+{
+	uint32_t val;
+
+	val = (uint32_t)(uintptr_t)v >> 4;
+	val ^= (uint32_t)(offset / PAGE_SIZE) * 31;
+	return val % PC_HASHSIZE;
+}
+
+static
+struct pcpage *
+pc_lookup(struct vnode *v, off_t offset)
+{
+	struct pcpage *pp;
+
+	for (pp = pc_hash[pc_hashfunc(v, offset)]; pp; pp = pp->pp_hashnext) {
+		if (pp->pp_vnode == v && pp->pp_offset == offset) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_hash_insert(struct pcpage *pp)
+{
+	unsigned ix = pc_hashfunc(pp->pp_vnode, pp->pp_offset);
+
+	pp->pp_hashnext = pc_hash[ix];
+	pc_hash[ix] = pp;
+}
+
+static
+void
+pc_hash_remove(struct pcpage *pp)
+{
+	struct pcpage **ppp;
+
+	ppp = &pc_hash[pc_hashfunc(pp->pp_vnode, pp->pp_offset)];
+	for (; *ppp != NULL; ppp = &(*ppp)->pp_hashnext) {
+		if (*ppp == pp) {
+			*ppp = pp->pp_hashnext;
+			pp->pp_hashnext = NULL;
+			return;
+		}
+	}
+	panic("pagecache: page %p not in hash table\n", pp);
+}
+
+static
+void
+pc_lru_addtail(struct pcpage *pp)
+{
+	pp->pp_lrunext = NULL;
+	pp->pp_lruprev = pc_lrutail;
+	if (pc_lrutail != NULL) {
+		pc_lrutail->pp_lrunext = pp;
+	}
+	else {
+		pc_lruhead = pp;
+	}
+	pc_lrutail = pp;
+}
+
+static
+void
+pc_lru_remove(struct pcpage *pp)
+{
+	if (pp->pp_lruprev != NULL) {
+		pp->pp_lruprev->pp_lrunext = pp->pp_lrunext;
+	}
+	else {
+		pc_lruhead = pp->pp_lrunext;
+	}
+	if (pp->pp_lrunext != NULL) {
+		pp->pp_lrunext->pp_lruprev = pp->pp_lruprev;
+	}
+	else {
+		pc_lrutail = pp->pp_lruprev;
+	}
+	pp->pp_lrunext = pp->pp_lruprev = NULL;
+}
+
+/*
+ * Take a page out of the cache proper and put its frame on the free
+ * list.
+ */
+static
+void
+pc_unlink(struct pcpage *pp)
+{
+	KASSERT(pp->pp_refcount == 0);
+	KASSERT(!pp->pp_busy);
+
+	pc_hash_remove(pp);
+	pc_lru_remove(pp);
+	pp->pp_vnode = NULL;
+	pp->pp_ops = NULL;
+	pp->pp_dirty = false;
+
+	pp->pp_hashnext = pc_freelist;
+	pc_freelist = pp;
+}
+
+/*
+ * Wait for some page to change state. Called with pagecache_lock
+ * held; returns with it held, but it's been dropped in between so
+ * the caller must recheck everything.
+ */
+static
+void
+pc_wait(void)
+{
+	wchan_lock(pagecache_wchan);
+	spinlock_release(&pagecache_lock);
+	wchan_sleep(pagecache_wchan);
+	spinlock_acquire(&pagecache_lock);
+}
+
+/*
+ * Write a dirty page back. Called and returns with pagecache_lock
+ * held, but drops it during the I/O.
+ */
+static
+int
+pc_writeback(struct pcpage *pp)
+{
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&pagecache_lock));
+	KASSERT(pp->pp_dirty);
+	KASSERT(!pp->pp_busy);
+
+	/*
+	 * Clear the dirty flag before writing, so that if the page is
+	 * modified again while we're at it, that isn't lost.
+	 */
+	pp->pp_busy = true;
+	pp->pp_dirty = false;
+	pp->pp_refcount++;
+	spinlock_release(&pagecache_lock);
+
+	result = pp->pp_ops->pco_pageout(pp->pp_vnode, pp->pp_offset,
+					 (const void *)pp->pp_kvaddr);
+
+	spinlock_acquire(&pagecache_lock);
+	pp->pp_refcount--;
+	pp->pp_busy = false;
+	if (result) {
+		pp->pp_dirty = true;
+	}
+	else {
+		pc_stats.writebacks++;
+	}
+	wchan_wakeall(pagecache_wchan);
+	return result;
+}
+
+/*
+ * Get a frame for a new page. Called with pagecache_lock held.
+ *
+ * On success *RET is either a frame (not on any list) or NULL, which
+ * means the caller should just try again. Because the lock may have
+ * been dropped, either way the caller must recheck whether the page
+ * it wants has appeared in the meantime. Fails if memory is exhausted
+ * and the cache has nothing at all to evict, or if writing back the
+ * page chosen for eviction fails.
+ */
+static
+int
+pc_getframe(struct pcpage **ret)
+{
+	struct pcpage *pp;
+	int result;
+	vaddr_t kva;
+
+	KASSERT(spinlock_do_i_hold(&pagecache_lock));
+
+	*ret = NULL;
+
+	/* Reuse a free frame if we have one. */
+	if (pc_freelist != NULL) {
+		pp = pc_freelist;
+		pc_freelist = pp->pp_hashnext;
+		pp->pp_hashnext = NULL;
+		*ret = pp;
+		return 0;
+	}
+
+	/* Grow, if we're under the limit. */
+	if (pc_nframes < pc_maxframes) {
+		/* Reserve the slot before unlocking. */
+		pc_nframes++;
+		spinlock_release(&pagecache_lock);
+
+		kva = 0;
+		pp = kmalloc(sizeof(*pp));
+		if (pp != NULL) {
+			kva = alloc_kpages(1);
+			if (kva == 0) {
+				kfree(pp);
+			}
+		}
+
+		spinlock_acquire(&pagecache_lock);
+		if (kva != 0) {
+			pp->pp_vnode = NULL;
+			pp->pp_offset = 0;
+			pp->pp_ops = NULL;
+			pp->pp_kvaddr = kva;
+			pp->pp_refcount = 0;
+			pp->pp_busy = false;
+			pp->pp_dirty = false;
+			pp->pp_hashnext = NULL;
+			pp->pp_lrunext = pp->pp_lruprev = NULL;
+			*ret = pp;
+			return 0;
+		}
+
+		/* Out of memory; evict instead. */
+		pc_nframes--;
+	}
+
+	/* Evict the least recently used page we can. */
+	for (pp = pc_lruhead; pp != NULL; pp = pp->pp_lrunext) {
+		if (pp->pp_refcount == 0 && !pp->pp_busy) {
+			break;
+		}
+	}
+
+	if (pp == NULL) {
+		if (pc_lruhead == NULL) {
+			/* No memory, and nothing of ours to give up. */
+			return ENOMEM;
+		}
+		/* Everything is pinned or busy. Wait for a change. */
+		pc_wait();
+		return 0;
+	}
+
+	if (pp->pp_dirty) {
+		result = pc_writeback(pp);
+		if (result) {
+			/*
+			 * Move it to the back so the next try picks
+			 * something else, rather than failing on the
+			 * same page forever. (It was pinned while the
+			 * lock was dropped, so it's still in the cache.)
+			 */
+			pc_lru_remove(pp);
+			pc_lru_addtail(pp);
+			return result;
+		}
+		return 0;
+	}
+
+	pc_stats.evictions++;
+	pc_unlink(pp);
+
+	pp = pc_freelist;
+	pc_freelist = pp->pp_hashnext;
+	pp->pp_hashnext = NULL;
+	*ret = pp;
+	return 0;
+}
+
+/*
+ * Give a frame obtained from pc_getframe back unused.
+ */
+static
+void
+pc_putframe(struct pcpage *pp)
+{
+	pp->pp_hashnext = pc_freelist;
+	pc_freelist = pp;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Public interface
+
+int
+pagecache_get(struct vnode *v, off_t offset,
+	      const struct pagecache_ops *ops, struct pcpage **ret)
+{
+	struct pcpage *pp, *newpp;
+	int result;
+
+	KASSERT(v != NULL);
+	KASSERT(ops != NULL);
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pagecache_lock);
+
+	newpp = NULL;
+	while (1) {
+		pp = pc_lookup(v, offset);
+		if (pp != NULL) {
+			if (pp->pp_busy) {
+				pc_wait();
+				continue;
+			}
+			if (newpp != NULL) {
+				/* Someone beat us to it. */
+				pc_putframe(newpp);
+			}
+			pc_stats.hits++;
+			pp->pp_refcount++;
+			pc_lru_remove(pp);
+			pc_lru_addtail(pp);
+			spinlock_release(&pagecache_lock);
+			*ret = pp;
+			return 0;
+		}
+
+		if (newpp != NULL) {
+			break;
+		}
+
+		result = pc_getframe(&newpp);
+		if (result) {
+			spinlock_release(&pagecache_lock);
+			return result;
+		}
+	}
+
+	/* Not found; insert the new page busy and read it in. */
+	pp = newpp;
+	pc_stats.misses++;
+	pp->pp_vnode = v;
+	pp->pp_offset = offset;
+	pp->pp_ops = ops;
+	pp->pp_refcount = 1;
+	pp->pp_busy = true;
+	pp->pp_dirty = false;
+	pc_hash_insert(pp);
+	pc_lru_addtail(pp);
+	spinlock_release(&pagecache_lock);
+
+	result = ops->pco_pagein(v, offset, (void *)pp->pp_kvaddr);
+
+	spinlock_acquire(&pagecache_lock);
+	pp->pp_busy = false;
+	if (result) {
+		pp->pp_refcount--;
+		pc_unlink(pp);
+	}
+	wchan_wakeall(pagecache_wchan);
+	spinlock_release(&pagecache_lock);
+
+	if (result) {
+		return result;
+	}
+	*ret = pp;
+	return 0;
+}
+
+void *
+pagecache_kvaddr(struct pcpage *pp)
+{
+	KASSERT(pp->pp_refcount > 0);
+	return (void *)pp->pp_kvaddr;
+}
+
+void
+pagecache_markdirty(struct pcpage *pp)
+{
+	spinlock_acquire(&pagecache_lock);
+	KASSERT(pp->pp_refcount > 0);
+	pp->pp_dirty = true;
+	spinlock_release(&pagecache_lock);
+}
+
+void
+pagecache_release(struct pcpage *pp)
+{
+	spinlock_acquire(&pagecache_lock);
+	KASSERT(pp->pp_refcount > 0);
+	pp->pp_refcount--;
+	if (pp->pp_refcount == 0) {
+		/* Someone may be waiting for an evictable page. */
+		wchan_wakeall(pagecache_wchan);
+	}
+	spinlock_release(&pagecache_lock);
+}
+
+int
+pagecache_flush(struct vnode *v)
+{
+	struct pcpage *pp;
+	int result, ret = 0;
+
+	spinlock_acquire(&pagecache_lock);
+ again:
+	for (pp = pc_lruhead; pp != NULL; pp = pp->pp_lrunext) {
+		if (pp->pp_vnode != v) {
+			continue;
+		}
+		if (pp->pp_busy) {
+			pc_wait();
+			goto again;
+		}
+		if (pp->pp_dirty) {
+			result = pc_writeback(pp);
+			if (result) {
+				/* Remember the first error; don't loop on it. */
+				if (ret == 0) {
+					ret = result;
+				}
+				break;
+			}
+			/* The list may have changed; rescan. */
+			goto again;
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	return ret;
+}
+
+void
+pagecache_discard(struct vnode *v, off_t len)
+{
+	struct pcpage *pp, *next;
+	off_t keep;
+
+	spinlock_acquire(&pagecache_lock);
+ again:
+	for (pp = pc_lruhead; pp != NULL; pp = next) {
+		next = pp->pp_lrunext;
+		if (pp->pp_vnode != v || pp->pp_offset + PAGE_SIZE <= len) {
+			continue;
+		}
+		if (pp->pp_busy) {
+			pc_wait();
+			goto again;
+		}
+		KASSERT(pp->pp_refcount == 0);
+
+		if (pp->pp_offset >= len) {
+			pc_unlink(pp);
+		}
+		else {
+			/* Straddles LEN; keep the front, zero the back. */
+			keep = len - pp->pp_offset;
+			bzero((char *)pp->pp_kvaddr + keep, PAGE_SIZE - keep);
+		}
+	}
+	spinlock_release(&pagecache_lock);
+}
+
+unsigned
+pagecache_reclaim(unsigned npages)
+{
+	struct pcpage *pp, *next, *victims;
+	unsigned count;
+
+	spinlock_acquire(&pagecache_lock);
+
+	/* Count the frames already free. */
+	count = 0;
+	for (pp = pc_freelist; pp != NULL && count < npages;
+	     pp = pp->pp_hashnext) {
+		count++;
+	}
+
+	/*
+	 * Push clean, idle pages onto the free list, oldest first, until
+	 * there are enough frames there.
+	 */
+	for (pp = pc_lruhead; pp != NULL && count < npages; pp = next) {
+		next = pp->pp_lrunext;
+		if (pp->pp_refcount == 0 && !pp->pp_busy && !pp->pp_dirty) {
+			pc_stats.evictions++;
+			pc_unlink(pp);
+			count++;
+		}
+	}
+
+	/* Detach up to NPAGES frames from the free list. */
+	victims = NULL;
+	count = 0;
+	while (count < npages && pc_freelist != NULL) {
+		pp = pc_freelist;
+		pc_freelist = pp->pp_hashnext;
+		pp->pp_hashnext = victims;
+		victims = pp;
+		count++;
+	}
+	KASSERT(pc_nframes >= count);
+	pc_nframes -= count;
+	pc_stats.reclaimed += count;
+
+	spinlock_release(&pagecache_lock);
+
+	/* Free them with no locks held. */
+	while (victims != NULL) {
+		pp = victims;
+		victims = pp->pp_hashnext;
+		free_kpages(pp->pp_kvaddr);
+		kfree(pp);
+	}
+
+	return count;
+}
+
+/*
+ * Print the statistics. Like kheap_printstats this doesn't worry
+ * about the numbers changing underneath it.
+ */
+void
+pagecache_printstats(void)
+{
+	struct pcpage *pp;
+	unsigned ncached = 0, ndirty = 0, npinned = 0;
+
+	spinlock_acquire(&pagecache_lock);
+	for (pp = pc_lruhead; pp != NULL; pp = pp->pp_lrunext) {
+		ncached++;
+		if (pp->pp_dirty) {
+			ndirty++;
+		}
+		if (pp->pp_refcount > 0) {
+			npinned++;
+		}
+	}
+	spinlock_release(&pagecache_lock);
+
+	kprintf("Page cache: %u/%u frames, %u cached, %u dirty, %u pinned\n",
+		pc_nframes, pc_maxframes, ncached, ndirty, npinned);
+	kprintf("    %u hits, %u misses, %u evictions, %u writebacks, "
+		"%u reclaimed\n",
+		pc_stats.hits, pc_stats.misses, pc_stats.evictions,
+		pc_stats.writebacks, pc_stats.reclaimed);
+}
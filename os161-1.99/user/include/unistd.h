@@ -42,6 +42,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>	/* needs kern/time.h */
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -156,6 +157,15 @@ time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+/* Threads. errno is still shared by all the threads of a process. */
+int __thread_create(void (*start)(void *(*)(void *), void *),
+		    void *(*func)(void *), void *arg);
+__DEAD void thread_exit(void *value);
+int thread_join(int tid, void **value);
+int futex_wait(volatile int *addr, int expected);
+int futex_wake(volatile int *addr, int n);
+pid_t wait4(pid_t pid, int *returncode, int flags, struct rusage *usage);
+int getrusage(int who, struct rusage *usage);
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.
@@ -163,5 +173,6 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void *(*func)(void *), void *arg); /* __thread_create */
 
 #endif /* _UNISTD_H_ */
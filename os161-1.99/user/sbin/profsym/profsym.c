@@ -0,0 +1,463 @@
+/*
+ * profsym - print a flat profile from a kernel sampling profile.
+ *
+ * Usage: profsym [-n count] profilefile kernel
+ *
+ * Reads a file written by the kernel menu command "pr save" (the
+ * format is in <kern/prof.h>) and the kernel binary it came from, and
+ * prints how many samples landed in each kernel function, biggest
+ * first. User-mode samples can't be named without the program, so
+ * they're listed by pid and address; feed those addresses to
+ * os161-addr2line with the program binary.
+ *
+ * This runs on the host. Both files are in the kernel's byte order
+ * (big-endian); the ELF is read by hand so as not to need the host's
+ * <elf.h>.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <netinet/in.h> // for arpa/inet.h
+#include <arpa/inet.h>  // for ntohl
+
+#include "kern/prof.h"
+
+#define SWAPL(x) ntohl(x)
+
+/* The few bits of ELF we need. */
+#define ELF_SHOFF	32	/* e_shoff in the file header */
+#define ELF_SHENTSIZE	46	/* e_shentsize */
+#define ELF_SHNUM	48	/* e_shnum */
+#define SH_TYPE		4	/* sh_type in a section header */
+#define SH_OFFSET	16	/* sh_offset */
+#define SH_SIZE		20	/* sh_size */
+#define SH_LINK		24	/* sh_link */
+#define SHT_SYMTAB	2
+#define SYM_SIZE	16	/* sizeof(Elf32_Sym) */
+#define STT_NOTYPE	0
+#define STT_FUNC	2
+
+/* Default number of lines of each kind. */
+#define DEFAULT_COUNT	30
+
+struct sym {
+	uint32_t s_addr;
+	const char *s_name;
+	uint32_t s_count;	/* samples */
+};
+
+struct sample {
+	uint32_t sa_pc;
+	int32_t sa_pid;
+	uint32_t sa_user;
+	uint32_t sa_count;
+};
+
+static struct sym *syms;
+static unsigned nsyms;
+
+static struct sample *samples;
+static unsigned nsamples;
+
+static uint32_t total, idle, dropped, ncpus, hz;
+
+////////////////////////////////////////////////////////////
+//
+// Reading files
+
+static
+void *
+readfile(const char *path, size_t *len)
+{
+	FILE *f;
+	long size;
+	void *buf;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		err(1, "%s", path);
+	}
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0) {
+		err(1, "%s: fseek", path);
+	}
+	rewind(f);
+	buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL) {
+		err(1, "malloc");
+	}
+	if (fread(buf, 1, size, f) != (size_t)size) {
+		errx(1, "%s: Short read", path);
+	}
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+/* Big-endian fields at byte offset OFF, checked against the length. */
+static
+uint32_t
+get32(const unsigned char *buf, size_t len, size_t off)
+{
+	uint32_t v;
+
+	if (off + 4 > len) {
+		errx(1, "File truncated");
+	}
+	memcpy(&v, buf + off, 4);
+	return SWAPL(v);
+}
+
+static
+uint16_t
+get16(const unsigned char *buf, size_t len, size_t off)
+{
+	if (off + 2 > len) {
+		errx(1, "File truncated");
+	}
+	return (buf[off] << 8) | buf[off + 1];
+}
+
+static
+int
+symcmp(const void *av, const void *bv)
+{
+	const struct sym *a = av, *b = bv;
+
+	if (a->s_addr != b->s_addr) {
+		return a->s_addr < b->s_addr ? -1 : 1;
+	}
+	return strcmp(a->s_name, b->s_name);
+}
+
+/*
+ * Load the function symbols from the kernel's symbol table, sorted
+ * by address. Untyped symbols are kept too, for the assembler code.
+ */
+static
+void
+readsyms(const char *path)
+{
+	unsigned char *buf;
+	size_t len, shoff, sh, symoff, symsize, stroff, strsize, s;
+	unsigned shentsize, shnum, i, type;
+	uint32_t name;
+
+	buf = readfile(path, &len);
+	if (len < 52 || memcmp(buf, "\177ELF", 4) != 0 || buf[4] != 1) {
+		errx(1, "%s: Not a 32-bit ELF file", path);
+	}
+	shoff = get32(buf, len, ELF_SHOFF);
+	shentsize = get16(buf, len, ELF_SHENTSIZE);
+	shnum = get16(buf, len, ELF_SHNUM);
+
+	symoff = symsize = stroff = strsize = 0;
+	for (i=0; i<shnum; i++) {
+		sh = shoff + i * shentsize;
+		if (get32(buf, len, sh + SH_TYPE) != SHT_SYMTAB) {
+			continue;
+		}
+		symoff = get32(buf, len, sh + SH_OFFSET);
+		symsize = get32(buf, len, sh + SH_SIZE);
+		sh = shoff + get32(buf, len, sh + SH_LINK) * shentsize;
+		stroff = get32(buf, len, sh + SH_OFFSET);
+		strsize = get32(buf, len, sh + SH_SIZE);
+		break;
+	}
+	if (symsize == 0) {
+		errx(1, "%s: No symbol table", path);
+	}
+	if (stroff + strsize > len || strsize == 0) {
+		errx(1, "%s: Bad string table", path);
+	}
+
+	syms = malloc((symsize / SYM_SIZE) * sizeof(*syms));
+	if (syms == NULL) {
+		err(1, "malloc");
+	}
+	for (s = symoff; s + SYM_SIZE <= symoff + symsize; s += SYM_SIZE) {
+		name = get32(buf, len, s);
+		type = buf[s + 12] & 0xf;
+		/* Skip undefined symbols and those with no name. */
+		if (get16(buf, len, s + 14) == 0 || name == 0 ||
+		    name >= strsize) {
+			continue;
+		}
+		if (type != STT_FUNC && type != STT_NOTYPE) {
+			continue;
+		}
+		syms[nsyms].s_addr = get32(buf, len, s + 4);
+		syms[nsyms].s_name = (const char *)buf + stroff + name;
+		syms[nsyms].s_count = 0;
+		/* Local labels the assembler leaves lying around */
+		if (syms[nsyms].s_name[0] == '$' ||
+		    syms[nsyms].s_name[0] == '.') {
+			continue;
+		}
+		nsyms++;
+	}
+	qsort(syms, nsyms, sizeof(*syms), symcmp);
+	/* buf stays allocated; the names point into it. */
+}
+
+static
+int
+samplekeycmp(const void *av, const void *bv)
+{
+	const struct sample *a = av, *b = bv;
+
+	if (a->sa_user != b->sa_user) {
+		return a->sa_user < b->sa_user ? -1 : 1;
+	}
+	if (a->sa_pid != b->sa_pid) {
+		return a->sa_pid < b->sa_pid ? -1 : 1;
+	}
+	return a->sa_pc < b->sa_pc ? -1 : a->sa_pc > b->sa_pc;
+}
+
+/*
+ * Add together samples from different cpus with the same pc, pid
+ * and mode.
+ */
+static
+void
+mergesamples(void)
+{
+	unsigned i, j;
+
+	if (nsamples == 0) {
+		return;
+	}
+	qsort(samples, nsamples, sizeof(*samples), samplekeycmp);
+	for (i=1, j=0; i<nsamples; i++) {
+		if (samplekeycmp(&samples[i], &samples[j]) == 0) {
+			samples[j].sa_count += samples[i].sa_count;
+		}
+		else {
+			samples[++j] = samples[i];
+		}
+	}
+	nsamples = j + 1;
+}
+
+#define CPUHDR(f) offsetof(struct prof_cpuhdr, f)
+#define ENTRY(f) offsetof(struct prof_entry, f)
+
+static
+void
+readprof(const char *path)
+{
+	unsigned char *buf;
+	size_t len, pos;
+	uint32_t i, j, n;
+	const struct prof_entry *pe;
+
+	buf = readfile(path, &len);
+	if (len < sizeof(struct prof_filehdr) ||
+	    get32(buf, len, 0) != PROF_MAGIC) {
+		errx(1, "%s: Not a profile file", path);
+	}
+	if (get32(buf, len, offsetof(struct prof_filehdr, ph_version)) !=
+	    PROF_VERSION) {
+		errx(1, "%s: Profile version %u; I only know %u", path,
+		     get32(buf, len, offsetof(struct prof_filehdr, ph_version)),
+		     PROF_VERSION);
+	}
+	ncpus = get32(buf, len, offsetof(struct prof_filehdr, ph_ncpus));
+	hz = get32(buf, len, offsetof(struct prof_filehdr, ph_hz));
+	pos = sizeof(struct prof_filehdr);
+
+	/* One pass to size things, one to read them. */
+	for (i=0; i<ncpus; i++) {
+		n = get32(buf, len, pos + CPUHDR(pc_nentries));
+		total += get32(buf, len, pos + CPUHDR(pc_nsamples));
+		idle += get32(buf, len, pos + CPUHDR(pc_idle));
+		dropped += get32(buf, len, pos + CPUHDR(pc_dropped));
+		pos += sizeof(struct prof_cpuhdr) + n * sizeof(*pe);
+		nsamples += n;
+	}
+	if (pos > len) {
+		errx(1, "%s: Profile file truncated", path);
+	}
+	samples = malloc(nsamples * sizeof(*samples) + 1);
+	if (samples == NULL) {
+		err(1, "malloc");
+	}
+
+	pos = sizeof(struct prof_filehdr);
+	nsamples = 0;
+	for (i=0; i<ncpus; i++) {
+		n = get32(buf, len, pos + CPUHDR(pc_nentries));
+		pos += sizeof(struct prof_cpuhdr);
+		for (j=0; j<n; j++) {
+			samples[nsamples].sa_pc =
+				get32(buf, len, pos + ENTRY(pe_pc));
+			samples[nsamples].sa_pid =
+				get32(buf, len, pos + ENTRY(pe_pid));
+			samples[nsamples].sa_count =
+				get32(buf, len, pos + ENTRY(pe_count));
+			samples[nsamples].sa_user =
+				get32(buf, len, pos + ENTRY(pe_user));
+			nsamples++;
+			pos += sizeof(*pe);
+		}
+	}
+	free(buf);
+	mergesamples();
+}
+
+////////////////////////////////////////////////////////////
+//
+// Output
+
+/* The symbol PC is in: the last one starting at or below it. */
+static
+struct sym *
+findsym(uint32_t pc)
+{
+	unsigned lo = 0, hi = nsyms;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (syms[mid].s_addr <= pc) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo == 0 ? NULL : &syms[lo - 1];
+}
+
+static
+int
+symcountcmp(const void *av, const void *bv)
+{
+	const struct sym *a = av, *b = bv;
+
+	if (a->s_count != b->s_count) {
+		return a->s_count > b->s_count ? -1 : 1;
+	}
+	return a->s_addr < b->s_addr ? -1 : a->s_addr > b->s_addr;
+}
+
+static
+int
+samplecountcmp(const void *av, const void *bv)
+{
+	const struct sample *a = av, *b = bv;
+
+	if (a->sa_count != b->sa_count) {
+		return a->sa_count > b->sa_count ? -1 : 1;
+	}
+	return samplekeycmp(av, bv);
+}
+
+static
+double
+pct(uint32_t n)
+{
+	return total == 0 ? 0.0 : n * 100.0 / total;
+}
+
+static
+void
+printkernel(unsigned count)
+{
+	struct sym *sy;
+	uint32_t kern = 0, unknown = 0, i;
+
+	for (i=0; i<nsamples; i++) {
+		if (samples[i].sa_user) {
+			continue;
+		}
+		kern += samples[i].sa_count;
+		sy = findsym(samples[i].sa_pc);
+		if (sy == NULL) {
+			unknown += samples[i].sa_count;
+		}
+		else {
+			sy->s_count += samples[i].sa_count;
+		}
+	}
+	qsort(syms, nsyms, sizeof(*syms), symcountcmp);
+
+	printf("\nKernel: %u samples (%.1f%%)\n", kern, pct(kern));
+	printf("%8s %6s  %s\n", "samples", "%", "function");
+	for (i=0; i<nsyms && i<count && syms[i].s_count > 0; i++) {
+		printf("%8u %5.1f%%  %s\n", syms[i].s_count,
+		       pct(syms[i].s_count), syms[i].s_name);
+	}
+	if (unknown > 0) {
+		printf("%8u %5.1f%%  (below the first symbol)\n", unknown,
+		       pct(unknown));
+	}
+}
+
+static
+void
+printuser(unsigned count)
+{
+	uint32_t user = 0, i, shown;
+
+	qsort(samples, nsamples, sizeof(*samples), samplecountcmp);
+	for (i=0; i<nsamples; i++) {
+		if (samples[i].sa_user) {
+			user += samples[i].sa_count;
+		}
+	}
+
+	printf("\nUser: %u samples (%.1f%%)\n", user, pct(user));
+	printf("%8s %6s %6s  %s\n", "samples", "%", "pid", "pc");
+	shown = 0;
+	for (i=0; i<nsamples && shown<count; i++) {
+		if (!samples[i].sa_user) {
+			continue;
+		}
+		printf("%8u %5.1f%% %6d  0x%08x\n", samples[i].sa_count,
+		       pct(samples[i].sa_count), samples[i].sa_pid,
+		       samples[i].sa_pc);
+		shown++;
+	}
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: profsym [-n count] profilefile kernel");
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned count = DEFAULT_COUNT;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		    case 'n':
+			count = atoi(optarg);
+			break;
+		    default:
+			usage();
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+	}
+	readprof(argv[optind]);
+	readsyms(argv[optind + 1]);
+
+	printf("%u samples on %u cpus at %u Hz: %u idle (%.1f%%), "
+	       "%u dropped\n", total, ncpus, hz, idle, pct(idle), dropped);
+	printkernel(count);
+	printuser(count);
+	return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * tracecvt - convert a kernel event trace to a timeline.
+ *
+ * Usage: tracecvt tracefile > trace.json
+ *
+ * Reads a file written by the kernel menu command "tr save" (the
+ * format is in <kern/trace.h>) and writes it out in the Trace Event
+ * Format that chrome://tracing and Perfetto load. Each cpu is a row.
+ * What thread was running is shown as slices named by thread address;
+ * syscalls and interrupts nest inside them; faults, wakeups and
+ * migrations are instant markers.
+ *
+ * This runs on the host. The file is in the kernel's byte order.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+
+#include <netinet/in.h> // for arpa/inet.h
+#include <arpa/inet.h>  // for ntohl
+
+#include "kern/trace.h"
+
+#define SWAPL(x) ntohl(x)
+#define SWAPS(x) ntohs(x)
+#define SWAPLL(x) (((uint64_t)ntohl((uint32_t)(x)) << 32) | ntohl((x) >> 32))
+
+struct cpu {
+	uint32_t cpu_number;
+	uint32_t cpu_nevents;
+	uint32_t cpu_lost;
+	struct trace_event *cpu_events;	/* already byte-swapped */
+};
+
+static struct trace_filehdr hdr;
+static struct cpu *cpus;
+static int first = 1;
+
+static
+void
+readall(FILE *f, void *buf, size_t len, const char *what)
+{
+	if (fread(buf, 1, len, f) != len) {
+		errx(1, "Trace file truncated reading %s", what);
+	}
+}
+
+static
+void
+readtrace(const char *path)
+{
+	FILE *f;
+	struct trace_cpuhdr tc;
+	struct trace_event *te;
+	uint32_t i, j;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		err(1, "%s", path);
+	}
+	readall(f, &hdr, sizeof(hdr), "header");
+	hdr.th_magic = SWAPL(hdr.th_magic);
+	hdr.th_version = SWAPL(hdr.th_version);
+	hdr.th_ncpus = SWAPL(hdr.th_ncpus);
+	if (hdr.th_magic != TRACE_MAGIC) {
+		errx(1, "%s: Not a trace file", path);
+	}
+	if (hdr.th_version != TRACE_VERSION) {
+		errx(1, "%s: Trace version %u; I only know %u", path,
+		     hdr.th_version, TRACE_VERSION);
+	}
+
+	cpus = calloc(hdr.th_ncpus, sizeof(*cpus));
+	if (cpus == NULL) {
+		err(1, "malloc");
+	}
+	for (i=0; i<hdr.th_ncpus; i++) {
+		readall(f, &tc, sizeof(tc), "cpu header");
+		cpus[i].cpu_number = SWAPL(tc.tc_cpu);
+		cpus[i].cpu_nevents = SWAPL(tc.tc_nevents);
+		cpus[i].cpu_lost = SWAPL(tc.tc_lost);
+		cpus[i].cpu_events = malloc(cpus[i].cpu_nevents *
+					    sizeof(struct trace_event));
+		if (cpus[i].cpu_events == NULL && cpus[i].cpu_nevents > 0) {
+			err(1, "malloc");
+		}
+		readall(f, cpus[i].cpu_events,
+			cpus[i].cpu_nevents * sizeof(struct trace_event),
+			"events");
+		for (j=0; j<cpus[i].cpu_nevents; j++) {
+			te = &cpus[i].cpu_events[j];
+			te->te_time = SWAPLL(te->te_time);
+			te->te_type = SWAPS(te->te_type);
+			te->te_info = SWAPS(te->te_info);
+			te->te_a = SWAPL(te->te_a);
+			te->te_b = SWAPL(te->te_b);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * The earliest first event of any cpu.
+ */
+static
+uint64_t
+findstart(void)
+{
+	uint64_t start = 0;
+	uint32_t i;
+	int found = 0;
+
+	for (i=0; i<hdr.th_ncpus; i++) {
+		if (cpus[i].cpu_nevents == 0) {
+			continue;
+		}
+		if (!found ||
+		    cpus[i].cpu_events[0].te_time < start) {
+			start = cpus[i].cpu_events[0].te_time;
+			found = 1;
+		}
+	}
+	return start;
+}
+
+/* Nanoseconds to microseconds. */
+static
+double
+usecs(uint64_t nsecs)
+{
+	return nsecs / 1000.0;
+}
+
+/*
+ * Print one event. PH is the phase: B(egin), E(nd), X (complete,
+ * with DUR), or i(nstant). ARGS, if not NULL, is a JSON object body.
+ */
+static
+void
+emit(const char *name, char ph, uint32_t cpu, uint64_t time, uint64_t dur,
+     const char *args)
+{
+	printf("%s\n  {\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 0, "
+	       "\"tid\": %u, \"ts\": %.3f",
+	       first ? "" : ",", name, ph, cpu, usecs(time));
+	if (ph == 'X') {
+		printf(", \"dur\": %.3f", usecs(dur));
+	}
+	if (ph == 'i') {
+		printf(", \"s\": \"t\"");
+	}
+	if (args != NULL) {
+		printf(", \"args\": {%s}", args);
+	}
+	printf("}");
+	first = 0;
+}
+
+static const char *const statenames[] = {
+	"run", "ready", "sleep", "zombie",
+};
+
+static
+void
+convertcpu(struct cpu *c, uint64_t start)
+{
+	struct trace_event *te;
+	uint64_t now, slicestart;
+	uint32_t i, running;
+	char name[64], args[128];
+
+	if (c->cpu_nevents == 0) {
+		return;
+	}
+
+	running = 0;
+	slicestart = c->cpu_events[0].te_time - start;
+
+	for (i=0; i<c->cpu_nevents; i++) {
+		te = &c->cpu_events[i];
+		now = te->te_time - start;
+
+		switch (te->te_type) {
+		    case TRACE_SWITCH:
+			/* Until the first switch we don't know who ran. */
+			if (running == 0) {
+				running = te->te_a;
+			}
+			snprintf(name, sizeof(name), "thread 0x%x", running);
+			snprintf(args, sizeof(args), "\"then\": \"%s\"",
+				 te->te_info < 4 ?
+				 statenames[te->te_info] : "?");
+			emit(name, 'X', c->cpu_number, slicestart,
+			     now - slicestart, args);
+			running = te->te_b;
+			slicestart = now;
+			break;
+		    case TRACE_WAKEUP:
+			snprintf(args, sizeof(args),
+				 "\"thread\": \"0x%x\", \"cpu\": %u",
+				 te->te_a, te->te_info);
+			emit("wakeup", 'i', c->cpu_number, now, 0, args);
+			break;
+		    case TRACE_MIGRATE:
+			snprintf(args, sizeof(args),
+				 "\"thread\": \"0x%x\", \"from\": %u, "
+				 "\"to\": %u", te->te_a, te->te_info, te->te_b);
+			emit("migrate", 'i', c->cpu_number, now, 0, args);
+			break;
+		    case TRACE_SYSCALL:
+			snprintf(name, sizeof(name), "syscall %u",
+				 te->te_info);
+			emit(name, 'B', c->cpu_number, now, 0, NULL);
+			break;
+		    case TRACE_SYSRET:
+			snprintf(name, sizeof(name), "syscall %u",
+				 te->te_info);
+			snprintf(args, sizeof(args), "\"error\": %u",
+				 te->te_b);
+			emit(name, 'E', c->cpu_number, now, 0, args);
+			break;
+		    case TRACE_FAULT:
+			snprintf(args, sizeof(args),
+				 "\"code\": %u, \"vaddr\": \"0x%x\", "
+				 "\"epc\": \"0x%x\"",
+				 te->te_info, te->te_a, te->te_b);
+			emit("fault", 'i', c->cpu_number, now, 0, args);
+			break;
+		    case TRACE_IRQ:
+			snprintf(args, sizeof(args),
+				 "\"cause\": \"0x%x\", \"epc\": \"0x%x\"",
+				 te->te_a, te->te_b);
+			emit("irq", 'B', c->cpu_number, now, 0, args);
+			break;
+		    case TRACE_IRQDONE:
+			emit("irq", 'E', c->cpu_number, now, 0, NULL);
+			break;
+		    default:
+			warnx("cpu %u: unknown event type %u", c->cpu_number,
+			      te->te_type);
+			break;
+		}
+	}
+
+	if (running != 0) {
+		snprintf(name, sizeof(name), "thread 0x%x", running);
+		emit(name, 'X', c->cpu_number, slicestart, now - slicestart,
+		     NULL);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t start;
+	uint32_t i;
+	char args[64];
+
+	if (argc != 2) {
+		errx(1, "Usage: tracecvt tracefile > trace.json");
+	}
+	readtrace(argv[1]);
+	start = findstart();
+
+	printf("[");
+	for (i=0; i<hdr.th_ncpus; i++) {
+		snprintf(args, sizeof(args), "\"name\": \"cpu %u\"",
+			 cpus[i].cpu_number);
+		printf("%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", "
+		       "\"pid\": 0, \"tid\": %u, \"args\": {%s}}",
+		       first ? "" : ",", cpus[i].cpu_number, args);
+		first = 0;
+		if (cpus[i].cpu_lost > 0) {
+			warnx("cpu %u: %u earlier events were overwritten",
+			      cpus[i].cpu_number, cpus[i].cpu_lost);
+		}
+	}
+	for (i=0; i<hdr.th_ncpus; i++) {
+		convertcpu(&cpus[i], start);
+	}
+	printf("\n]\n");
+	return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * futextest - test futex_wait and futex_wake.
+ *
+ * Several threads add to a shared counter, holding a mutex built out
+ * of a futex: an atomic compare-and-swap when the lock is free, and
+ * futex_wait/futex_wake only when there's contention. If the mutex
+ * works, no increments are lost. We also count how often the slow
+ * path was taken, to show the fast path doing most of the work.
+ *
+ * Needs thread_create and thread_join.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NTHREADS	6
+#define NLOOPS		20000
+
+/* Mutex states. */
+#define UNLOCKED	0
+#define LOCKED		1	/* held, nobody waiting */
+#define CONTENDED	2	/* held, maybe someone waiting */
+
+static volatile int mutex = UNLOCKED;
+static volatile int counter;
+static volatile int nwaits, nwakes;	/* only changed holding mutex */
+
+/*
+ * Store NEWVAL at *P if it holds OLDVAL. Returns the old value either
+ * way.
+ */
+static
+int
+cas(volatile int *p, int oldval, int newval)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   give up if x != oldval */
+		"move %1, %4;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   retry if it failed */
+		"2:;"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (oldval), "r" (newval) : "memory");
+	return x;
+}
+
+/* Store NEWVAL at *P and return what was there. */
+static
+int
+swap(volatile int *p, int newval)
+{
+	int c;
+
+	do {
+		c = *p;
+	} while (cas(p, c, newval) != c);
+	return c;
+}
+
+/*
+ * The fast path is one compare-and-swap. Otherwise mark the mutex
+ * contended, so the holder knows to wake us, and sleep until we're
+ * the one to take it from UNLOCKED.
+ */
+static
+void
+mutex_lock(void)
+{
+	int c;
+
+	c = cas(&mutex, UNLOCKED, LOCKED);
+	if (c == UNLOCKED) {
+		return;
+	}
+	if (c != CONTENDED) {
+		c = swap(&mutex, CONTENDED);
+	}
+	while (c != UNLOCKED) {
+		if (futex_wait(&mutex, CONTENDED) < 0 && errno != EAGAIN) {
+			err(1, "futex_wait");
+		}
+		c = swap(&mutex, CONTENDED);
+	}
+	nwaits++;
+}
+
+static
+void
+mutex_unlock(void)
+{
+	/* Only make a system call if someone might be waiting. */
+	if (swap(&mutex, UNLOCKED) == CONTENDED) {
+		if (futex_wake(&mutex, 1) < 0) {
+			err(1, "futex_wake");
+		}
+		/* Not holding the lock, but it's only a statistic. */
+		nwakes++;
+	}
+}
+
+static
+void *
+adder(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i=0; i<NLOOPS; i++) {
+		mutex_lock();
+		counter++;
+		mutex_unlock();
+	}
+	return NULL;
+}
+
+static
+void
+checkerrors(void)
+{
+	int x = 0;
+
+	/* Wrong value: should come straight back. */
+	if (futex_wait(&x, 1) >= 0 || errno != EAGAIN) {
+		errx(1, "futex_wait on a changed value didn't fail with "
+		     "EAGAIN");
+	}
+	/* Misaligned. */
+	if (futex_wait((int *)((char *)&x + 1), 0) >= 0 || errno != EINVAL) {
+		errx(1, "futex_wait on a misaligned address didn't fail "
+		     "with EINVAL");
+	}
+	/* Nobody waiting. */
+	if (futex_wake(&x, 1) != 0) {
+		errx(1, "futex_wake with no waiters woke someone");
+	}
+}
+
+int
+main(void)
+{
+	int tids[NTHREADS];
+	int i;
+
+	checkerrors();
+
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(adder, NULL);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+
+	printf("counter %d (expected %d), %d slow locks, %d wakes\n",
+	       counter, NTHREADS * NLOOPS, nwaits, nwakes);
+	if (counter != NTHREADS * NLOOPS) {
+		errx(1, "FAILED: lost increments");
+	}
+	printf("futextest done.\n");
+	return 0;
+}
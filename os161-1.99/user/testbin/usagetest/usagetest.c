@@ -0,0 +1,168 @@
+/*
+ * usagetest - test getrusage.
+ *
+ * Spin in user mode, make system calls, and touch a lot of memory,
+ * checking after each that the matching part of our resource usage
+ * went up. Then start a second thread that sleeps in futex_wait until
+ * we wake it, and check that its voluntary context switches count
+ * for the process, both while it's alive and after it has exited and
+ * been joined. Finally check that a bad "who" is refused.
+ *
+ * Needs thread_create, thread_join and the futex calls.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define NPAGES		64
+#define PAGESIZE	4096
+#define NSPINS		2000000
+#define NCALLS		2000
+
+static char pages[NPAGES * PAGESIZE];
+static volatile unsigned sink;
+
+/* For the sleeper: set once it has started, to wake it, and when done. */
+static volatile int started, wakeup, done;
+
+static
+void
+getusage(struct rusage *ru)
+{
+	if (getrusage(RUSAGE_SELF, ru) < 0) {
+		err(1, "getrusage");
+	}
+}
+
+/* Microseconds in TV. */
+static
+unsigned long long
+usec(const struct timeval *tv)
+{
+	return (unsigned long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static
+void
+show(const char *msg, const struct rusage *ru)
+{
+	printf("%-8s user %llu us, sys %llu us, %llu faults, "
+	       "%llu/%llu switches\n", msg,
+	       usec(&ru->ru_utime), usec(&ru->ru_stime),
+	       (unsigned long long)ru->ru_minflt,
+	       (unsigned long long)ru->ru_nvcsw,
+	       (unsigned long long)ru->ru_nivcsw);
+}
+
+/*
+ * Sleep until main sets wakeup. Each futex_wait that sleeps is a
+ * voluntary context switch.
+ */
+static
+void *
+sleeper(void *arg)
+{
+	(void)arg;
+	started = 1;
+	while (wakeup == 0) {
+		if (futex_wait(&wakeup, 0) < 0 && errno != EAGAIN) {
+			err(1, "futex_wait");
+		}
+	}
+	done = 1;
+	return NULL;
+}
+
+int
+main(void)
+{
+	struct rusage before, during, after;
+	unsigned i;
+	int tid, bad = 0;
+
+	getusage(&before);
+	show("start", &before);
+
+	for (i=0; i<NSPINS; i++) {
+		sink += i;
+	}
+	getusage(&after);
+	show("spin", &after);
+	if (usec(&after.ru_utime) <= usec(&before.ru_utime)) {
+		warnx("user time didn't go up");
+		bad = 1;
+	}
+
+	before = after;
+	for (i=0; i<NCALLS; i++) {
+		getpid();
+	}
+	getusage(&after);
+	show("syscall", &after);
+	if (usec(&after.ru_stime) <= usec(&before.ru_stime)) {
+		warnx("system time didn't go up");
+		bad = 1;
+	}
+
+	before = after;
+	for (i=0; i<NPAGES; i++) {
+		pages[i * PAGESIZE] = i;
+	}
+	getusage(&after);
+	show("touch", &after);
+	if (after.ru_minflt <= before.ru_minflt) {
+		warnx("fault count didn't go up");
+		bad = 1;
+	}
+
+	/*
+	 * Give the sleeper plenty of time to get into futex_wait
+	 * before waking it. Until we join it, this thread only spins
+	 * and makes calls that don't normally sleep (no printing), so the
+	 * voluntary switches in between are all the sleeper's.
+	 */
+	getusage(&before);
+	tid = thread_create(sleeper, NULL);
+	if (tid < 0) {
+		err(1, "thread_create");
+	}
+	while (started == 0) {
+		/* spin */
+	}
+	for (i=0; i<NSPINS; i++) {
+		sink += i;
+	}
+	wakeup = 1;
+	if (futex_wake(&wakeup, 1) < 0) {
+		err(1, "futex_wake");
+	}
+	while (done == 0) {
+		/* spin */
+	}
+	getusage(&during);
+	if (thread_join(tid, NULL) < 0) {
+		err(1, "thread_join");
+	}
+	getusage(&after);
+	show("sleeper", &during);
+	show("joined", &after);
+	if (during.ru_nvcsw <= before.ru_nvcsw) {
+		warnx("the sleeper's voluntary switches weren't counted");
+		bad = 1;
+	}
+	if (after.ru_nvcsw < during.ru_nvcsw) {
+		warnx("the sleeper's switches were lost when it exited");
+		bad = 1;
+	}
+
+	if (getrusage(12345, &after) != -1 || errno != EINVAL) {
+		warnx("getrusage with a bad who didn't fail with EINVAL");
+		bad = 1;
+	}
+
+	printf("usagetest: %s\n", bad ? "FAILED" : "passed");
+	return bad;
+}
@@ -29,20 +29,13 @@
 
 /*
  * Test multiple user level threads inside a process. The program
- * forks 3 threads off 2 to functions, each of which displays a string
- * every once in a while.
+ * starts 3 threads running 2 functions, each of which displays a
+ * string every once in a while, then waits for them all with
+ * thread_join.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Returning from main exits the whole process, so the parent has to
+ * join its threads before it leaves. Each thread returns the number
+ * of times it printed, which comes back through thread_join.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +44,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,22 +55,34 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+void *ThreadRunner(void *);
+void *BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
     int i;
+    int tids[NTHREADS];
+    void *value;
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+	if (tids[i] < 0) {
+	    err(1, "thread_create");
+	}
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], &value) < 0) {
+	    err(1, "thread_join %d", tids[i]);
+	}
+	printf("\nThread %d printed %d times\n", tids[i], (int)value);
     }
 
     printf("Parent has left.\n");
@@ -88,23 +94,34 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+void *
+BladeRunner(void *arg)
 {
+    int printed = 0;
+
+    (void)arg;
     while (count < MAX) {
-	if (count % 500 == 0)
+	if (count % 500 == 0) {
 	    printf("Blade ");
+	    printed++;
+	}
 	count++;
     }
+    return (void *)printed;
 }
 
-void
-ThreadRunner()
+void *
+ThreadRunner(void *arg)
 {
+    int printed = 0;
+
+    (void)arg;
     while (count < MAX) {
-	if (count % 513 == 0)
+	if (count % 513 == 0) {
 	    printf(" Runner\n");
+	    printed++;
+	}
 	count++;
     }
+    return (void *)printed;
 }
-    